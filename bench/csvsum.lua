@@ -0,0 +1,23 @@
+-- Summing columns of numeric fields held as strings, like a CSV report where
+-- the same values recur across many rows.
+
+local n = tonumber((arg and arg[1]) or 300000)
+
+local fields = {}
+for i = 1, 500 do
+  fields[i] = tostring(i * 1.25) -- distinct, reused across rows
+end
+fields[501] = "  42 "
+fields[502] = "0x1F"
+fields[503] = "-3.5e2"
+
+local sum, count = 0, 0
+for i = 1, n do
+  local f = fields[(i * 7) % 503 + 1]
+  sum = sum + f
+  if tonumber(f) > 100 then
+    count = count + 1
+  end
+end
+
+print(sum, count)
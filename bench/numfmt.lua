@@ -0,0 +1,21 @@
+-- Number to string conversion, as in generating a numeric report: integer
+-- keys concatenated into names, and fractional values written out as text.
+
+local n = tonumber((arg and arg[1]) or 200000)
+
+local keys = {}
+local total = 0
+for i = 1, n do
+  local key = "row" .. i .. ":" .. (i * 0.25) .. "/" .. (i / 7)
+  keys[i % 64] = key
+  total = total + #key
+end
+
+local parts = {}
+for i = 1, n / 10 do
+  parts[#parts + 1] = tostring(i * 1.1) .. "," .. tostring(-i / 3)
+end
+
+print(total, #table.concat(parts, ";"))
+print(keys[1], keys[63])
+print(1e100, -1e-5, 0.1, 1/3, 2^53, 123456789012345, 3.14159265358979)
@@ -0,0 +1,18 @@
+-- Calls and returns which keep crossing the size at which the lua stack used
+-- to be reallocated
+
+local function fib(n)
+  if n < 2 then return n end
+  return fib(n - 1) + fib(n - 2)
+end
+
+local function at_depth(d, n)
+  if d == 0 then return fib(n) end
+  return (at_depth(d - 1, n))
+end
+
+local sum = 0
+for d = 300, 900, 5 do
+  for i = 1, 10 do sum = sum + at_depth(d, 14) end
+end
+io.write(sum, "\n")
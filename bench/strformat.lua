@@ -0,0 +1,16 @@
+-- Log and report lines built with string.format from a few fixed formats.
+
+local n = tonumber((arg and arg[1]) or 100000)
+
+local total = 0
+local last
+for i = 1, n do
+  local line = string.format("[%5d] %-8s value=%.2f hex=%x (%d%%)",
+                             i, "item", i * 0.37, i, i % 100)
+  local row = string.format("%s,%d,%5.2f", "name", i, i / 3)
+  total = total + #line + #row
+  last = line .. "|" .. row
+end
+
+print(total)
+print(last)
@@ -0,0 +1,42 @@
+-- Interning throughput for short strings which only differ in a few bytes,
+-- like request lines sharing a common prefix. Every key is 40 bytes, which
+-- is as long as a string gets and still be interned.
+
+local n = tonumber((arg and arg[1]) or 6000)
+local rounds = tonumber((arg and arg[2]) or 4)
+
+local prefix, suffix = "GET /api/v1/items?id=", " HTTP/1"
+local keys = {}
+local count = 0
+
+for r = 1, rounds do
+  for i = 1, n do
+    -- the tag's digits only land on even positions, between dots
+    local tag = string.gsub(tostring(100000 + i), "%d", "%0.")
+    local key = prefix .. tag .. suffix
+    if keys[key] == nil then
+      keys[key] = i
+      count = count + 1
+    end
+  end
+end
+
+-- Strings used to be interned with a hash which only read every
+-- (size >> 5) + 1-th byte, so keys agreeing on those bytes always collided.
+-- Count how many distinct hashes that sampler could have given these keys.
+local function sampled(s)
+  local step = math.floor(#s / 32) + 1
+  local bytes = {}
+  for i = 1, #s, step do bytes[#bytes + 1] = string.sub(s, i, i) end
+  return table.concat(bytes)
+end
+local chains, nchains = {}, 0
+for key in pairs(keys) do
+  local sig = sampled(key)
+  if chains[sig] == nil then
+    chains[sig] = true
+    nchains = nchains + 1
+  end
+end
+
+print(count, #(prefix .. "1.0.0.0.0.1." .. suffix), nchains)
@@ -0,0 +1,28 @@
+-- A tokenizer-style scan over a large string, one character at a time, with
+-- short substrings pulled out for each word.
+
+local n = tonumber((arg and arg[1]) or 40000)
+
+local text = string.rep("local x1 = foo(bar, 42) + baz[7] -- note\n", n)
+local counts = {}
+local words = 0
+local i, len = 1, #text
+while i <= len do
+  local c = string.sub(text, i, i)
+  counts[c] = (counts[c] or 0) + 1
+  if c >= "a" and c <= "z" then
+    local j = i
+    while string.sub(text, j + 1, j + 1) >= "a" and
+          string.sub(text, j + 1, j + 1) <= "z" do
+      j = j + 1
+    end
+    local word = string.sub(text, i, j)
+    counts[word] = (counts[word] or 0) + 1
+    words = words + 1
+    i = j + 1
+  else
+    i = i + 1
+  end
+end
+
+print(len, words, counts["l"], counts["local"], counts[" "], counts["\n"])
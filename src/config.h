@@ -33,11 +33,25 @@ typedef int64_t   i64;
 #define INIT_HEAP_SIZE    (128 * 1024)
 #define LUAV_INIT_STRING  10
 #define LUA_NUMBER_FMT    "%.14g"
+#define LUA_NUMBER_SIZE   32
 #define LFIELDS_PER_FLUSH 50
 
+/* Dispatch instructions in the interpreter with computed gotos */
+#define VM_COMPUTED_GOTO TRUE
+
+/* Rewrite instructions in place into versions specialized for the operand
+   types they keep seeing, falling back to the generic version on a mismatch */
+#define VM_QUICKENING      TRUE
+#define QUICKEN_COUNT      2   // runs of an instruction before specializing it
+#define QUICKEN_MAX_DEOPTS 4   // failed specializations before giving up
+
 #define JIT_ON           TRUE
 #define JIT_CACHE_TABLE  (TRUE && JIT_ON)
 #define JIT_FULL_COMPILE (TRUE && JIT_ON)
 #define JIT_FULL_RUN     (TRUE && JIT_FULL_COMPILE)
+/* Compile with few optimizations first, and fully once code stays hot */
+#define JIT_TIERED       (TRUE && JIT_ON)
+/* Compile on a background thread while the interpreter keeps running */
+#define JIT_ASYNC        (TRUE && JIT_ON)
 
 #endif /* _CONFIG_H_ */
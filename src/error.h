@@ -4,6 +4,7 @@
 #include <setjmp.h>
 
 #include "config.h"
+#include "lbuf.h"
 #include "luav.h"
 
 #define ERRBUF_SIZE 200
@@ -11,6 +12,7 @@
 #define ONERR(try, catch, errvar) {             \
     jmp_buf onerr;                              \
     jmp_buf *prev = err_catcher;                \
+    u32 bufs = lbuf_open.depth;                 \
     static struct lthread *env;                 \
     err_catcher = &onerr;                       \
     env = coroutine_current();                  \
@@ -21,6 +23,7 @@
       if (env != coroutine_current()) {         \
         coroutine_changeenv(env);               \
       }                                         \
+      lbuf_unwind(bufs);                        \
       { catch }                                 \
       errvar = 1;                               \
     }                                           \
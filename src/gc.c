@@ -160,6 +160,17 @@ void garbage_collect() {
         case LTHREAD:
           coroutine_free((lthread_t*) (tmp + 1));
           break;
+        case LUPVALUE: {
+          /* Open upvalues are still on their stack's list, and are only
+             released once the stack has closed them */
+          lupvalue_t *up = (lupvalue_t*) (tmp + 1);
+          if (up->v != &up->value) {
+            tmp->bits = GC_BUILD(gc_head, GC_TYPE(tmp));
+            gc_head = tmp;
+            continue;
+          }
+          break;
+        }
         case LJFUNC: {
           jfunc_t *f = (jfunc_t*) (tmp + 1);
           if (f->ref_count == 0) {
@@ -294,8 +305,8 @@ void gc_traverse_pointer(void *_ptr, int type) {
 
     /* Keep around the upvalue, and travel through */
     case LUPVALUE: {
-      luav *ptr = _ptr;
-      gc_traverse(*ptr);
+      lupvalue_t *up = _ptr;
+      gc_traverse(*up->v);
       break;
     }
 
@@ -309,6 +320,7 @@ void gc_traverse_pointer(void *_ptr, int type) {
       GC_SETBLACK(func->instrs);
       GC_SETBLACK(func->trace.instrs);
       GC_SETBLACK(func->trace.misc);
+      GC_SETBLACK(func->icache);
       if (func->funcs != NULL) GC_SETBLACK(func->funcs);
       if (func->jfunc != NULL) GC_SETBLACK(func->jfunc);
       u32 i;
@@ -0,0 +1,242 @@
+/**
+ * @file lbuf.c
+ * @brief Implementation of buffers for building up lua strings
+ *
+ * A buffer accumulates the contents of a string in a scratch area, and then
+ * creates exactly one lstring_t of the right size when it's finished. Short
+ * strings never leave the inline storage in the buffer itself. Longer ones
+ * move to a malloc'd area which grows with realloc, and is handed on to the
+ * next buffer when this one is done, so repeated large builds don't need to
+ * allocate at all.
+ *
+ * None of the scratch memory is managed by the garbage collector, so it is
+ * safe to call back into lua (and hence collect garbage) while a buffer is
+ * open. Every open buffer has a slot in lbuf_open, a malloc'd stack which
+ * records its scratch area, so that if an error unwinds past the buffer
+ * lbuf_unwind() can release that area from the slot alone. The buffers
+ * themselves are in C frames which the error has jumped out of, so they are
+ * never looked at again. Each coroutine has its own stack of slots, which is
+ * swapped in and out of lbuf_open along with the rest of its state.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lbuf.h"
+#include "lstring.h"
+#include "luav.h"
+#include "util.h"
+
+lbuf_stack_t lbuf_open;     //<! Open buffers of the running coroutine
+static char *spare;         //<! Scratch area left over from a finished buffer
+static size_t spare_cap;    //<! Capacity of the spare scratch area
+
+DESTROY static void lbuf_destroy() {
+  free(spare);
+  spare = NULL;
+  free(lbuf_open.slots);
+  lbuf_open.slots = NULL;
+}
+
+/**
+ * @brief Initialize a buffer to be empty, ready to be appended to
+ *
+ * Every buffer which is initialized must either be finished with
+ * lbuf_finish() or released by lbuf_unwind() if an error occurs.
+ *
+ * @param buf the buffer to initialize
+ */
+void lbuf_init(lbuf_t *buf) {
+  if (lbuf_open.depth == lbuf_open.size) {
+    lbuf_open.size  = MAX(lbuf_open.size * 2, 8);
+    lbuf_open.slots = xrealloc(lbuf_open.slots,
+                               lbuf_open.size * sizeof(lbuf_slot_t));
+  }
+  lbuf_slot_t *slot = &lbuf_open.slots[lbuf_open.depth];
+  slot->data     = NULL;
+  slot->capacity = 0;
+  slot->unwind   = NULL;
+  slot->open     = TRUE;
+  buf->slot      = lbuf_open.depth++;
+  buf->data      = buf->init;
+  buf->length    = 0;
+  buf->capacity  = LBUF_INIT;
+}
+
+/**
+ * @brief Ensure that there is room for some more bytes in the buffer
+ *
+ * The returned pointer is where the next bytes should be written. After
+ * writing them, lbuf_advance() should be called with the number of bytes
+ * actually used.
+ *
+ * @param buf the buffer to grow
+ * @param size the number of bytes which will be appended
+ * @return the location to write the new bytes to
+ */
+char *lbuf_reserve(lbuf_t *buf, size_t size) {
+  if (buf->length + size <= buf->capacity) {
+    return buf->data + buf->length;
+  }
+
+  size_t cap = MAX(buf->capacity * 2, buf->length + size);
+  if (buf->data != buf->init) {
+    buf->data = xrealloc(buf->data, cap);
+  } else {
+    if (spare != NULL && spare_cap >= cap) {
+      buf->data = spare;
+      cap = spare_cap;
+      spare = NULL;
+    } else {
+      buf->data = xmalloc(cap);
+    }
+    memcpy(buf->data, buf->init, buf->length);
+  }
+  buf->capacity = cap;
+  lbuf_open.slots[buf->slot].data     = buf->data;
+  lbuf_open.slots[buf->slot].capacity = cap;
+  return buf->data + buf->length;
+}
+
+/**
+ * @brief Append some bytes to a buffer
+ *
+ * @param buf the buffer to append to
+ * @param mem the bytes to append
+ * @param size the number of bytes to append
+ */
+void lbuf_addmem(lbuf_t *buf, const char *mem, size_t size) {
+  memcpy(lbuf_reserve(buf, size), mem, size);
+  buf->length += size;
+}
+
+/**
+ * @brief Append the string form of a number to a buffer
+ *
+ * @param buf the buffer to append to
+ * @param num the number to format
+ */
+void lbuf_addnum(lbuf_t *buf, double num) {
+  buf->length += lv_fmtnum(lbuf_reserve(buf, LUA_NUMBER_SIZE), num);
+}
+
+/**
+ * @brief Append formatted output to a buffer, like sprintf()
+ *
+ * @param buf the buffer to append to
+ * @param fmt the printf-style format string
+ */
+void lbuf_printf(lbuf_t *buf, const char *fmt, ...) {
+  va_list args, copy;
+  va_start(args, fmt);
+  va_copy(copy, args);
+  size_t avail = buf->capacity - buf->length;
+  int len = vsnprintf(buf->data + buf->length, avail, fmt, args);
+  assert(len >= 0);
+  if ((size_t) len >= avail) {
+    /* Didn't fit, so grow the buffer and try again */
+    char *dst = lbuf_reserve(buf, (size_t) len + 1);
+    vsnprintf(dst, (size_t) len + 1, fmt, copy);
+  }
+  va_end(copy);
+  va_end(args);
+  buf->length += (size_t) len;
+}
+
+/**
+ * @brief Give up the scratch area recorded in a buffer's slot
+ */
+static void lbuf_free(lbuf_slot_t *slot) {
+  if (slot->data == NULL) {
+    return;
+  }
+  if (slot->capacity <= LBUF_SPARE_MAX && slot->capacity > spare_cap) {
+    free(spare);
+    spare = slot->data;
+    spare_cap = slot->capacity;
+  } else {
+    free(slot->data);
+  }
+  slot->data = NULL;
+}
+
+/**
+ * @brief Give up the scratch area of a buffer, and close its slot
+ *
+ * Buffers are almost always closed in order, but a library function may
+ * finish them out of order, so a slot below the top is only marked closed,
+ * and popped once everything above it is closed too.
+ *
+ * @param i the index of the buffer's slot in lbuf_open
+ */
+static void lbuf_release(u32 i) {
+  assert(i < lbuf_open.depth && lbuf_open.slots[i].open);
+  lbuf_free(&lbuf_open.slots[i]);
+  lbuf_open.slots[i].open = FALSE;
+  while (lbuf_open.depth > 0 && !lbuf_open.slots[lbuf_open.depth - 1].open) {
+    lbuf_open.depth--;
+  }
+}
+
+/**
+ * @brief Create a lua string from the contents of a buffer
+ *
+ * The buffer is closed, and must be initialized again to be reused.
+ *
+ * @param buf the buffer to finish
+ * @return the canonical string which has the buffer's contents
+ */
+lstring_t *lbuf_finish(lbuf_t *buf) {
+  lstring_t *str = lstr_intern(buf->data, buf->length);
+  lbuf_release(buf->slot);
+  return str;
+}
+
+/**
+ * @brief Release all buffers opened since lbuf_open had some depth
+ *
+ * This is used when an error is caught, because any buffers opened since the
+ * error handler was installed will never be finished. Any other resources
+ * registered with lbuf_onunwind() are given up along with them. Only the
+ * slots are used, as the buffers were in C frames which are now gone.
+ *
+ * @param depth the depth of lbuf_open when the error handler was installed
+ */
+void lbuf_unwind(u32 depth) {
+  while (lbuf_open.depth > depth) {
+    lbuf_slot_t *slot = &lbuf_open.slots[lbuf_open.depth - 1];
+    void (*unwind)(void*) = slot->unwind;
+    void *arg = slot->unwind_arg;
+    lbuf_release(lbuf_open.depth - 1);
+    if (unwind != NULL) {
+      unwind(arg);
+    }
+  }
+}
+
+/**
+ * @brief Release every buffer of a coroutine which isn't running
+ *
+ * This is used when a coroutine is freed while it still had buffers open,
+ * for example because an error was raised through it.
+ *
+ * @param bufs the open buffers of the coroutine
+ */
+void lbuf_discard(lbuf_stack_t *bufs) {
+  assert(bufs->slots != lbuf_open.slots || bufs->slots == NULL);
+  u32 i;
+  for (i = bufs->depth; i > 0; i--) {
+    lbuf_slot_t *slot = &bufs->slots[i - 1];
+    if (!slot->open) {
+      continue;
+    }
+    lbuf_free(slot);
+    if (slot->unwind != NULL) {
+      slot->unwind(slot->unwind_arg);
+    }
+  }
+  free(bufs->slots);
+  bufs->slots = NULL;
+  bufs->depth = bufs->size = 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file lbuf.h
+ * @brief Headers for buffers which build up lua strings piece by piece
+ */
+
+#ifndef _LBUF_H_
+#define _LBUF_H_
+
+#include <stdarg.h>
+
+#include "config.h"
+#include "lstring.h"
+
+#define LBUF_INIT      256          /* Bytes stored inline in each buffer */
+#define LBUF_SPARE_MAX (1024 * 1024)  /* Largest scratch area kept for reuse */
+
+/* A string under construction */
+typedef struct lbuf {
+  char   *data;           //<! Contents of the buffer, not null-terminated
+  size_t length;          //<! Number of bytes currently in the buffer
+  size_t capacity;        //<! Number of bytes data can hold
+  u32    slot;            //<! Index of the buffer's slot in lbuf_open
+  char   init[LBUF_INIT]; //<! Inline storage, used until contents outgrow it
+} lbuf_t;
+
+/* What an error needs to release an open buffer. This lives apart from the
+   buffer, which is on a C stack frame that an error may have jumped out of */
+typedef struct lbuf_slot {
+  char   *data;             //<! Malloc'd scratch area, NULL while inline
+  size_t capacity;          //<! Number of bytes data can hold
+  void   (*unwind)(void*);  //<! Called if an error releases the buffer
+  void   *unwind_arg;       //<! Argument to pass to unwind
+  int    open;              //<! Whether the buffer is still open
+} lbuf_slot_t;
+
+/* The open buffers of a coroutine, in the order they were opened */
+typedef struct lbuf_stack {
+  lbuf_slot_t *slots;
+  u32 depth;              //<! Number of slots in use
+  u32 size;               //<! Number of slots allocated
+} lbuf_stack_t;
+
+extern lbuf_stack_t lbuf_open;
+
+void       lbuf_init(lbuf_t *buf);
+char      *lbuf_reserve(lbuf_t *buf, size_t size);
+void       lbuf_addmem(lbuf_t *buf, const char *mem, size_t size);
+void       lbuf_addnum(lbuf_t *buf, double num);
+void       lbuf_printf(lbuf_t *buf, const char *fmt, ...)
+                       __attribute__((format(printf, 2, 3)));
+lstring_t *lbuf_finish(lbuf_t *buf);
+void       lbuf_unwind(u32 depth);
+void       lbuf_discard(lbuf_stack_t *bufs);
+
+#define lbuf_addstr(buf, str) lbuf_addmem(buf, (str)->data, (str)->length)
+#define lbuf_advance(buf, n) ((buf)->length += (n))
+#define lbuf_onunwind(buf, f, arg)                    \
+  (lbuf_open.slots[(buf)->slot].unwind = (f),         \
+   lbuf_open.slots[(buf)->slot].unwind_arg = (arg))
+
+static inline void lbuf_addchar(lbuf_t *buf, char c) {
+  if (buf->length == buf->capacity) {
+    lbuf_reserve(buf, 1);
+  }
+  buf->data[buf->length++] = c;
+}
+
+#endif /* _LBUF_H_ */
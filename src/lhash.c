@@ -132,6 +132,27 @@ luav lhash_get(lhash_t *map, luav key) {
   return map->table[index].value;
 }
 
+/**
+ * @brief Find which slot of the hash portion of a table holds a key
+ *
+ * A key stays in its slot until the table portion is resized or the slot is
+ * reused for another key after the key's removal, so a slot can be cached
+ * and validated later by checking that it still holds the same key.
+ *
+ * @param map the table to search
+ * @param key the key to look for
+ * @param slot filled in with the index into map->table holding the key
+ * @return TRUE if the key has a non-nil value in the hash portion
+ */
+int lhash_slot(lhash_t *map, luav key, u32 *slot) {
+  i32 index;
+  if (!lhash_index(map, key, &index)) {
+    return FALSE;
+  }
+  *slot = (u32) index;
+  return TRUE;
+}
+
 /**
  * @brief Set a value in a table for a specified key
  *
@@ -193,7 +214,11 @@ void lhash_set(lhash_t *map, luav key, luav value) {
         lhash_resize(map, LHASH_ARRAY, UPSIZE);
         assert(map->array[index] == LUAV_NIL);
         map->array[index] = value;
-        map->length = (u32) index;
+        /* The resize may have moved higher keys into the array already */
+        if ((u32) index > map->length) {
+          map->length = (u32) index;
+        }
+        map->asize++;
         return;
       }
     }
@@ -310,7 +335,7 @@ static void lhash_resize(lhash_t *map, int which, int direction) {
  */
 static int lhash_index(lhash_t *map, luav key, i32 *index) {
   i32 cap  = (i32) map->tcap;
-  i32 h    = (i32) (lv_hash(key) % map->tcap);
+  i32 h    = (i32) (lv_keyhash(key) % map->tcap);
   i32 step = 0;
   i32 hole = -1;
 
@@ -323,7 +348,7 @@ static int lhash_index(lhash_t *map, luav key, i32 *index) {
     assert(h >= 0);
     struct lh_pair *entry = &map->table[h];
     luav cur = entry->key;
-    if (cur == key) {
+    if (lv_rawequal(cur, key)) {
       *index = h;
       return (entry->value != LUAV_NIL);
     } else if (cur == LUAV_NIL) {
@@ -388,8 +413,8 @@ void lhash_next(lhash_t *map, luav key, luav *nxtkey, luav *nxtval) {
   if (key != LUAV_NIL) {
     /* Find where our key is (taking collisions into account), then increment
        the index to move on to the next cell */
-    h = lv_hash(key) % map->tcap;
-    while (map->table[h].key != key) {
+    h = lv_keyhash(key) % map->tcap;
+    while (!lv_rawequal(map->table[h].key, key)) {
       h = (h + 1) % map->tcap;
     }
     h++;
@@ -442,7 +467,7 @@ double lhash_maxn(lhash_t *map) {
  * @param value the value to insert at the specified position.
  */
 void lhash_insert(lhash_t *map, u32 pos, luav value) {
-  if (pos > map->acap) {
+  if (pos == 0 || pos >= map->acap) {
     lhash_set(map, lv_number(pos), value);
     return;
   }
@@ -456,9 +481,14 @@ void lhash_insert(lhash_t *map, u32 pos, luav value) {
   if (pos <= map->length) {
     memmove(&map->array[pos + 1], &map->array[pos],
             (map->length - pos + 1) * sizeof(luav));
+    map->length++;
+  } else if (value != LUAV_NIL) {
+    map->length = pos;
   }
   map->array[pos] = value;
-  map->length++;
+  if (value != LUAV_NIL) {
+    map->asize++;
+  }
 }
 
 /**
@@ -472,13 +502,17 @@ void lhash_insert(lhash_t *map, u32 pos, luav value) {
  */
 luav lhash_remove(lhash_t *map, u32 pos) {
   assert(map->length < map->acap);
-  if (pos > map->length) {
+  if (pos == 0 || pos > map->length) {
     return LUAV_NIL;
   }
   map->version++;
   luav ret = map->array[pos];
   memmove(&map->array[pos], &map->array[pos + 1],
           (map->length - pos) * sizeof(luav));
+  map->array[map->length] = LUAV_NIL;
+  if (ret != LUAV_NIL) {
+    map->asize--;
+  }
   /* Recalculate the length now */
   map->length--;
   while (map->length > 0 && map->array[map->length] == LUAV_NIL) {
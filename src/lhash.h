@@ -28,7 +28,7 @@ typedef struct lhash {
   } *table;        // hash table, array of key/value pairs
 
   u32  acap;       // array capacity
-  u32  asize;      // array size (# of elements in array)
+  u32  asize;      // array size (# of non-nil elements in array)
   luav *array;     // array part which acts like an array
 
   struct lhash *metatable;   // the metatable for this table
@@ -42,6 +42,7 @@ lhash_t* lhash_hint(u32 arr_size, u32 table_size);
 void lhash_init(lhash_t *map, u32 arr_size, u32 table_size);
 luav lhash_get(lhash_t *map, luav key);
 void lhash_set(lhash_t *map, luav key, luav value);
+int  lhash_slot(lhash_t *map, luav key, u32 *slot);
 
 void   lhash_next(lhash_t *map, luav key, luav *nxtkey, luav *nxtval);
 double lhash_maxn(lhash_t *map);
@@ -8,6 +8,7 @@
 #include "config.h"
 #include "error.h"
 #include "gc.h"
+#include "lbuf.h"
 #include "lhash.h"
 #include "lib/coroutine.h"
 #include "lstate.h"
@@ -134,56 +135,50 @@ static u32 lua_type(LSTATE) {
 }
 
 static u32 lua_tostring(LSTATE) {
-  int len = 20;
-  lstring_t *str = lstr_alloc((size_t) len);
-
   luav v = lstate_getval(0);
+  if (lv_isstring(v)) {
+    lstate_return1(v);
+  } else if (lv_istable(v) || lv_isuserdata(v)) {
+    lhash_t *meta = getmetatable(v);
+    if (meta) {
+      luav value = lhash_get(meta, META_TOSTRING);
+      if (value != LUAV_NIL) {
+        vm_stack->base[argvi] = v;
+        return vm_fun(lv_getfunction(value, 0), 1, argvi, retc, retvi);
+      }
+    }
+  }
+
+  lbuf_t b;
+  lbuf_init(&b);
   switch (lv_gettype(v)) {
     case LNIL:
-      len = sprintf(str->data, "nil");
+      lbuf_addmem(&b, "nil", 3);
       break;
-    case LSTRING:
-      lstate_return1(v);
     case LFUNCTION:
-      len = sprintf(str->data, "function: %p", lv_getfunction(v, 0));
+      lbuf_printf(&b, "function: %p", lv_getfunction(v, 0));
       break;
     case LBOOLEAN:
-      len = sprintf(str->data, lv_getbool(v, 0) ? "true" : "false");
+      lbuf_printf(&b, "%s", lv_getbool(v, 0) ? "true" : "false");
       break;
-    case LNUMBER: {
-      len = snprintf(str->data, (size_t) len, LUA_NUMBER_FMT,
-                     lv_castnumber(v, 0));
+    case LNUMBER:
+      lbuf_addnum(&b, lv_castnumber(v, 0));
       break;
-    }
     case LTHREAD:
-      len = sprintf(str->data, "thread: %p", lv_getthread(v, 0));
+      lbuf_printf(&b, "thread: %p", lv_getthread(v, 0));
+      break;
+    case LTABLE:
+      lbuf_printf(&b, "table: %p", lv_gettable(v, 0));
       break;
-
     case LUSERDATA:
-    case LTABLE: {
-      lhash_t *meta = getmetatable(v);
-      if (meta) {
-        luav value = lhash_get(meta, META_TOSTRING);
-        if (value != LUAV_NIL) {
-          vm_stack->base[argvi] = v;
-          return vm_fun(lv_getfunction(value, 0), 1, argvi, retc, retvi);
-        }
-      }
-      if (lv_gettype(v) == LTABLE) {
-        len = sprintf(str->data, "table: %p", lv_gettable(v, 0));
-      } else {
-        len = sprintf(str->data, "userdata: %p", lv_getuserdata(v, 0));
-      }
+      lbuf_printf(&b, "userdata: %p", lv_getuserdata(v, 0));
       break;
-    }
 
     default:
       panic("Unknown luav: 0x%016" PRIu64, v);
   }
 
-  str->length = (size_t) len;
-  v = lv_string(lstr_add(str));
-  lstate_return1(v);
+  lstate_return1(lv_string(lbuf_finish(&b)));
 }
 
 static u32 lua_print(LSTATE) {
@@ -197,7 +192,11 @@ static u32 lua_print(LSTATE) {
       case LFUNCTION: printf("function: %p", lv_getfunction(value, 0)); break;
       case LUSERDATA: printf("userdata: %p", lv_getuserdata(value, 0)); break;
       case LTHREAD:   printf("thread: %p", lv_getthread(value, 0));     break;
-      case LNUMBER:   printf(LUA_NUMBER_FMT, lv_castnumber(value, 0));  break;
+      case LNUMBER: {
+        char buf[LUA_NUMBER_SIZE];
+        fwrite(buf, 1, lv_fmtnum(buf, lv_cvt(value)), stdout);
+        break;
+      }
       case LBOOLEAN:  printf(lv_getbool(value, 0) ? "true" : "false");  break;
       case LSTRING: {
         lstring_t *str = lv_caststring(value, i);
@@ -328,10 +327,16 @@ static u32 lua_pcall(LSTATE) {
   int err;
   u32 ret;
   lframe_t *cur = vm_running;
+  lcallinfo_t *ci = vm_stack->ci;
+  u32 top = vm_stack->size;
   ONERR({
     ret = vm_fun(closure, argc - 1, argvi + 1, retc - 1, retvi + 1);
     lstate_return(LUAV_TRUE, 0);
   }, {
+    /* the frames which errored never returned, so close their upvalues and
+       release their call infos */
+    vm_stack_close(vm_stack, top);
+    vm_stack_unwind(vm_stack, ci);
     lstate_return(LUAV_FALSE, 0);
     lstate_return(err_value, 1);
   }, err);
@@ -347,12 +352,16 @@ static u32 lua_xpcall(LSTATE) {
   volatile int tried = 0;
   u32 ret;
   lframe_t *running = vm_running;
+  lcallinfo_t *ci = vm_stack->ci;
+  u32 top = vm_stack->size;
 
   ONERR({
     ret = vm_fun(f, 0, 0, retc - 1, retvi + 1);
     lstate_return(LUAV_TRUE, 0);
   }, {
     luav retval;
+    vm_stack_close(vm_stack, top);
+    vm_stack_unwind(vm_stack, ci);
     /* If the error handling function has an error, we need to return something
        different, otherwise invoke the error handling function */
     if (!tried) {
@@ -512,7 +521,7 @@ static u32 lua_setfenv(LSTATE) {
 }
 
 static u32 lua_rawequal(LSTATE) {
-  lstate_return1(lv_bool(lstate_getval(0) == lstate_getval(1)));
+  lstate_return1(lv_bool(lv_rawequal(lstate_getval(0), lstate_getval(1))));
 }
 
 /**
@@ -54,6 +54,7 @@ INIT static void lua_coroutine_init() {
   main_thread->frame         = NULL;
   main_thread->vm_stack.size = 0;
   main_thread->stack         = NULL;
+  memset(&main_thread->bufs, 0, sizeof(lbuf_stack_t));
 
   lua_coroutine = lhash_alloc();
   cfunc_register(lua_coroutine, "create",  lua_co_create);
@@ -82,6 +83,8 @@ void coroutine_changeenv(lthread_t *to) {
   lthread_t *old = cur_thread;
   old->env = global_env;
   old->frame = vm_running;
+  old->bufs = lbuf_open;
+  old->cstack_limit = vm_cstack_limit;
   xassert(to != NULL);
   xassert(to != old);
   xassert(to->status != CO_RUNNING);
@@ -90,6 +93,8 @@ void coroutine_changeenv(lthread_t *to) {
   to->status = CO_RUNNING;
   vm_running = to->frame;
   global_env = to->env;
+  lbuf_open = to->bufs;
+  vm_cstack_limit = to->cstack_limit;
   if (to == main_thread) {
     vm_stack = main_stack;
   } else {
@@ -127,6 +132,9 @@ static u32 lua_co_create(LSTATE) {
   thread->stack  = mmap(NULL, CO_STACK_SIZE, PROT_WRITE | PROT_READ,
                         MAP_ANON | MAP_PRIVATE, -1, 0);
   xassert(thread->stack != MAP_FAILED);
+  /* Compiled code may use the upper half of the stack, the rest is left for
+     compiling and for the C functions called from under it */
+  thread->cstack_limit = (char*) thread->stack + CO_STACK_SIZE / 2;
 
   thread->caller  = NULL;
   thread->closure = function;
@@ -134,6 +142,7 @@ static u32 lua_co_create(LSTATE) {
   thread->env     = cur_thread->env;
   thread->argvi   = 0;
   thread->argc    = 0;
+  memset(&thread->bufs, 0, sizeof(lbuf_stack_t));
   vm_stack_init(&thread->vm_stack, 20);
 
   size_t *stack = (size_t*) ((size_t) thread->stack + CO_STACK_SIZE);
@@ -296,6 +305,7 @@ static u32 lua_co_yield(LSTATE) {
 void coroutine_free(lthread_t *thread) {
   if (thread->stack != NULL) {
     vm_stack_destroy(&thread->vm_stack);
+    lbuf_discard(&thread->bufs);
     xassert(munmap(thread->stack, CO_STACK_SIZE) == 0);
     thread->stack = NULL;
   }
@@ -1,6 +1,7 @@
 #ifndef _LIB_COROUTINE_H
 #define _LIB_COROUTINE_H
 
+#include "lbuf.h"
 #include "lhash.h"
 #include "vm.h"
 
@@ -21,6 +22,8 @@ typedef struct lthread {
   void *curstack;         //<! Last saved c-stack
   lhash_t *env;           //<! Lua environment
   lstack_t vm_stack;      //<! Lua stack
+  lbuf_stack_t bufs;      //<! Open string buffers, while not running
+  char *cstack_limit;     //<! vm_cstack_limit on this thread's C stack
 } lthread_t;
 
 lthread_t* coroutine_current(void);
@@ -10,6 +10,7 @@
 
 #include "error.h"
 #include "gc.h"
+#include "lbuf.h"
 #include "lhash.h"
 #include "lstate.h"
 #include "lstring.h"
@@ -161,21 +162,29 @@ static u32 lua_io_lines_iterator(LSTATE) {
   if (f == NULL) {
     err_rawstr("No more lines to read", TRUE);
   }
-  size_t len = 0;
-  lstring_t *str = lstr_alloc(1024);
+  lbuf_t b;
+  int newline = FALSE;
 
-  while (fgets(str->data + len, (int) (str->length - len), f) != NULL) {
-    len += strlen(str->data + len);
-    if (str->data[len] == '\n') {
+  lbuf_init(&b);
+  while (!newline) {
+    char *dst = lbuf_reserve(&b, LBUF_INIT);
+    if (fgets(dst, LBUF_INIT, f) == NULL) {
       break;
     }
-    lstr_realloc(str, 0);
+    size_t len = strlen(dst);
+    /* The newline isn't part of the returned line */
+    if (len > 0 && dst[len - 1] == '\n') {
+      newline = TRUE;
+      len--;
+    }
+    lbuf_advance(&b, len);
   }
-  if (len == 0) {
+  lstring_t *line = lbuf_finish(&b);
+  if (!newline && line->length == 0) {
     vm_running->closure->upvalues[0] = lv_userdata(NULL);
     lstate_return1(LUAV_NIL);
   }
-  lstate_return1(lv_string(str));
+  lstate_return1(lv_string(line));
 }
 
 static cfunc_t io_iterator = {.f = lua_io_lines_iterator, .name = "nope",
@@ -252,9 +261,11 @@ static u32 lua_io_write(LSTATE) {
         fprintf(f, "%.*s", (int) str->length, str->data);
         break;
 
-      case LNUMBER:
-        fprintf(f, LUA_NUMBER_FMT, lv_castnumber(value, i));
+      case LNUMBER: {
+        char buf[LUA_NUMBER_SIZE];
+        fwrite(buf, 1, lv_fmtnum(buf, lv_cvt(value)), f);
         break;
+      }
 
       default:
         err_badtype(i, LSTRING, lv_gettype(value));
@@ -0,0 +1,605 @@
+/**
+ * @file lib/pattern.c
+ * @brief Implementation of lua patterns, used by the string library
+ *
+ * Patterns are compiled once into a flat program of items, and programs are
+ * cached by the (interned) pattern string, so a pattern used in a loop is only
+ * ever parsed once. Every item which matches a single character (a literal, a
+ * '.', a %class or a [set]) is compiled down to a 256-bit set, so matching a
+ * character is always one bit test.
+ *
+ * Before running the backtracking matcher, the literal prefix of the pattern
+ * (if there is one) is used to skip ahead with memchr() to the places where a
+ * match could possibly start. Patterns which are entirely literal don't run
+ * the matcher at all.
+ */
+
+#include <alloca.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "error.h"
+#include "gc.h"
+#include "lib/pattern.h"
+#include "luav.h"
+#include "util.h"
+
+#define PAT_CACHE_SIZE 64
+
+#define PI_SINGLE   0   /* one character from a set, possibly quantified */
+#define PI_CAPOPEN  1   /* '(' */
+#define PI_POSCAP   2   /* '()' */
+#define PI_CAPCLOSE 3   /* ')' */
+#define PI_BALANCE  4   /* '%bxy' */
+#define PI_FRONTIER 5   /* '%f[set]' */
+#define PI_BACKREF  6   /* '%1' through '%9' */
+#define PI_END      7   /* '$' at the end of the pattern */
+
+#define SET_ADD(set, c) ((set)[(u8) (c) >> 5] |= 1u << ((u8) (c) & 31))
+#define SET_HAS(set, c) (((set)[(u8) (c) >> 5] >> ((u8) (c) & 31)) & 1)
+
+/* One step of a compiled pattern */
+typedef struct pitem {
+  u8  type;     //<! One of the PI_* constants
+  u8  quant;    //<! Quantifier of a PI_SINGLE: 0, '*', '+', '-' or '?'
+  u8  arg1;     //<! Capture index, or first character of a %b
+  u8  arg2;     //<! Second character of a %b
+  u32 set[8];   //<! Characters matched by PI_SINGLE and PI_FRONTIER
+} pitem_t;
+
+struct pattern {
+  lstring_t *source;  //<! Pattern string this program was compiled from
+  u32    refs;        //<! Number of matches currently using this program
+  u8     cached;      //<! Whether this program is still in the cache
+  u8     anchor;      //<! Pattern started with '^'
+  u8     plain;       //<! Pattern is entirely its literal prefix
+  char   *prefix;     //<! Literal characters every match must start with
+  size_t prefix_len;  //<! Length of the literal prefix
+  u32    nitems;      //<! Number of items in the program
+  pitem_t items[1];   //<! The compiled program
+};
+
+static pattern_t *pat_cache[PAT_CACHE_SIZE];
+
+static const char *pat_do(pmatch_t *m, const char *s, u32 i);
+
+static void pattern_gc() {
+  u32 i;
+  for (i = 0; i < PAT_CACHE_SIZE; i++) {
+    if (pat_cache[i] != NULL) {
+      gc_traverse_pointer(pat_cache[i]->source, LSTRING);
+    }
+  }
+}
+
+INIT static void lua_pattern_init() {
+  gc_add_hook(pattern_gc);
+}
+
+DESTROY static void lua_pattern_destroy() {
+  u32 i;
+  for (i = 0; i < PAT_CACHE_SIZE; i++) {
+    free(pat_cache[i]);
+    pat_cache[i] = NULL;
+  }
+}
+
+/**
+ * @brief Raise an error about a malformed pattern, freeing the partially
+ *        compiled program
+ */
+static void pat_error(pattern_t *prog, char *msg) NORETURN;
+static void pat_error(pattern_t *prog, char *msg) {
+  free(prog);
+  err_rawstr(msg, TRUE);
+}
+
+/**
+ * @brief Test whether a character is a member of a %-class, like %a
+ */
+static int pat_class(int c, int cl) {
+  int res;
+  switch (tolower(cl)) {
+    case 'a': res = isalpha(c);  break;
+    case 'c': res = iscntrl(c);  break;
+    case 'd': res = isdigit(c);  break;
+    case 'l': res = islower(c);  break;
+    case 'p': res = ispunct(c);  break;
+    case 's': res = isspace(c);  break;
+    case 'u': res = isupper(c);  break;
+    case 'w': res = isalnum(c);  break;
+    case 'x': res = isxdigit(c); break;
+    case 'z': res = (c == 0);    break;
+    default: return (cl == c);
+  }
+  if (isupper(cl)) {
+    return !res;
+  }
+  return res;
+}
+
+/**
+ * @brief Add all members of a %-class to a set
+ */
+static void pat_addclass(u32 *set, int cl) {
+  int c;
+  for (c = 0; c < 256; c++) {
+    if (pat_class(c, cl)) {
+      SET_ADD(set, c);
+    }
+  }
+}
+
+/**
+ * @brief Compile a [set] into a bitmap
+ *
+ * @param prog the program being compiled
+ * @param p the character after the '['
+ * @param end the end of the pattern
+ * @param set the bitmap to fill in
+ * @return the character after the closing ']'
+ */
+static const char *pat_set(pattern_t *prog, const char *p, const char *end,
+                           u32 *set) {
+  int complement = FALSE;
+  u32 i;
+  if (p < end && *p == '^') {
+    complement = TRUE;
+    p++;
+  }
+  /* The first character is always part of the set, even if it's a ']' */
+  do {
+    if (p >= end) {
+      pat_error(prog, "malformed pattern (missing ']')");
+    }
+    if (*p == '%') {
+      if (++p >= end) {
+        pat_error(prog, "malformed pattern (missing ']')");
+      }
+      pat_addclass(set, (u8) *p++);
+    } else if (p + 2 < end && p[1] == '-' && p[2] != ']') {
+      int c;
+      for (c = (u8) p[0]; c <= (u8) p[2]; c++) {
+        SET_ADD(set, c);
+      }
+      p += 3;
+    } else {
+      SET_ADD(set, *p);
+      p++;
+    }
+  } while (p >= end || *p != ']');
+
+  if (complement) {
+    for (i = 0; i < 8; i++) {
+      set[i] = ~set[i];
+    }
+  }
+  return p + 1;
+}
+
+/**
+ * @brief Compile a pattern into a program
+ *
+ * @param pat the pattern to compile
+ * @return the compiled program, allocated with malloc
+ */
+static pattern_t *pat_compile(lstring_t *pat) {
+  const char *p   = pat->data;
+  const char *end = p + pat->length;
+  u32 open[PAT_MAXCAPTURES];
+  u8  closed[PAT_MAXCAPTURES];
+  u32 nopen = 0, level = 0, i;
+
+  /* There can't be more items than characters, plus one for an empty pattern.
+     The literal prefix is stored after the items */
+  size_t items = pat->length + 1;
+  pattern_t *prog = xcalloc(1, sizeof(pattern_t) + items * sizeof(pitem_t) +
+                               pat->length + 1);
+  prog->prefix = (char*) &prog->items[items];
+  prog->source = pat;
+
+  if (p < end && *p == '^') {
+    prog->anchor = TRUE;
+    p++;
+  }
+
+  while (p < end) {
+    pitem_t *it = &prog->items[prog->nitems++];
+    switch (*p) {
+      case '(':
+        if (level >= PAT_MAXCAPTURES) {
+          pat_error(prog, "too many captures");
+        }
+        if (p + 1 < end && p[1] == ')') {
+          it->type = PI_POSCAP;
+          closed[level++] = TRUE;
+          p += 2;
+        } else {
+          it->type = PI_CAPOPEN;
+          closed[level] = FALSE;
+          open[nopen++] = level++;
+          p++;
+        }
+        continue;
+
+      case ')':
+        if (nopen == 0) {
+          pat_error(prog, "invalid pattern capture");
+        }
+        it->type = PI_CAPCLOSE;
+        it->arg1 = (u8) open[--nopen];
+        closed[it->arg1] = TRUE;
+        p++;
+        continue;
+
+      case '$':
+        if (p + 1 == end) {
+          it->type = PI_END;
+          p++;
+          continue;
+        }
+        break;
+
+      case '%':
+        if (p + 1 < end && p[1] == 'b') {
+          if (p + 3 >= end) {
+            pat_error(prog, "malformed pattern (missing arguments to '%b')");
+          }
+          it->type = PI_BALANCE;
+          it->arg1 = (u8) p[2];
+          it->arg2 = (u8) p[3];
+          p += 4;
+          continue;
+        } else if (p + 1 < end && p[1] == 'f') {
+          p += 2;
+          if (p >= end || *p != '[') {
+            pat_error(prog, "missing '[' after '%f' in pattern");
+          }
+          it->type = PI_FRONTIER;
+          p = pat_set(prog, p + 1, end, it->set);
+          continue;
+        } else if (p + 1 < end && isdigit((u8) p[1])) {
+          int idx = p[1] - '1';
+          if (idx < 0 || (u32) idx >= level || !closed[idx]) {
+            pat_error(prog, "invalid capture index");
+          }
+          it->type = PI_BACKREF;
+          it->arg1 = (u8) idx;
+          p += 2;
+          continue;
+        }
+        break;
+    }
+
+    /* Otherwise this is a single character class, possibly quantified */
+    it->type = PI_SINGLE;
+    if (*p == '%') {
+      if (p + 1 >= end) {
+        pat_error(prog, "malformed pattern (ends with '%')");
+      }
+      pat_addclass(it->set, (u8) p[1]);
+      p += 2;
+    } else if (*p == '[') {
+      p = pat_set(prog, p + 1, end, it->set);
+    } else if (*p == '.') {
+      memset(it->set, 0xff, sizeof(it->set));
+      p++;
+    } else {
+      SET_ADD(it->set, *p);
+      p++;
+    }
+    if (p < end && strchr("*+-?", *p) != NULL) {
+      it->quant = (u8) *p++;
+    }
+  }
+
+  /* Captures can be left unfinished, but that's only an error if the pattern
+     actually matches something, so it's checked by pattern_captures() */
+
+  /* Find the literal prefix, any sequence of single characters */
+  for (i = 0; i < prog->nitems; i++) {
+    pitem_t *it = &prog->items[i];
+    u32 j, bits = 0, c = 0;
+    if (it->type == PI_CAPOPEN || it->type == PI_POSCAP) {
+      continue;
+    } else if (it->type != PI_SINGLE || it->quant != 0) {
+      break;
+    }
+    for (j = 0; j < 8 && bits <= 1; j++) {
+      bits += (u32) __builtin_popcount(it->set[j]);
+      if (it->set[j] != 0) {
+        c = j * 32 + (u32) __builtin_ctz(it->set[j]);
+      }
+    }
+    if (bits != 1) {
+      break;
+    }
+    prog->prefix[prog->prefix_len++] = (char) c;
+  }
+  prog->plain = (i == prog->nitems && prog->prefix_len == prog->nitems);
+
+  return prog;
+}
+
+/**
+ * @brief Fetch the compiled program for a pattern
+ *
+ * The program is looked up in the cache first. Every program returned must be
+ * given back with pattern_release() when the caller is done with it.
+ *
+ * @param pat the pattern to compile
+ * @return the compiled program
+ */
+pattern_t *pattern_compile(lstring_t *pat) {
+  u32 slot = lv_keyhash(lv_string(pat)) % PAT_CACHE_SIZE;
+  pattern_t *prog = pat_cache[slot];
+  if (prog == NULL || !lstr_equal(prog->source, pat)) {
+    if (prog != NULL) {
+      /* Evicting a program which is in use defers freeing it to the user */
+      prog->cached = FALSE;
+      if (prog->refs == 0) {
+        free(prog);
+      }
+      pat_cache[slot] = NULL;
+    }
+    prog = pat_compile(pat);
+    prog->cached = TRUE;
+    pat_cache[slot] = prog;
+  }
+  prog->refs++;
+  return prog;
+}
+
+/**
+ * @brief Stop using a program returned by pattern_compile()
+ */
+void pattern_release(pattern_t *prog) {
+  prog->refs--;
+  if (prog->refs == 0 && !prog->cached) {
+    free(prog);
+  }
+}
+
+/**
+ * @brief Find the first occurrence of one block of memory in another
+ *
+ * @param s the memory to search
+ * @param len the length of s
+ * @param pat the memory to search for
+ * @param plen the length of pat
+ * @return a pointer to the occurrence in s, or NULL if there isn't one
+ */
+const char *pattern_memfind(const char *s, size_t len,
+                            const char *pat, size_t plen) {
+  if (plen == 0) {
+    return s;
+  } else if (plen > len) {
+    return NULL;
+  }
+  const char *last = s + (len - plen);
+  while (s <= last) {
+    s = memchr(s, pat[0], (size_t) (last - s) + 1);
+    if (s == NULL) {
+      return NULL;
+    }
+    if (memcmp(s + 1, pat + 1, plen - 1) == 0) {
+      return s;
+    }
+    s++;
+  }
+  return NULL;
+}
+
+static const char *pat_max(pmatch_t *m, const char *s, u32 i) {
+  u32 *set = m->prog->items[i].set;
+  ptrdiff_t count = 0;
+  while (s + count < m->end && SET_HAS(set, s[count])) {
+    count++;
+  }
+  /* Try with the most repetitions first */
+  for (; count >= 0; count--) {
+    const char *res = pat_do(m, s + count, i + 1);
+    if (res != NULL) {
+      return res;
+    }
+  }
+  return NULL;
+}
+
+static const char *pat_min(pmatch_t *m, const char *s, u32 i) {
+  u32 *set = m->prog->items[i].set;
+  while (1) {
+    const char *res = pat_do(m, s, i + 1);
+    if (res != NULL) {
+      return res;
+    } else if (s < m->end && SET_HAS(set, *s)) {
+      s++;
+    } else {
+      return NULL;
+    }
+  }
+}
+
+static const char *pat_balance(pmatch_t *m, const char *s, pitem_t *it) {
+  if (s >= m->end || (u8) *s != it->arg1) {
+    return NULL;
+  }
+  u32 depth = 1;
+  while (++s < m->end) {
+    if ((u8) *s == it->arg2) {
+      if (--depth == 0) {
+        return s + 1;
+      }
+    } else if ((u8) *s == it->arg1) {
+      depth++;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Match the program, starting at item i, against the subject at s
+ *
+ * @return the end of the match, or NULL if there's no match
+ */
+static const char *pat_do(pmatch_t *m, const char *s, u32 i) {
+  pattern_t *prog = m->prog;
+  const char *res;
+
+  while (i < prog->nitems) {
+    pitem_t *it = &prog->items[i];
+    switch (it->type) {
+      case PI_SINGLE: {
+        int ok = s < m->end && SET_HAS(it->set, *s);
+        switch (it->quant) {
+          case '?':
+            if (ok && (res = pat_do(m, s + 1, i + 1)) != NULL) {
+              return res;
+            }
+            i++;
+            continue;
+          case '*':
+            return pat_max(m, s, i);
+          case '+':
+            return ok ? pat_max(m, s + 1, i) : NULL;
+          case '-':
+            return pat_min(m, s, i);
+          default:
+            if (!ok) {
+              return NULL;
+            }
+            s++;
+            i++;
+            continue;
+        }
+      }
+
+      case PI_CAPOPEN:
+      case PI_POSCAP: {
+        u32 l = m->level++;
+        m->capture[l].init = s;
+        m->capture[l].len  = it->type == PI_POSCAP ? PAT_CAP_POSITION
+                                                   : PAT_CAP_UNFINISHED;
+        if ((res = pat_do(m, s, i + 1)) == NULL) {
+          m->level--;
+        }
+        return res;
+      }
+
+      case PI_CAPCLOSE: {
+        u32 l = it->arg1;
+        m->capture[l].len = s - m->capture[l].init;
+        if ((res = pat_do(m, s, i + 1)) == NULL) {
+          m->capture[l].len = PAT_CAP_UNFINISHED;
+        }
+        return res;
+      }
+
+      case PI_END:
+        return s == m->end ? s : NULL;
+
+      case PI_BALANCE:
+        if ((s = pat_balance(m, s, it)) == NULL) {
+          return NULL;
+        }
+        i++;
+        continue;
+
+      case PI_FRONTIER: {
+        u8 prev = s == m->src ? 0 : (u8) s[-1];
+        u8 cur  = s < m->end ? (u8) *s : 0;
+        if (SET_HAS(it->set, prev) || !SET_HAS(it->set, cur)) {
+          return NULL;
+        }
+        i++;
+        continue;
+      }
+
+      case PI_BACKREF: {
+        ptrdiff_t len = m->capture[it->arg1].len;
+        if (len < 0 || m->end - s < len ||
+            memcmp(m->capture[it->arg1].init, s, (size_t) len) != 0) {
+          return NULL;
+        }
+        s += len;
+        i++;
+        continue;
+      }
+    }
+  }
+  return s;
+}
+
+/**
+ * @brief Search for the first match of a pattern in a string
+ *
+ * @param m the match state to fill in with the captures of the match
+ * @param prog the compiled pattern
+ * @param src the subject string
+ * @param len the length of the subject
+ * @param init the offset in the subject to start searching at
+ * @param gmatch if TRUE, a leading '^' is a literal, as in string.gmatch
+ * @param start filled in with the beginning of the match
+ * @return the end of the match, or NULL if there is no match
+ */
+const char *pattern_search(pmatch_t *m, pattern_t *prog, const char *src,
+                           size_t len, size_t init, int gmatch,
+                           const char **start) {
+  const char *s   = src + init;
+  const char *end = src + len;
+  const char *prefix = prog->prefix;
+  size_t plen = prog->prefix_len;
+  int anchor = prog->anchor && !gmatch;
+
+  m->prog = prog;
+  m->src  = src;
+  m->end  = end;
+
+  /* In gmatch, the '^' is just one more character of the prefix */
+  if (prog->anchor && gmatch) {
+    char *tmp = alloca(plen + 1);
+    tmp[0] = '^';
+    memcpy(tmp + 1, prefix, plen);
+    prefix = tmp;
+    plen++;
+  }
+
+  do {
+    if (!anchor && plen > 0) {
+      s = pattern_memfind(s, (size_t) (end - s), prefix, plen);
+      if (s == NULL) {
+        return NULL;
+      }
+    }
+    m->level = 0;
+    if (prog->plain) {
+      if (anchor && ((size_t) (end - s) < plen || memcmp(s, prefix, plen))) {
+        return NULL;
+      }
+      *start = s;
+      return s + plen;
+    }
+    const char *res = pat_do(m, s + (prog->anchor && gmatch), 0);
+    if (res != NULL) {
+      *start = s;
+      return res;
+    }
+  } while (s++ < end && !anchor);
+
+  return NULL;
+}
+
+/**
+ * @brief Returns the number of captures of a successful match, checking that
+ *        they were all finished
+ */
+u32 pattern_captures(pmatch_t *m) {
+  u32 i;
+  for (i = 0; i < m->level; i++) {
+    if (m->capture[i].len == PAT_CAP_UNFINISHED) {
+      err_rawstr("unfinished capture", TRUE);
+    }
+  }
+  return m->level;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file lib/pattern.h
+ * @brief Headers for compiled lua patterns
+ */
+
+#ifndef _LIB_PATTERN_H
+#define _LIB_PATTERN_H
+
+#include <stddef.h>
+
+#include "config.h"
+#include "lstring.h"
+
+#define PAT_MAXCAPTURES    32
+#define PAT_CAP_UNFINISHED (-1)
+#define PAT_CAP_POSITION   (-2)
+#define PAT_SPECIALS       "^$*+?.([%-"
+
+typedef struct pattern pattern_t;
+
+/* State of a match of a compiled pattern against a subject string */
+typedef struct pmatch {
+  pattern_t  *prog;     //<! Pattern being matched
+  const char *src;      //<! Beginning of the subject
+  const char *end;      //<! End of the subject
+  u32        level;     //<! Number of captures (finished or not)
+  struct {
+    const char *init;   //<! Where the capture starts in the subject
+    ptrdiff_t  len;     //<! Length, or PAT_CAP_{UNFINISHED,POSITION}
+  } capture[PAT_MAXCAPTURES];
+} pmatch_t;
+
+pattern_t  *pattern_compile(lstring_t *pat);
+void        pattern_release(pattern_t *prog);
+const char *pattern_search(pmatch_t *m, pattern_t *prog, const char *src,
+                           size_t len, size_t init, int gmatch,
+                           const char **start);
+u32         pattern_captures(pmatch_t *m);
+const char *pattern_memfind(const char *s, size_t len,
+                            const char *pat, size_t plen);
+
+#endif /* _LIB_PATTERN_H */
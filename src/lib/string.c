@@ -1,57 +1,23 @@
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "error.h"
 #include "gc.h"
+#include "lbuf.h"
 #include "lhash.h"
 #include "lstate.h"
 #include "luav.h"
+#include "util.h"
 #include "vm.h"
+#include "lib/pattern.h"
 
 #define MAX_FORMAT 20
-
-/**
- * @brief Resize a string if necessary so that the given size will fit in
- *        the string's capacity
- *
- * @param str the string to possibly resize
- * @param size the desired size of the string
- */
-#define RESIZE(str, size)                     \
-  if ((size) >= (str)->length) {              \
-    str = lstr_realloc(str, str->length * 2); \
-  }
-
-/**
- * @brief Call snprintf() until it successfully fits entirely inside the given
- *        string
- *
- * @param str the string to write into
- * @param size the current size of the string
- * @param fmt the format and arguments to pass to snprintf()
- */
-#define SNPRINTF(str, size, fmt...) {                                          \
-    int tmp;                                                                   \
-    while ((size_t) (tmp = snprintf(&str->data[size], str->length - size, fmt))\
-                           + size >= str->length) {                            \
-      str = lstr_realloc(str, (size_t) tmp + size + 1);                        \
-    }                                                                          \
-    size += (size_t) tmp;                                                      \
-  }
-
-/**
- * @brief Append one character onto a string
- *
- * @param str the string to append to
- * @param size the size of the string
- * @param c the character to add to the buffer
- */
-#define APPEND(str, size, c) {  \
-    RESIZE(str, size + 1);      \
-    str->data[size++] = c;      \
-  }
+#define FMT_FLAGS "-+ #0"
+#define FMT_CACHE_SIZE 32
 
 /**
  * @brief Fix beginning/end indices for a string to be real indices
@@ -77,7 +43,7 @@
         i--;                                                  \
       }                                                       \
       if (j < -len) {                                         \
-        j = 0;                                                \
+        j = -1;                                               \
       } else if (j < 0) {                                     \
         j += len;                                             \
       } else if (j > len) {                                   \
@@ -90,6 +56,27 @@
     }                                                         \
   }
 
+/* One conversion of a format string, along with the text in front of it */
+typedef struct fspec {
+  u32  lit;               //<! Offset in the format of the literal text
+  u32  litlen;            //<! Length of the literal text
+  char conv;              //<! Conversion character, or 0 after the last one
+  u8   left;              //<! The '-' flag was given
+  u8   zero;              //<! The '0' flag was given
+  u8   exotic;            //<! Other flags were given, so use snprintf
+  i16  width;             //<! Minimum field width, or -1 if none
+  i16  precision;         //<! Precision, or -1 if none
+  char spec[MAX_FORMAT];  //<! The conversion as passed to snprintf
+} fspec_t;
+
+/* A format string broken up into its conversions */
+typedef struct format {
+  lstring_t *source;      //<! Format string this was compiled from
+  u32    nspecs;          //<! Number of conversions, plus the trailing text
+  fspec_t specs[1];       //<! The conversions, in order
+} format_t;
+
+static format_t *fmt_cache[FMT_CACHE_SIZE];
 static luav str_empty;
 static lhash_t *lua_string;
 static u32 lua_string_format(LSTATE);
@@ -102,10 +89,23 @@ static u32 lua_string_reverse(LSTATE);
 static u32 lua_string_byte(LSTATE);
 static u32 lua_string_char(LSTATE);
 static u32 lua_string_find(LSTATE);
+static u32 lua_string_match(LSTATE);
+static u32 lua_string_gmatch(LSTATE);
+static u32 lua_string_gsub(LSTATE);
 static char errbuf[200];
 
+static void lua_string_gc() {
+  u32 i;
+  for (i = 0; i < FMT_CACHE_SIZE; i++) {
+    if (fmt_cache[i] != NULL) {
+      gc_traverse_pointer(fmt_cache[i]->source, LSTRING);
+    }
+  }
+}
+
 INIT static void lua_string_init() {
   str_empty = lv_string(lstr_empty());
+  gc_add_hook(lua_string_gc);
 
   lua_string = lhash_alloc();
   cfunc_register(lua_string, "format",  lua_string_format);
@@ -118,132 +118,347 @@ INIT static void lua_string_init() {
   cfunc_register(lua_string, "byte",    lua_string_byte);
   cfunc_register(lua_string, "char",    lua_string_char);
   cfunc_register(lua_string, "find",    lua_string_find);
+  cfunc_register(lua_string, "match",   lua_string_match);
+  cfunc_register(lua_string, "gmatch",  lua_string_gmatch);
+  cfunc_register(lua_string, "gsub",    lua_string_gsub);
 
   lhash_set(lua_globals, LSTR("string"), lv_table(lua_string));
 }
 
+DESTROY static void lua_string_destroy() {
+  u32 i;
+  for (i = 0; i < FMT_CACHE_SIZE; i++) {
+    free(fmt_cache[i]);
+    fmt_cache[i] = NULL;
+  }
+}
+
+/**
+ * @brief Compile a format string into its list of conversions
+ *
+ * Errors in the format are raised here, before any arguments are looked at.
+ *
+ * @param lfmt the format string
+ * @return the compiled format, which must be freed with free()
+ */
+static format_t *fmt_compile(lstring_t *lfmt) {
+  const char *fmt = lfmt->data;
+  size_t len = lfmt->length;
+  size_t i = 0, j;
+  /* Every conversion takes at least two characters, plus the trailing text */
+  format_t *f = xcalloc(1, sizeof(format_t) + (len / 2 + 1) * sizeof(fspec_t));
+  f->source = lfmt;
+
+  while (1) {
+    fspec_t *spec = &f->specs[f->nspecs++];
+    spec->lit = (u32) i;
+    while (i < len && fmt[i] != '%') i++;
+    spec->litlen = (u32) (i - spec->lit);
+    spec->width = spec->precision = -1;
+    if (i >= len) {
+      break;
+    }
+
+    size_t start = i++;
+    if (i < len && fmt[i] == '%') {
+      spec->conv = '%';
+      i++;
+      continue;
+    }
+    for (; i < len && fmt[i] != 0 && strchr(FMT_FLAGS, fmt[i]); i++) {
+      switch (fmt[i]) {
+        case '-': spec->left = TRUE; break;
+        case '0': spec->zero = TRUE; break;
+        default:  spec->exotic = TRUE; break;
+      }
+      if (i - start >= sizeof(FMT_FLAGS)) {
+        free(f);
+        err_rawstr("invalid format (repeated flags)", TRUE);
+      }
+    }
+    for (j = 0; j < 3 && i < len && isdigit((u8) fmt[i]); j++, i++) {
+      spec->width = (i16) (MAX(spec->width, 0) * 10 + (fmt[i] - '0'));
+    }
+    if (i < len && fmt[i] == '.') {
+      spec->precision = 0;
+      for (i++, j = 0; j < 3 && i < len && isdigit((u8) fmt[i]); j++, i++) {
+        spec->precision = (i16) (spec->precision * 10 + (fmt[i] - '0'));
+      }
+    }
+    if (i < len && isdigit((u8) fmt[i])) {
+      free(f);
+      err_rawstr("invalid format (width or precision too long)", TRUE);
+    }
+
+    spec->conv = i < len ? fmt[i] : 0;
+    if (spec->conv == 0) {
+      free(f);
+      err_rawstr("invalid option '%' to 'format'", TRUE);
+    } else if (strchr("cdiouxXeEfgGqs", spec->conv) == NULL) {
+      sprintf(errbuf, "invalid option '%%%c' to 'format'", spec->conv);
+      free(f);
+      err_rawstr(errbuf, TRUE);
+    }
+    /* Integers are all printed from a 64-bit argument */
+    memcpy(spec->spec, &fmt[start], i - start);
+    if (strchr("diouxX", spec->conv) != NULL) {
+      spec->spec[i - start] = 'z';
+      spec->spec[i - start + 1] = spec->conv;
+    } else {
+      spec->spec[i - start] = spec->conv;
+    }
+    i++;
+  }
+
+  return f;
+}
+
+/**
+ * @brief Fetch the compiled form of a format string, from the cache if
+ *        possible
+ */
+static format_t *fmt_lookup(lstring_t *lfmt) {
+  u32 slot = lv_keyhash(lv_string(lfmt)) % FMT_CACHE_SIZE;
+  format_t *f = fmt_cache[slot];
+  if (f == NULL || !lstr_equal(f->source, lfmt)) {
+    f = fmt_compile(lfmt);
+    free(fmt_cache[slot]);
+    fmt_cache[slot] = f;
+  }
+  return f;
+}
+
+/**
+ * @brief Append a converted value to a buffer, padded out to the width of
+ *        its conversion
+ *
+ * @param b the buffer to append to
+ * @param spec the conversion being done
+ * @param mem the characters of the value, not including any sign
+ * @param len the number of characters
+ * @param neg whether a '-' goes in front of the value
+ */
+static void fmt_pad(lbuf_t *b, fspec_t *spec, const char *mem, size_t len,
+                    int neg) {
+  size_t total = len + (neg != 0);
+  size_t pad = 0;
+  if (spec->width >= 0 && (size_t) spec->width > total) {
+    pad = (size_t) spec->width - total;
+  }
+  if (!spec->left && !spec->zero) {
+    memset(lbuf_reserve(b, pad), ' ', pad);
+    lbuf_advance(b, pad);
+  }
+  if (neg) {
+    lbuf_addchar(b, '-');
+  }
+  if (!spec->left && spec->zero) {
+    memset(lbuf_reserve(b, pad), '0', pad);
+    lbuf_advance(b, pad);
+  }
+  lbuf_addmem(b, mem, len);
+  if (spec->left) {
+    memset(lbuf_reserve(b, pad), ' ', pad);
+    lbuf_advance(b, pad);
+  }
+}
+
+/**
+ * @brief Append an integer conversion without going through snprintf
+ */
+static void fmt_int(lbuf_t *b, fspec_t *spec, ssize_t num) {
+  static const char lower[] = "0123456789abcdef";
+  static const char upper[] = "0123456789ABCDEF";
+  const char *digits = spec->conv == 'X' ? upper : lower;
+  u32 base = spec->conv == 'x' || spec->conv == 'X' ? 16 :
+             spec->conv == 'o' ? 8 : 10;
+  int neg = (spec->conv == 'd' || spec->conv == 'i') && num < 0;
+  size_t n = neg ? -(size_t) num : (size_t) num;
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  do {
+    *--p = digits[n % base];
+    n /= base;
+  } while (n > 0);
+  fmt_pad(b, spec, p, (size_t) (tmp + sizeof(tmp) - p), neg);
+}
+
+/**
+ * @brief Append a '%f' conversion without going through snprintf
+ *
+ * The number is scaled by an exact power of ten so the digits to print are the
+ * integer part. That's only done when the error from the scaling can't change
+ * how the number rounds, and otherwise the caller has to use snprintf.
+ *
+ * @return TRUE if the number was appended, FALSE if it wasn't
+ */
+static int fmt_fixed(lbuf_t *b, fspec_t *spec, double num) {
+  static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                 1e8, 1e9};
+  int prec = spec->precision < 0 ? 6 : spec->precision;
+  if (prec > 9) {
+    return FALSE;
+  }
+  double scaled = fabs(num) * pow10[prec];
+  if (!(scaled < 1e13)) {
+    return FALSE;
+  }
+  double whole = floor(scaled);
+  double frac = scaled - whole;
+  if (fabs(frac - 0.5) < 0.01) {
+    return FALSE;
+  }
+
+  u64 n = (u64) whole + (frac > 0.5);
+  char tmp[32];
+  char *p = tmp + sizeof(tmp);
+  int i;
+  for (i = 0; i < prec; i++) {
+    *--p = (char) ('0' + n % 10);
+    n /= 10;
+  }
+  if (prec > 0) {
+    *--p = '.';
+  }
+  do {
+    *--p = (char) ('0' + n % 10);
+    n /= 10;
+  } while (n > 0);
+  fmt_pad(b, spec, p, (size_t) (tmp + sizeof(tmp) - p), signbit(num));
+  return TRUE;
+}
+
+/**
+ * @brief Append a quoted string for the '%q' conversion
+ */
+static void fmt_quoted(lbuf_t *b, lstring_t *str) {
+  size_t j;
+  lbuf_addchar(b, '"');
+  for (j = 0; j < str->length; j++) {
+    /* Make sure we escape all escape sequences */
+    switch (str->data[j]) {
+      case 0:
+        lbuf_addmem(b, "\\000", 4);
+        break;
+
+      case '"':
+        lbuf_addmem(b, "\\\"", 2);
+        break;
+
+      case '\n':
+        lbuf_addmem(b, "\\\n", 2);
+        break;
+
+      case '\\':
+        lbuf_addmem(b, "\\\\", 2);
+        break;
+
+      default:
+        lbuf_addchar(b, str->data[j]);
+        break;
+    }
+  }
+  lbuf_addchar(b, '"');
+}
+
 static u32 lua_string_format(LSTATE) {
   lstring_t *lfmt = lstate_getstring(0);
   if (lfmt->length == 0) { lstate_return1(str_empty); }
-  size_t len = 0;
-  lstring_t *newstr = lstr_alloc(LUAV_INIT_STRING);
-  char *fmt = lfmt->data;
-  u32 i, j, argi = 0;
-  char buf[MAX_FORMAT];
-
-  for (i = 0; i < lfmt->length; i++) {
-    if (fmt[i] != '%') {
-      APPEND(newstr, len, fmt[i]);
-      continue;
+  format_t *f = fmt_lookup(lfmt);
+  const char *fmt = lfmt->data;
+  lbuf_t b;
+  u32 i, argi = 0;
+
+  lbuf_init(&b);
+  for (i = 0; i < f->nspecs; i++) {
+    fspec_t *spec = &f->specs[i];
+    lbuf_addmem(&b, fmt + spec->lit, spec->litlen);
+    if (spec->conv != 0 && spec->conv != '%') {
+      argi++;
     }
 
-    /* Figure out what exactly is the format string, moving it into a separate
-       buffer to pass to snprintf() later */
-    u32  start = i;
-    char *pct_start = &fmt[i++];
-    if (fmt[i] == '-') i++;
-    for (j = 0; j < 3 && isdigit(fmt[i]); j++) i++; /* skip the width */
-    /* TODO: take out these two asserts */
-    assert(!isdigit(fmt[i]));
-    if (fmt[i] == '.') i++;                         /* skip period format */
-    if (fmt[i] == '-') i++;
-    for (j = 0; j < 3 && isdigit(fmt[i]); j++) i++; /* skip the precision */
-    assert(!isdigit(fmt[i]));
-
-    strncpy(buf, pct_start, i - start + 1);
-    buf[i - start + 1] = 0;
-
-    argi++;
-    switch (fmt[i]) {
-      case '%':
-        APPEND(newstr, len, '%');
-        argi--;
+    switch (spec->conv) {
+      case 0:
         break;
-      case 'c':
-        SNPRINTF(newstr, len, buf, (char) lstate_getnumber(argi));
+      case '%':
+        lbuf_addchar(&b, '%');
         break;
 
-      case 'i':
-      case 'd':
-        SNPRINTF(newstr, len, buf, (int) lstate_getnumber(argi));
+      case 'c': {
+        char c = (char) lstate_getnumber(argi);
+        if (spec->width < 0) {
+          lbuf_addchar(&b, c);
+        } else {
+          lbuf_printf(&b, spec->spec, c);
+        }
         break;
+      }
 
+      case 'd':
+      case 'i':
       case 'o':
       case 'u':
       case 'x':
       case 'X': {
-        /* Use the generic PRIu64 macro to print a 64-bit argument, but change
-           the last character to whatever format we specified. */
-        char *default_fmt = "zd";
-        u32 end = i - start;
-        buf[end + strlen(default_fmt)] = 0;
-        memcpy(&buf[end], default_fmt, strlen(default_fmt));
-        buf[end + strlen(default_fmt) - 1] = fmt[i];
-        SNPRINTF(newstr, len, buf, (ssize_t) lstate_getnumber(argi));
+        ssize_t num = (ssize_t) lstate_getnumber(argi);
+        if (!spec->exotic && spec->precision < 0) {
+          fmt_int(&b, spec, num);
+        } else {
+          lbuf_printf(&b, spec->spec, num);
+        }
+        break;
+      }
+
+      case 'f': {
+        double num = lstate_getnumber(argi);
+        if (spec->exotic || !fmt_fixed(&b, spec, num)) {
+          lbuf_printf(&b, spec->spec, num);
+        }
         break;
       }
 
+      case 'g':
+        /* This is how numbers are converted to strings anyway */
+        if (strcmp(spec->spec, LUA_NUMBER_FMT) == 0) {
+          lbuf_addnum(&b, lstate_getnumber(argi));
+          break;
+        }
+        /* fall through */
       case 'e':
       case 'E':
-      case 'f':
-      case 'g':
       case 'G':
-        SNPRINTF(newstr, len, buf, lstate_getnumber(argi));
+        lbuf_printf(&b, spec->spec, lstate_getnumber(argi));
         break;
 
-      case 'q':
       case 's': {
-        luav arg = lstate_getval(argi);
-        lstring_t *str = lv_caststring(arg, argi);
-        if (fmt[i] == 's') {
-          SNPRINTF(newstr, len, buf, str->data);
+        lstring_t *str = lv_caststring(lstate_getval(argi), argi);
+        if (spec->zero || spec->exotic) {
+          lbuf_printf(&b, spec->spec, str->data);
           break;
         }
-        APPEND(newstr, len, '"');
-        for (j = 0; j < str->length; j++) {
-          /* Make sure we escape all escape sequences */
-          switch (str->data[j]) {
-            case 0:
-              APPEND(newstr, len, '\\');
-              APPEND(newstr, len, '0');
-              APPEND(newstr, len, '0');
-              APPEND(newstr, len, '0');
-              break;
-
-            case '"':
-              APPEND(newstr, len, '\\');
-              APPEND(newstr, len, '"');
-              break;
-
-            case '\n':
-              APPEND(newstr, len, '\\');
-              APPEND(newstr, len, '\n');
-              break;
-
-            case '\\':
-              APPEND(newstr, len, '\\');
-              APPEND(newstr, len, '\\');
-              break;
-
-            default:
-              APPEND(newstr, len, str->data[j]);
-              break;
+        /* Long strings without a precision are copied whole, like lua, but
+           otherwise the string ends at a null byte, as with sprintf */
+        size_t len = str->length;
+        if (spec->precision >= 0 || len < 100) {
+          const char *nul = memchr(str->data, 0, len);
+          if (nul != NULL) {
+            len = (size_t) (nul - str->data);
           }
         }
-        APPEND(newstr, len, '"');
+        if (spec->precision >= 0 && len > (size_t) spec->precision) {
+          len = (size_t) spec->precision;
+        }
+        fmt_pad(&b, spec, str->data, len, FALSE);
         break;
       }
 
-      default:
-        sprintf(errbuf, "invalid option '%%%c' to 'format'", fmt[i]);
-        err_rawstr(errbuf, TRUE);
+      case 'q':
+        fmt_quoted(&b, lv_caststring(lstate_getval(argi), argi));
+        break;
     }
   }
 
-  APPEND(newstr, len, 0);
-  newstr->length = len - 1;
-
-  lstate_return1(lv_string(lstr_add(newstr)));
+  lstate_return1(lv_string(lbuf_finish(&b)));
 }
 
 static u32 lua_string_rep(LSTATE) {
@@ -279,16 +494,12 @@ static u32 lua_string_sub(LSTATE) {
 
   FIX_INDICES(start, end, strlen);
 
-  if (end == 0 || end < start) {
+  if (end < start) {
     lstate_return1(str_empty);
   }
 
   size_t len = (size_t) (end - start + 1);
-  lstring_t *newstr = lstr_alloc(len);
-  memcpy(newstr->data, str->data + start, len);
-  newstr->data[len] = 0;
-
-  lstate_return1(lv_string(lstr_add(newstr)));
+  lstate_return1(lv_string(lstr_intern(str->data + start, len)));
 }
 
 static u32 lua_string_len(LSTATE) {
@@ -354,6 +565,9 @@ static u32 lua_string_byte(LSTATE) {
 static u32 lua_string_char(LSTATE) {
   if (argc == 0) {
     lstate_return1(str_empty);
+  } else if (argc == 1) {
+    char c = (char) lstate_getnumber(0);
+    lstate_return1(lv_string(lstr_intern(&c, 1)));
   }
   lstring_t *str = lstr_alloc(argc);
   u32 i;
@@ -364,29 +578,327 @@ static u32 lua_string_char(LSTATE) {
   lstate_return1(lv_string(lstr_add(str)));
 }
 
-static u32 lua_string_find(LSTATE) {
+/**
+ * @brief Convert a lua position in a string to an offset, like posrelat() in
+ *        the reference implementation
+ *
+ * @param pos the position, where negative values count back from the end
+ * @param len the length of the string
+ * @return an offset into the string in [0, len]
+ */
+static size_t str_offset(double pos, size_t len) {
+  i64 off = (i64) pos;
+  if (off < 0) {
+    off += (i64) len + 1;
+  }
+  off--;
+  if (off < 0) {
+    return 0;
+  } else if ((size_t) off > len) {
+    return len;
+  }
+  return (size_t) off;
+}
+
+/**
+ * @brief Test whether a pattern has no special characters, in which case it
+ *        can be searched for as a plain string
+ */
+static int str_isplain(lstring_t *pat) {
+  size_t i;
+  for (i = 0; i < pat->length; i++) {
+    if (pat->data[i] != 0 && strchr(PAT_SPECIALS, pat->data[i]) != NULL) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/**
+ * @brief Get the value of one capture of a match
+ *
+ * @param m the successful match
+ * @param i the index of the capture
+ * @param s the beginning of the whole match
+ * @param e the end of the whole match
+ * @return the captured string, or position. If the pattern had no captures,
+ *         capture 0 is the whole match.
+ */
+static luav str_capture(pmatch_t *m, u32 i, const char *s, const char *e) {
+  if (i >= m->level) {
+    if (i != 0) {
+      err_rawstr("invalid capture index", TRUE);
+    }
+    return lv_string(lstr_intern(s, (size_t) (e - s)));
+  } else if (m->capture[i].len == PAT_CAP_POSITION) {
+    return lv_number((double) (m->capture[i].init - m->src + 1));
+  }
+  return lv_string(lstr_intern(m->capture[i].init,
+                               (size_t) m->capture[i].len));
+}
+
+/**
+ * @brief Return all the captures of a match from a lua function
+ *
+ * @param m the successful match
+ * @param s the beginning of the whole match, or NULL if the whole match
+ *        shouldn't be returned when there are no captures
+ * @param e the end of the whole match
+ * @param n the number of values already returned
+ * @return the total number of values returned
+ */
+static u32 str_captures(pmatch_t *m, const char *s, const char *e, u32 n,
+                        u32 retc, u32 retvi) {
+  u32 i, cnt = pattern_captures(m);
+  if (cnt == 0 && s != NULL) {
+    cnt = 1;
+  }
+  for (i = 0; i < cnt; i++) {
+    lstate_return(str_capture(m, i, s, e), n + i);
+  }
+  return n + cnt;
+}
+
+/**
+ * @brief Shared implementation of string.find and string.match
+ *
+ * @param find TRUE if this is string.find, FALSE if string.match
+ */
+static u32 str_find(int find, LSTATE) {
   lstring_t *s = lstate_getstring(0);
   lstring_t *pat = lstate_getstring(1);
-  i32 init = argc > 2 ? (i32) lstate_getnumber(2) : 1;
+  size_t init = 0;
+  if (argc > 2 && lstate_getval(2) != LUAV_NIL) {
+    init = str_offset(lstate_getnumber(2), s->length);
+  }
 
-  if (init < (i32) -s->length) {
-    init = (i32) s->length;
-  } else if (init < 0) {
-    init += (i32) s->length;
-  } else if (init == 0) {
-    init = 1;
+  if (find && ((argc > 3 && lv_getbool(lstate_getval(3), 3)) ||
+               str_isplain(pat))) {
+    const char *ptr = pattern_memfind(s->data + init, s->length - init,
+                                      pat->data, pat->length);
+    if (ptr == NULL) {
+      lstate_return1(LUAV_NIL);
+    }
+    size_t start = (size_t) (ptr - s->data) + 1;
+    lstate_return(lv_number((double) start), 0);
+    lstate_return(lv_number((double) (start + pat->length - 1)), 1);
+    return 2;
   }
 
-  /* TODO: this is supposed to use regexes... */
-  char *ptr = strstr(s->data + (init - 1), pat->data);
+  pmatch_t m;
+  const char *start;
+  pattern_t *prog = pattern_compile(pat);
+  const char *end = pattern_search(&m, prog, s->data, s->length, init, FALSE,
+                                   &start);
+  /* Captures point into the subject, so the program isn't needed anymore */
+  pattern_release(prog);
+  if (end == NULL) {
+    lstate_return1(LUAV_NIL);
+  }
+  if (!find) {
+    return str_captures(&m, start, end, 0, retc, retvi);
+  }
+  lstate_return(lv_number((double) (start - s->data + 1)), 0);
+  lstate_return(lv_number((double) (end - s->data)), 1);
+  return str_captures(&m, NULL, NULL, 2, retc, retvi);
+}
+
+static u32 lua_string_find(LSTATE) {
+  return str_find(TRUE, argc, argvi, retc, retvi);
+}
+
+static u32 lua_string_match(LSTATE) {
+  return str_find(FALSE, argc, argvi, retc, retvi);
+}
+
+/**
+ * @brief Iterator returned from string.gmatch
+ *
+ * The upvalues are the subject, the pattern, and the offset in the subject to
+ * search from next.
+ */
+static u32 lua_string_gmatch_iterator(LSTATE) {
+  luav *upvalues = vm_running->closure->upvalues;
+  lstring_t *s = lv_getptr(upvalues[0]);
+  size_t init = (size_t) lv_cvt(upvalues[2]);
+  if (init > s->length) {
+    lstate_return1(LUAV_NIL);
+  }
 
-  if (ptr == NULL) {
+  pmatch_t m;
+  const char *start;
+  pattern_t *prog = pattern_compile(lv_getptr(upvalues[1]));
+  const char *end = pattern_search(&m, prog, s->data, s->length, init, TRUE,
+                                   &start);
+  pattern_release(prog);
+  if (end == NULL) {
+    upvalues[2] = lv_number((double) s->length + 1);
     lstate_return1(LUAV_NIL);
   }
+  /* An empty match has to move forward so the same one isn't found again */
+  init = (size_t) (end - s->data) + (end == start);
+  upvalues[2] = lv_number((double) init);
+  return str_captures(&m, start, end, 0, retc, retvi);
+}
+
+static cfunc_t gmatch_iterator = {.f = lua_string_gmatch_iterator,
+                                  .name = "gmatch iterator", .upvalues = 3};
+
+static u32 lua_string_gmatch(LSTATE) {
+  lstring_t *s = lstate_getstring(0);
+  lstring_t *pat = lstate_getstring(1);
+  /* Compile now so that errors in the pattern show up here */
+  pattern_release(pattern_compile(pat));
+
+  lclosure_t *closure = gc_alloc(CLOSURE_SIZE(3), LFUNCTION);
+  closure->type = LUAF_C;
+  closure->function.c = &gmatch_iterator;
+  closure->env = vm_running->caller->closure->env;
+  closure->upvalues[0] = lv_string(s);
+  closure->upvalues[1] = lv_string(pat);
+  closure->upvalues[2] = lv_number(0);
+  lstate_return1(lv_function(closure));
+}
+
+/**
+ * @brief Append one capture of a match to a buffer, without creating a lua
+ *        string for it
+ */
+static void str_addcapture(lbuf_t *b, pmatch_t *m, u32 i,
+                           const char *s, const char *e) {
+  if (i >= m->level) {
+    if (i != 0) {
+      err_rawstr("invalid capture index", TRUE);
+    }
+    lbuf_addmem(b, s, (size_t) (e - s));
+  } else if (m->capture[i].len == PAT_CAP_POSITION) {
+    lbuf_addnum(b, (double) (m->capture[i].init - m->src + 1));
+  } else {
+    lbuf_addmem(b, m->capture[i].init, (size_t) m->capture[i].len);
+  }
+}
+
+/**
+ * @brief Append the replacement for one match in string.gsub to a buffer
+ *
+ * @param b the buffer being built
+ * @param m the successful match
+ * @param s the beginning of the match
+ * @param e the end of the match
+ * @param repl the replacement table or function
+ * @param rstr the replacement string, or NULL if repl isn't a string
+ */
+static void str_addvalue(lbuf_t *b, pmatch_t *m, const char *s, const char *e,
+                         luav repl, lstring_t *rstr) {
+  u32 i, cnt = pattern_captures(m);
+  if (rstr != NULL) {
+    for (i = 0; i < rstr->length; i++) {
+      char c = rstr->data[i];
+      if (c != '%') {
+        lbuf_addchar(b, c);
+        continue;
+      }
+      /* A trailing '%' escapes the null terminator, as in lua 5.1 */
+      c = rstr->data[++i];
+      if (!isdigit((unsigned char) c)) {
+        lbuf_addchar(b, c);
+      } else if (c == '0') {
+        lbuf_addmem(b, s, (size_t) (e - s));
+      } else {
+        str_addcapture(b, m, (u32) (c - '1'), s, e);
+      }
+    }
+    return;
+  }
+
+  luav value;
+  if (lv_istable(repl)) {
+    value = lhash_get(lv_gettable(repl, 2), str_capture(m, 0, s, e));
+  } else {
+    if (cnt == 0) {
+      cnt = 1;
+    }
+    u32 idx = vm_stack_alloc(vm_stack, cnt);
+    for (i = 0; i < cnt; i++) {
+      vm_stack->base[idx + i] = str_capture(m, i, s, e);
+    }
+    u32 ret = vm_fun(lv_getfunction(repl, 2), cnt, idx, 1, idx);
+    value = ret > 0 ? vm_stack->base[idx] : LUAV_NIL;
+    vm_stack_dealloc(vm_stack, idx);
+  }
+
+  if (!lv_getbool(value, 0)) {
+    lbuf_addmem(b, s, (size_t) (e - s));
+  } else if (lv_isstring(value)) {
+    lbuf_addstr(b, (lstring_t*) lv_getptr(value));
+  } else if (lv_isnumber(value)) {
+    lbuf_addnum(b, lv_cvt(value));
+  } else {
+    sprintf(errbuf, "invalid replacement value (a %s)",
+            err_typestr(lv_gettype(value)));
+    err_rawstr(errbuf, TRUE);
+  }
+}
+
+static void str_unwind_pattern(void *prog) {
+  pattern_release(prog);
+}
+
+static u32 lua_string_gsub(LSTATE) {
+  lstring_t *src = lstate_getstring(0);
+  lstring_t *pat = lstate_getstring(1);
+  luav repl = lstate_getval(2);
+  lstring_t *rstr = NULL;
+  size_t max = src->length + 1;
+  if (argc > 3 && lstate_getval(3) != LUAV_NIL) {
+    double n = lstate_getnumber(3);
+    max = n < 0 ? 0 : (size_t) n;
+  }
+  if (lv_isstring(repl) || lv_isnumber(repl)) {
+    rstr = lv_caststring(repl, 2);
+  } else if (!lv_istable(repl) && !lv_isfunction(repl)) {
+    err_str(2, "string/function/table expected");
+  }
+
+  lbuf_t b;
+  pmatch_t m;
+  const char *s = src->data;
+  const char *end = s + src->length;
+  const char *p = s;
+  size_t n = 0;
+  pattern_t *prog = pattern_compile(pat);
+  lbuf_init(&b);
+  /* Replacement functions can raise errors, which have to give the program
+     back as well as the buffer */
+  lbuf_onunwind(&b, str_unwind_pattern, prog);
+
+  while (n < max) {
+    const char *start;
+    const char *e = pattern_search(&m, prog, s, src->length, (size_t) (p - s),
+                                   FALSE, &start);
+    if (e == NULL) {
+      break;
+    }
+    lbuf_addmem(&b, p, (size_t) (start - p));
+    n++;
+    str_addvalue(&b, &m, start, e, repl, rstr);
+    if (e > start) {
+      p = e;
+    } else if (start < end) {
+      lbuf_addchar(&b, *start);
+      p = start + 1;
+    } else {
+      p = end;
+      break;
+    }
+    if (*pat->data == '^') {
+      break;
+    }
+  }
+  lbuf_addmem(&b, p, (size_t) (end - p));
+  pattern_release(prog);
 
-  size_t start = ((size_t) ptr - (size_t) s->data) + 1;
-  size_t end = start + pat->length - 1;
-  lstate_return(lv_number((double) start), 0);
-  lstate_return(lv_number((double) end), 1);
+  lstate_return(lv_string(lbuf_finish(&b)), 0);
+  lstate_return(lv_number((double) n), 1);
   return 2;
 }
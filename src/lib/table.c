@@ -11,6 +11,7 @@
 
 #include "config.h"
 #include "gc.h"
+#include "lbuf.h"
 #include "lhash.h"
 #include "lstate.h"
 #include "vm.h"
@@ -171,27 +172,21 @@ static u32 lua_table_concat(LSTATE) {
     lstate_return1(lv_string(lstr_empty()));
   }
 
-  size_t str_size = 0;
+  lbuf_t b;
+  lbuf_init(&b);
   for (k = i; k <= j && k <= table->length; k++) {
-    lstring_t *str = lv_caststring(table->array[k], 0);
-    str_size += str->length + sep->length;
-  }
-  str_size -= sep->length;
-
-  lstring_t *ret = lstr_alloc(str_size);
-  char *str_data = ret->data;
-  for (k = i; k <= j && k <= table->length; k++) {
-    lstring_t *str = lv_caststring(table->array[k], 0);
-    memcpy(str_data, str->data, str->length);
-    str_data += str->length;
+    luav value = table->array[k];
+    if (lv_isnumber(value)) {
+      lbuf_addnum(&b, lv_cvt(value));
+    } else {
+      lbuf_addstr(&b, lv_caststring(value, 0));
+    }
     if (k != j && k < table->length) {
-      memcpy(str_data, sep->data, sep->length);
-      str_data += sep->length;
+      lbuf_addstr(&b, sep);
     }
   }
-  *str_data = 0;
 
-  ret = lstr_add(ret);
+  lstring_t *ret = lbuf_finish(&b);
   lstate_return(lv_string(ret), 0);
   gc_check();
   return 1;
@@ -7,7 +7,9 @@
 #include <llvm-c/Core.h>
 #include <llvm-c/ExecutionEngine.h>
 #include <llvm-c/Transforms/Scalar.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "config.h"
@@ -16,6 +18,7 @@
 #include "llvm.h"
 #include "opcode.h"
 #include "panic.h"
+#include "util.h"
 #include "vm.h"
 
 typedef LLVMValueRef      Value;
@@ -25,26 +28,36 @@ typedef LLVMValueRef(Binop)(LLVMBuilderRef, Value, Value, const char*);
 typedef i32(jitf)(void*, void*);
 
 #define GOTOBB(idx) LLVMBuildBr(builder, DSTBB(idx))
-#define DSTBB(idx) (blocks[idx] == NULL ? BAILBB(idx) : blocks[idx])
-#define BAILBB(idx) NEWBB(idx, bail_blocks, {})
-#define ERRBB(idx)  NEWBB(idx, err_blocks, { ERROR(); })
-#define NEWBB(idx, arr, extra) ({                                   \
+/* Leaving the compiled region is expected, but reaching an untraced
+   instruction inside of it means a guess made while compiling was wrong */
+#define DSTBB(idx) (blocks[idx] != NULL ? blocks[idx] :                   \
+                    ((idx) >= start && (idx) <= end) ? EXITBB(idx) :      \
+                    BAILBB(idx))
+#define BAILBB(idx) NEWBB(idx, bail_blocks, { SNAPSHOT(idx); }, leave_block)
+#define EXITBB(idx) NEWBB(idx, exit_blocks,                              \
+                          { build_side_exit(&s, jfun, idx);               \
+                            SNAPSHOT(idx); }, leave_block)
+#define ERRBB(idx)  NEWBB(idx, err_blocks, { ERROR(); SNAPSHOT(idx); }, \
+                          ret_block)
+#define NEWBB(idx, arr, extra, exit) ({                             \
     BasicBlock tmp = arr[idx];                                      \
     if (tmp == NULL) {                                              \
       BasicBlock cur = LLVMGetInsertBlock(builder);                 \
       tmp = LLVMInsertBasicBlock(ret_block, "");                    \
       LLVMPositionBuilderAtEnd(builder, tmp);                       \
       { extra };                                                    \
-      RETURN((i32) (idx));                                          \
+      RETURN((i32) (idx), exit);                                    \
       LLVMPositionBuilderAtEnd(builder, cur);                       \
       arr[idx] = tmp;                                               \
     }                                                               \
     tmp;                                                            \
   })
-#define RETURN(ret)                                                   \
+#define RETURN(ret, exit)                                             \
   Value r = LLVMConstInt(llvm_i32, (long long unsigned) (ret), TRUE); \
   LLVMBuildStore(builder, r, ret_val);                                \
-  LLVMBuildBr(builder, ret_block);
+  LLVMBuildBr(builder, exit);
+#define SNAPSHOT(idx) \
+  build_snapshot(&s, &dirty[(idx) * words], &live_regs[(idx) * words])
 #define ERROR() {                                                              \
     Value ptr = LLVMConstInt(llvm_u64, (size_t) &jit_bailed, FALSE);           \
     LLVMBuildStore(builder, lvc_32_one, LLVMConstIntToPtr(ptr, llvm_u32_ptr)); \
@@ -60,12 +73,27 @@ typedef i32(jitf)(void*, void*);
     }                                         \
   }
 #define TYPE(idx) \
-  ((u8) (((idx) >= 256 ? \
-          (lv_gettype(func->consts[(idx) - 256]) | TRACE_CONST):\
-          regtyps[idx]) & ~TRACE_UPVAL))
+  ((u8) ((idx) >= 256 ? \
+         (lv_gettype(func->consts[(idx) - 256]) | TRACE_CONST):\
+         regtyps[idx]))
 #define LTYPE(idx) ((u8) (TYPE(idx) & TRACE_TYPEMASK))
-#define SETTYPE(idx, typ) \
-  regtyps[idx] = (u8) ((regtyps[idx] & TRACE_UPVAL) | (typ))
+/* An array access keyed by the counter of its loop indexes with the counter
+   itself, and skips its bounds check if the loop's range was found in bounds
+   on the way into the loop */
+#define ARRAY_KEY(pc, index, in_bounds)                                   \
+  if (array_loops[pc] != 0) {                                             \
+    u32 __a = A(func->instrs[array_loops[pc]].instr);                     \
+    index     = LLVMBuildLoad(builder, ivars[__a], "");                   \
+    in_bounds = LLVMBuildLoad(builder, proven[pc], "");                   \
+  }
+#define SETTYPE(idx, typ) regtyps[idx] = (u8) (typ)
+/* The garbage collector only sees the lua stack, so objects used after the
+   call at i - 1 which only live in registers are stored there beforehand.
+   Registers unchanged since entry are already on the stack */
+#define CALL_KEEP(j) (BIT_TEST(&live_regs[i * words], j) &&         \
+                      BIT_TEST(&dirty[(i - 1) * words], j) &&       \
+                      LTYPE(j) != LNUMBER && LTYPE(j) != LBOOLEAN && \
+                      LTYPE(j) != LNIL)
 #define TOPTR(v) ({                                             \
     Value __tmp = LLVMBuildAnd(builder, v, lvc_data_mask, "");  \
     LLVMBuildIntToPtr(builder, __tmp, llvm_void_ptr, "");       \
@@ -80,10 +108,14 @@ typedef i32(jitf)(void*, void*);
 #define ADD_FUNCTION(name, ret, numa, ...) \
   ADD_FUNCTION2(name, #name, ret, numa, __VA_ARGS__)
 #define EXIT_FAIL LLVMDeleteFunction(function); return -1
+#define BIT_SET(set, i) ((set)[(i) / 64] |= (u64) 1 << ((i) % 64))
+#define BIT_TEST(set, i) ((set)[(i) / 64] & ((u64) 1 << ((i) % 64)))
+#define BIT_CLEAR(set, i) ((set)[(i) / 64] &= ~((u64) 1 << ((i) % 64)))
 
 typedef struct prolog {
   Value*  stacki;
   Value*  retc;
+  Value*  retca;
   Value*  retvi;
   Value*  argc;
   Value*  argca;
@@ -96,14 +128,70 @@ typedef struct state {
   Value       *regs;
   Value       *consts;
   u8          *types;
+  u8          *captured;  //<! Registers which closures hold upvalues for
+  Value       base_addr;  //<! Address of vm_stack->base
+  Value       stacki;     //<! Index of our frame on the lua stack
   lfunc_t     *func;
+  lfunc_t     *live;      //<! Function being run, which func may be a copy of
   Value       function;
   BasicBlock  *blocks;
 } state_t;
 
+/* Where a request is on its way through the compiler thread */
+#define JREQ_QUEUED    0
+#define JREQ_COMPILING 1
+#define JREQ_DONE      2
+
+/* What's known about the callee of a call when it's requested */
+#define JCALL_TRACED 1  //<! A closure was traced at the call
+#define JCALL_LUA    2  //<! The closure is a lua function
+#define JCALL_DIRECT 4  //<! Called straight through its compiled code
+
+/* A piece of a function to compile. When compiling asynchronously the
+   interpreter keeps running (and tracing) the function in the meantime, so
+   the request compiles a snapshot of the function's counts and traces taken
+   when it was made */
+typedef struct jrequest {
+  lfunc_t     *func;      //<! Function the result is installed into
+  lfunc_t     *snap;      //<! What's compiled, func itself or a copy of it
+  u8          *types;     //<! Types of the registers when requested
+  u32         start;
+  u32         end;
+  int         full;
+  u8          tier;       //<! JIT_TIER_* to compile at
+  jfunc_t     *prev;      //<! Code of a lower tier this replaces, if any
+  jfunc_t     *jfun;      //<! Handle the generated code refers to
+  u8          *calls;     //<! JCALL_* flags of each call from start
+  jfunc_t     **inlined;  //<! Code inlined at each call from start, or NULL
+  void        *binary;    //<! Machine code, once compiled
+  Value       value;      //<! LLVM function, once compiled
+  i32         result;     //<! Result of llvm_translate()
+  int         state;      //<! One of the JREQ_* constants
+  struct jrequest *next;
+} jrequest_t;
+
+/* Garbage LLVM functions which only the compiler thread may delete */
+typedef struct jgarbage {
+  Value value;
+  struct jgarbage *next;
+} jgarbage_t;
+
+/* Background compilation. The request list is only ever linked and unlinked
+   by the interpreter's thread, so it can read it without the lock */
+static pthread_t       jit_thread;
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jit_cond = PTHREAD_COND_INITIALIZER;
+static jrequest_t      *jit_requests;
+static jgarbage_t      *jit_garbage;
+static u32             jit_pending;
+static int             jit_finished;  //<! Set when a request is done
+static int             jit_running;
+static int             jit_stop;
+
 /* Global contexts for LLVM compilation */
 static LLVMModuleRef module;
-static LLVMPassManagerRef pass_manager;
+static LLVMPassManagerRef pass_manager;   //<! Passes of the optimizing tier
+static LLVMPassManagerRef pass_baseline;  //<! Passes of the baseline tier
 static LLVMExecutionEngineRef ex_engine;
 static LLVMBuilderRef builder;
 
@@ -139,12 +227,42 @@ static Value llvm_memmove;
 static Value llvm_gc_check;
 static Value llvm_vm_alloc;
 static Value llvm_vm_dealloc;
+static Value llvm_vm_close;
 static Value llvm_functions[128];
 static u32   llvm_fn_cnt = 0;
 
+/* Type-based alias analysis tags for the fields of tables which compiled code
+   accesses directly. Storing into an array part or bumping a version can't
+   move the array part, so loads of where it is can be hoisted out of loops */
+static u32   tbaa_kind;
+static Value tbaa_acap;
+static Value tbaa_array;
+static Value tbaa_meta;
+static Value tbaa_version;
+static Value tbaa_slot;
+
 Value build_pow(LLVMBuilderRef builder, Value bv, Value cv, const char* name);
 static Value get_stack_base(Value base_addr, Value offset, char *name);
 static Value get_vm_stack_base(void);
+static void *llvm_worker(void *arg);
+static void llvm_gc();
+static void jrequest_free(jrequest_t *req);
+
+/**
+ * @brief Builds the access tag of a scalar type for alias analysis
+ *
+ * @param root the root of the type hierarchy
+ * @param name the name of the type, accesses of differently named types never
+ *        alias each other
+ * @return the tag to attach to loads and stores of the type
+ */
+static Value tbaa_tag(Value root, char *name) {
+  Value zero    = LLVMConstInt(llvm_u64, 0, FALSE);
+  Value type[3] = {LLVMMDString(name, (u32) strlen(name)), root, zero};
+  Value node    = LLVMMDNode(type, 3);
+  Value tag[3]  = {node, node, zero};
+  return LLVMMDNode(tag, 3);
+}
 
 /**
  * @brief Initialize LLVM globals and engines needed for JIT compilation
@@ -159,25 +277,42 @@ void llvm_init() {
   pass_manager = LLVMCreateFunctionPassManagerForModule(module);
   xassert(pass_manager != NULL);
   LLVMAddVerifierPass(pass_manager);
+  LLVMAddTypeBasedAliasAnalysisPass(pass_manager);
+  LLVMAddBasicAliasAnalysisPass(pass_manager);
   LLVMAddJumpThreadingPass(pass_manager);
   LLVMAddPromoteMemoryToRegisterPass(pass_manager);
+  /* Registers are boxed u64s, so a register only ever holding numbers is a
+     phi of bitcasts from doubles once promoted. Combining right away turns
+     those into phis of doubles before the loop passes look at them */
+  LLVMAddInstructionCombiningPass(pass_manager);
   LLVMAddCFGSimplificationPass(pass_manager);
   LLVMAddReassociatePass(pass_manager);
   LLVMAddGVNPass(pass_manager);
   LLVMAddConstantPropagationPass(pass_manager);
   LLVMAddDeadStoreEliminationPass(pass_manager);
   LLVMAddAggressiveDCEPass(pass_manager);
-  LLVMAddIndVarSimplifyPass(pass_manager);
   LLVMAddLoopRotatePass(pass_manager);
   LLVMAddLICMPass(pass_manager);
-  LLVMAddLoopUnrollPass(pass_manager);
   LLVMAddLoopUnswitchPass(pass_manager);
+  /* Unswitching takes the guards of table accesses which can't change in the
+     loop out of it, so what they guarded can now be hoisted too */
+  LLVMAddLICMPass(pass_manager);
+  LLVMAddIndVarSimplifyPass(pass_manager);
+  LLVMAddLoopUnrollPass(pass_manager);
   LLVMAddSCCPPass(pass_manager);
   LLVMAddInstructionCombiningPass(pass_manager);
   LLVMAddMemCpyOptPass(pass_manager);
   LLVMAddCFGSimplificationPass(pass_manager);
   LLVMInitializeFunctionPassManager(pass_manager);
 
+  /* The baseline tier only cleans up after the translation */
+  pass_baseline = LLVMCreateFunctionPassManagerForModule(module);
+  xassert(pass_baseline != NULL);
+  LLVMAddVerifierPass(pass_baseline);
+  LLVMAddPromoteMemoryToRegisterPass(pass_baseline);
+  LLVMAddCFGSimplificationPass(pass_baseline);
+  LLVMInitializeFunctionPassManager(pass_baseline);
+
   /* Builder and execution engine */
   char *errs;
   LLVMBool err = LLVMCreateJITCompilerForModule(&ex_engine, module, 100, &errs);
@@ -210,6 +345,17 @@ void llvm_init() {
   lvc_false     = LLVMConstInt(llvm_u64, LUAV_FALSE, FALSE);
   lvc_luav      = LLVMConstInt(llvm_u32, sizeof(luav), FALSE);
 
+  /* Alias analysis of table fields */
+  char *root_name = "joule tbaa";
+  Value root   = LLVMMDString(root_name, (u32) strlen(root_name));
+  root         = LLVMMDNode(&root, 1);
+  tbaa_kind    = LLVMGetMDKindID("tbaa", 4);
+  tbaa_acap    = tbaa_tag(root, "lhash.acap");
+  tbaa_array   = tbaa_tag(root, "lhash.array");
+  tbaa_meta    = tbaa_tag(root, "lhash.metatable");
+  tbaa_version = tbaa_tag(root, "lhash.version");
+  tbaa_slot    = tbaa_tag(root, "luav");
+
   /* Adding functions */
   ADD_FUNCTION(lhash_get, llvm_u64, 2, llvm_void_ptr, llvm_u64);
   ADD_FUNCTION(lhash_set, LLVMVoidType(), 3, llvm_void_ptr, llvm_u64, llvm_u64);
@@ -222,15 +368,16 @@ void llvm_init() {
                 llvm_double);
   ADD_FUNCTION(lhash_hint, llvm_void_ptr, 2, llvm_u32, llvm_u32);
   ADD_FUNCTION(lstr_compare, llvm_i32, 2, llvm_void_ptr, llvm_void_ptr);
+  ADD_FUNCTION(lstr_equal, llvm_i32, 2, llvm_void_ptr, llvm_void_ptr);
   ADD_FUNCTION(lclosure_alloc, llvm_void_ptr, 2, llvm_void_ptr, llvm_u32);
-  ADD_FUNCTION(lupvalue_alloc, llvm_u64, 1, llvm_u64);
+  ADD_FUNCTION(lupvalue_find, llvm_u64, 2, llvm_void_ptr, llvm_u32);
   ADD_FUNCTION2(llvm_memmove, "llvm.memmove.p0i8.p0i8.i32", LLVMVoidType(), 5,
                 llvm_void_ptr, llvm_void_ptr, llvm_u32, llvm_u32,
                 LLVMInt1Type());
   ADD_FUNCTION2(llvm_memcpy, "llvm.memcpy.p0i8.p0i8.i32", LLVMVoidType(), 5,
                 llvm_void_ptr, llvm_void_ptr, llvm_u32, llvm_u32,
                 LLVMInt1Type());
-  ADD_FUNCTION(lv_concat, llvm_u64, 2, llvm_u64, llvm_u64);
+  ADD_FUNCTION(lv_concatn, llvm_u64, 2, llvm_u64_ptr, llvm_u32);
   ADD_FUNCTION(lhash_array, LLVMVoidType(), 3, llvm_void_ptr, llvm_u64_ptr,
                llvm_u32);
   ADD_FUNCTION(gc_check, LLVMVoidType(), 0);
@@ -238,6 +385,8 @@ void llvm_init() {
                llvm_u32, llvm_u32, llvm_u32, llvm_u32, llvm_u32, llvm_u32);
   ADD_FUNCTION(vm_stack_alloc, llvm_u32, 2, llvm_void_ptr, llvm_u32);
   ADD_FUNCTION(vm_stack_dealloc, LLVMVoidType(), 2, llvm_void_ptr, llvm_u32);
+  ADD_FUNCTION(vm_stack_grow, LLVMVoidType(), 2, llvm_void_ptr, llvm_u32);
+  ADD_FUNCTION(vm_stack_close, LLVMVoidType(), 2, llvm_void_ptr, llvm_u32);
 
   llvm_lhash_get  = LLVMGetNamedFunction(module, "lhash_get");
   llvm_lhash_set  = LLVMGetNamedFunction(module, "lhash_set");
@@ -247,6 +396,42 @@ void llvm_init() {
   llvm_gc_check   = LLVMGetNamedFunction(module, "gc_check");
   llvm_vm_alloc   = LLVMGetNamedFunction(module, "vm_stack_alloc");
   llvm_vm_dealloc = LLVMGetNamedFunction(module, "vm_stack_dealloc");
+  llvm_vm_close   = LLVMGetNamedFunction(module, "vm_stack_close");
+
+  if (JIT_ASYNC) {
+    gc_add_hook(llvm_gc);
+    jit_running = pthread_create(&jit_thread, NULL, llvm_worker, NULL) == 0;
+  }
+}
+
+/**
+ * @brief Stops the background compiler, abandoning outstanding requests
+ *
+ * Must be called before the heap is torn down, as pending compilations refer
+ * to functions on it. Afterwards everything is compiled synchronously.
+ */
+void llvm_stop() {
+  if (!jit_running) return;
+  pthread_mutex_lock(&jit_lock);
+  jit_stop = TRUE;
+  pthread_cond_signal(&jit_cond);
+  pthread_mutex_unlock(&jit_lock);
+  pthread_join(jit_thread, NULL);
+  jit_running = FALSE;
+
+  while (jit_garbage != NULL) {
+    jgarbage_t *g = jit_garbage;
+    jit_garbage = g->next;
+    LLVMFreeMachineCodeForFunction(ex_engine, g->value);
+    LLVMDeleteFunction(g->value);
+    free(g);
+  }
+  while (jit_requests != NULL) {
+    jrequest_t *req = jit_requests;
+    jit_requests = req->next;
+    jrequest_free(req);
+  }
+  jit_pending = 0;
 }
 
 /**
@@ -254,12 +439,15 @@ void llvm_init() {
  */
 void llvm_destroy() {
   u32 i;
+  llvm_stop();
   for (i = 0; i < llvm_fn_cnt; i++) {
     LLVMDeleteFunction(llvm_functions[i]);
   }
 
   LLVMFinalizeFunctionPassManager(pass_manager);
   LLVMDisposePassManager(pass_manager);
+  LLVMFinalizeFunctionPassManager(pass_baseline);
+  LLVMDisposePassManager(pass_baseline);
   LLVMDisposeBuilder(builder);
   LLVMDisposeExecutionEngine(ex_engine);
   LLVMContextDispose(LLVMGetGlobalContext());
@@ -299,6 +487,27 @@ static Value get_vm_stack_base(void) {
   return LLVMBuildBitCast(builder, base_addr, stack_typ, "");
 }
 
+/**
+ * @brief Builds the address of a register
+ *
+ * Registers normally live in allocas, but a register which is captured by a
+ * closure anywhere in the function lives in its slot on the lua stack instead
+ * so that open upvalues pointing at it always see the current value.
+ *
+ * @param s the current state
+ * @param idx the register index
+ *
+ * @return the address of the register, as a u64 pointer
+ */
+static Value build_regaddr(state_t *s, u32 idx) {
+  if (!s->captured[idx]) {
+    return s->regs[idx];
+  }
+  Value stack = get_stack_base(s->base_addr, s->stacki, "");
+  Value off   = LLVMConstInt(llvm_u32, idx, FALSE);
+  return LLVMBuildInBoundsGEP(builder, stack, &off, 1, "");
+}
+
 /**
  * @brief Builds a register set
  *
@@ -307,12 +516,7 @@ static Value get_vm_stack_base(void) {
  * @param v the value to set the register to as a u64
  */
 static void build_regset(state_t *s, u32 idx, Value v) {
-  Value addr = s->regs[idx];
-  if (TRACE_ISUPVAL(s->types[idx])) {
-    addr = TOPTR(LLVMBuildLoad(builder, addr, ""));
-    addr = LLVMBuildBitCast(builder, addr, llvm_u64_ptr, "");
-  }
-  LLVMBuildStore(builder, v, addr);
+  LLVMBuildStore(builder, v, build_regaddr(s, idx));
 }
 
 /**
@@ -324,12 +528,7 @@ static void build_regset(state_t *s, u32 idx, Value v) {
  * @return the register as a u64
  */
 static Value build_reg(state_t *s, u32 idx) {
-  Value tmp = LLVMBuildLoad(builder, s->regs[idx], "");
-  if (TRACE_ISUPVAL(s->types[idx])) {
-    tmp = LLVMBuildBitCast(builder, TOPTR(tmp), llvm_u64_ptr, "");
-    tmp = LLVMBuildLoad(builder, tmp, "");
-  }
-  return tmp;
+  return LLVMBuildLoad(builder, build_regaddr(s, idx), "");
 }
 
 /**
@@ -378,6 +577,117 @@ static void build_binop(state_t *s, u32 code, Binop operation) {
   build_regset(s, A(code), res);
 }
 
+/**
+ * @brief Builds the conversion of a double to an i32, along with a test of
+ *        whether the double was exactly that integer
+ *
+ * Boxed values other than numbers are NaNs, so they always fail the test.
+ *
+ * @param d the double to convert
+ * @param ok filled in with an i1 which is true if the conversion was exact
+ * @return the i32, which is meaningless unless ok is true
+ */
+static Value build_toi32(Value d, Value *ok) {
+  Value lo = LLVMBuildFCmp(builder, LLVMRealOGE, d,
+                           LLVMConstReal(llvm_double, INT32_MIN), "");
+  Value hi = LLVMBuildFCmp(builder, LLVMRealOLE, d,
+                           LLVMConstReal(llvm_double, INT32_MAX), "");
+  Value in_range = LLVMBuildAnd(builder, lo, hi, "");
+  /* Converting anything out of range would be undefined */
+  Value safe = LLVMBuildSelect(builder, in_range, d,
+                               LLVMConstReal(llvm_double, 0), "");
+  Value n    = LLVMBuildFPToSI(builder, safe, llvm_i32, "");
+  Value back = LLVMBuildSIToFP(builder, n, llvm_double, "");
+  Value same = LLVMBuildFCmp(builder, LLVMRealOEQ, back, d, "");
+  *ok = LLVMBuildAnd(builder, in_range, same, "");
+  return n;
+}
+
+/**
+ * @brief Builds a test of whether a register holds an integer which fits in
+ *        an i32
+ *
+ * @param s the current state
+ * @param reg the register to test
+ * @return an i1 which is true if the register holds such an integer
+ */
+static Value build_isi32(state_t *s, u32 reg) {
+  Value ok;
+  build_toi32(build_kregf(s, reg), &ok);
+  return ok;
+}
+
+/**
+ * @brief Returns the directions a numeric for loop may step in
+ *
+ * A loop which hasn't run, or whose FORPREP has failed its guards too often,
+ * isn't assumed to step in either direction.
+ *
+ * @param func the function containing the loop
+ * @param loop the FORLOOP of the loop
+ * @return TRACE_FOR_UP, TRACE_FOR_DOWN or TRACE_FOR_ANY
+ */
+static u8 llvm_fordir(lfunc_t *func, u32 loop) {
+  u32 prep = (u32) ((i32) loop + SBX(func->instrs[loop].instr));
+  u8 dir = func->trace.instrs[loop][0];
+  if (dir == LANY || JIT_WIDENED(&func->instrs[prep])) {
+    return TRACE_FOR_ANY;
+  }
+  return dir;
+}
+
+/**
+ * @brief Builds the guard of a numeric for loop over registers a to a + 2
+ *
+ * The index and limit have to be numbers, and the step has to have the sign
+ * the loop was traced with, unless it has been seen stepping both ways. A
+ * narrowed loop also needs all three to be integers which fit in an i32,
+ * which lets it count with an i64 that can never overflow.
+ *
+ * @param s the current state
+ * @param a the first register of the loop
+ * @param dir the directions the loop may step in, from llvm_fordir()
+ * @param narrow whether the loop counts with an integer
+ * @return an i1 which is true if the loop can run as compiled
+ */
+static Value build_forguard(state_t *s, u32 a, u8 dir, int narrow) {
+  Value step = build_kregf(s, a + 2);
+  Value ok;
+  if (dir == TRACE_FOR_ANY) {
+    ok = LLVMConstInt(LLVMInt1Type(), 1, FALSE);
+  } else {
+    ok = LLVMBuildFCmp(builder,
+                       dir == TRACE_FOR_DOWN ? LLVMRealOLT : LLVMRealOGT,
+                       step, LLVMConstReal(llvm_double, 0), "");
+  }
+  if (narrow) {
+    ok = LLVMBuildAnd(builder, ok, build_isi32(s, a), "");
+    ok = LLVMBuildAnd(builder, ok, build_isi32(s, a + 1), "");
+    return LLVMBuildAnd(builder, ok, build_isi32(s, a + 2), "");
+  }
+  Value index = build_kregf(s, a);
+  Value limit = build_kregf(s, a + 1);
+  ok = LLVMBuildAnd(builder, ok,
+                    LLVMBuildFCmp(builder, LLVMRealORD, index, limit, ""), "");
+  return ok;
+}
+
+/**
+ * @brief Builds the conversion of a register holding an integral number to
+ *        an i64
+ */
+static Value build_regint(state_t *s, u32 reg) {
+  return LLVMBuildFPToSI(builder, build_kregf(s, reg), llvm_u64, "");
+}
+
+/**
+ * @brief Builds the conversion of an i64 to a boxed number
+ */
+static Value build_intnum(Value v) {
+  Value d = LLVMBuildSIToFP(builder, v, llvm_double, "");
+  return LLVMBuildBitCast(builder, d, llvm_u64, "");
+}
+
 /**
  * @brief Get the base of the variable number of arguments on the stack, based
  *        on the previous instruction
@@ -431,9 +741,9 @@ static void build_lhash_get(state_t *state, size_t i, Value table, Value key,
     equal = insertbb(state->function, state->blocks[i]);
     diff = insertbb(state->function, state->blocks[i]);
     Value version = build_lhash_version(table);
-    u64 *trace_version    = &state->func->trace.misc[i].table.version;
-    luav *trace_value     = &state->func->trace.misc[i].table.value;
-    lhash_t **trace_table = &state->func->trace.misc[i].table.pointer;
+    u64 *trace_version    = &state->live->trace.misc[i].table.version;
+    luav *trace_value     = &state->live->trace.misc[i].table.value;
+    lhash_t **trace_table = &state->live->trace.misc[i].table.pointer;
     Value tversion = LLVMConstInt(llvm_u64, (size_t) trace_version, FALSE);
     Value tvalue = LLVMConstInt(llvm_u64, (size_t) trace_value, FALSE);
     Value ttable = LLVMConstInt(llvm_u64, (size_t) trace_table, FALSE);
@@ -470,6 +780,170 @@ static void build_lhash_get(state_t *state, size_t i, Value table, Value key,
   }
 }
 
+/**
+ * @brief Tags a load or store with what it accesses, for alias analysis
+ */
+static Value build_tbaa(Value inst, Value tag) {
+  LLVMSetMetadata(inst, tbaa_kind, tag);
+  return inst;
+}
+
+/**
+ * @brief Builds the address of a field of a table
+ *
+ * @param table the void* pointer to the table
+ * @param offset the offset of the field in an lhash_t
+ * @param typ the pointer type of the field's address
+ */
+static Value build_lhash_field(Value table, size_t offset, Type typ) {
+  Value off  = LLVMConstInt(llvm_u64, offset, FALSE);
+  Value addr = LLVMBuildInBoundsGEP(builder, table, &off, 1, "");
+  return LLVMBuildBitCast(builder, addr, typ, "");
+}
+
+/**
+ * @brief Builds a load of the capacity of a table's array part, as an i64
+ */
+static Value build_lhash_acap(Value table) {
+  Value addr = build_lhash_field(table, offsetof(lhash_t, acap), llvm_u32_ptr);
+  Value acap = build_tbaa(LLVMBuildLoad(builder, addr, ""), tbaa_acap);
+  return LLVMBuildZExt(builder, acap, llvm_u64, "");
+}
+
+/**
+ * @brief Builds a test of whether a boxed value has a type
+ *
+ * @param v the boxed value
+ * @param typ the type to test for
+ * @return an i1 which is true if the value has the type
+ */
+static Value build_hastype(Value v, u8 typ) {
+  if (typ == LNUMBER) {
+    /* Anything which isn't a NaN, or is the one NaN which is a number */
+    Value bits = LLVMBuildAnd(builder, v, lvc_nan_mask, "");
+    Value not_nan = LLVMBuildICmp(builder, LLVMIntNE, bits, lvc_nan_mask, "");
+    Value mask = LLVMConstInt(llvm_u64, UINT64_C(7) << LUAV_DATA_SIZE, FALSE);
+    bits = LLVMBuildAnd(builder, v, mask, "");
+    Value nan = LLVMBuildICmp(builder, LLVMIntEQ, bits, lvc_64_zero, "");
+    return LLVMBuildOr(builder, not_nan, nan, "");
+  }
+  Value bits = LLVMBuildAnd(builder, v, lvc_type_mask, "");
+  Value want = LLVMConstInt(llvm_u64, LUAV_PACK(typ, 0), FALSE);
+  return LLVMBuildICmp(builder, LLVMIntEQ, bits, want, "");
+}
+
+/**
+ * @brief Builds a test of whether a boxed value is a table
+ */
+static Value build_istable(Value v) {
+  Value typ  = LLVMBuildAnd(builder, v, lvc_type_mask, "");
+  Value want = LLVMConstInt(llvm_u64, LUAV_PACK(LTABLE, 0), FALSE);
+  return LLVMBuildICmp(builder, LLVMIntEQ, typ, want, "");
+}
+
+/**
+ * @brief Builds the lookup of the slot in a table's array part holding a key
+ *
+ * This is the part of lhash_get() for keys in the array part, and everything
+ * else, including a register which doesn't hold a table, goes to miss. None
+ * of the table's fields are written here, so in a loop which can't resize the
+ * table the loads of them are hoisted out of the loop.
+ *
+ * @param s the current state
+ * @param reg the register holding the table
+ * @param key the key, as a u64
+ * @param index the key already known to be an integer, as an i64, or NULL
+ * @param proven an i1 which is true when index is already known to be in the
+ *        array part, or NULL
+ * @param miss where to go when the key isn't in the array part
+ * @param table filled in with the void* pointer to the table
+ * @return the address of the slot, on the path the builder is left on
+ */
+static Value build_array_slot(state_t *s, u32 reg, Value key, Value index,
+                              Value proven, BasicBlock miss, Value *table) {
+  Value tv = build_reg(s, reg);
+  BasicBlock is_table = insertbb(s->function, LLVMGetInsertBlock(builder));
+  LLVMBuildCondBr(builder, build_istable(tv), is_table, miss);
+  LLVMPositionBuilderAtEnd(builder, is_table);
+  *table = TOPTR(tv);
+
+  Value ok = NULL;
+  if (index == NULL) {
+    Value d = LLVMBuildBitCast(builder, key, llvm_double, "");
+    index = LLVMBuildSExt(builder, build_toi32(d, &ok), llvm_u64, "");
+  }
+  Value pos   = LLVMBuildICmp(builder, LLVMIntSGT, index, lvc_64_zero, "");
+  Value below = LLVMBuildICmp(builder, LLVMIntSLT, index,
+                              build_lhash_acap(*table), "");
+  Value inb   = LLVMBuildAnd(builder, pos, below, "");
+  if (ok != NULL) {
+    inb = LLVMBuildAnd(builder, ok, inb, "");
+  }
+  if (proven != NULL) {
+    inb = LLVMBuildOr(builder, proven, inb, "");
+  }
+  BasicBlock hit = insertbb(s->function, is_table);
+  LLVMBuildCondBr(builder, inb, hit, miss);
+  LLVMPositionBuilderAtEnd(builder, hit);
+
+  Value addr  = build_lhash_field(*table, offsetof(lhash_t, array),
+                                  LLVMPointerType(llvm_u64_ptr, 0));
+  Value array = build_tbaa(LLVMBuildLoad(builder, addr, ""), tbaa_array);
+  return LLVMBuildInBoundsGEP(builder, array, &index, 1, "");
+}
+
+/**
+ * @brief Builds the checks, on the way into a narrowed loop, that every index
+ *        it counts through is in the array part of the tables it indexes
+ *
+ * @param s the current state
+ * @param loops the loop of each array access, from llvm_array_loops()
+ * @param proven the flag of each array access which the check is stored in
+ * @param loop the FORLOOP of the loop being entered
+ * @param first the first index the loop will use, as an i64
+ */
+static void build_loop_bounds(state_t *s, u32 *loops, Value *proven, u32 loop,
+                              Value first) {
+  lfunc_t *func = s->func;
+  u32 code  = func->instrs[loop].instr;
+  u32 body  = (u32) ((i32) loop + 1 + SBX(code));
+  u8 dir    = llvm_fordir(func, loop);
+  Value one = lvc_64_one;
+  Value limit = build_regint(s, A(code) + 1);
+  Value lo, hi;
+  if (dir == TRACE_FOR_ANY) {
+    /* Whichever way the loop steps, it stays between first and limit */
+    Value below = LLVMBuildICmp(builder, LLVMIntSLT, first, limit, "");
+    lo = LLVMBuildSelect(builder, below, first, limit, "");
+    hi = LLVMBuildSelect(builder, below, limit, first, "");
+  } else {
+    lo = dir == TRACE_FOR_DOWN ? limit : first;
+    hi = dir == TRACE_FOR_DOWN ? first : limit;
+  }
+  u32 pc;
+
+  for (pc = body; pc < loop; pc++) {
+    if (loops[pc] != loop) { continue; }
+    u32 site = func->instrs[pc].instr;
+    u32 reg  = OP(site) == OP_GETTABLE ? B(site) : A(site);
+    Value tv = build_reg(s, reg);
+    BasicBlock check = insertbb(s->function, LLVMGetInsertBlock(builder));
+    BasicBlock done  = insertbb(s->function, check);
+    LLVMBuildStore(builder, LLVMConstInt(LLVMInt1Type(), 0, FALSE),
+                   proven[pc]);
+    LLVMBuildCondBr(builder, build_istable(tv), check, done);
+
+    LLVMPositionBuilderAtEnd(builder, check);
+    Value acap  = build_lhash_acap(TOPTR(tv));
+    Value above = LLVMBuildICmp(builder, LLVMIntSGE, lo, one, "");
+    Value below = LLVMBuildICmp(builder, LLVMIntSLT, hi, acap, "");
+    LLVMBuildStore(builder, LLVMBuildAnd(builder, above, below, ""),
+                   proven[pc]);
+    LLVMBuildBr(builder, done);
+    LLVMPositionBuilderAtEnd(builder, done);
+  }
+}
+
 /**
  * @brief Build a constant LLVM pointer
  */
@@ -536,18 +1010,14 @@ static Value build_frame(Value closure, Value parent) {
 }
 
 /**
- * @brief Builds the prolog for a partially compiled function segment
+ * @brief Loads the counts and stack indices which a caller passes in the u32
+ *        array that is the second argument of compiled code
  */
-static void build_partial_prolog(state_t *state, prolog_t *pro,
-                                 Value last_ret_addr, Value last_ret) {
-  /* Calculate stacki, and LSTATE */
+static void build_jargs(state_t *state, prolog_t *pro) {
   Value jargs   = LLVMGetParam(state->function, 1);
-  Value stackio = LLVMConstInt(llvm_u32, JSTACKI, FALSE);
-  Value stackia = LLVMBuildInBoundsGEP(builder, jargs, &stackio, 1, "");
-  *pro->stacki  = LLVMBuildLoad(builder, stackia, "stacki");
   Value retco   = LLVMConstInt(llvm_u32, JRETC, FALSE);
-  Value retca   = LLVMBuildInBoundsGEP(builder, jargs, &retco, 1, "");
-  *pro->retc    = LLVMBuildLoad(builder, retca, "retc");
+  *pro->retca   = LLVMBuildInBoundsGEP(builder, jargs, &retco, 1, "");
+  *pro->retc    = LLVMBuildLoad(builder, *pro->retca, "retc");
   Value retvio  = LLVMConstInt(llvm_u32, JRETVI, FALSE);
   Value retvia  = LLVMBuildInBoundsGEP(builder, jargs, &retvio, 1, "");
   *pro->retvi   = LLVMBuildLoad(builder, retvia, "retvi");
@@ -557,6 +1027,19 @@ static void build_partial_prolog(state_t *state, prolog_t *pro,
   Value argvio  = LLVMConstInt(llvm_u32, JARGVI, FALSE);
   *pro->argvia  = LLVMBuildInBoundsGEP(builder, jargs, &argvio, 1, "");
   *pro->argvi   = LLVMBuildLoad(builder, *pro->argvia, "argvi");
+}
+
+/**
+ * @brief Builds the prolog for a partially compiled function segment
+ */
+static void build_partial_prolog(state_t *state, prolog_t *pro,
+                                 Value last_ret_addr, Value last_ret) {
+  /* Calculate stacki, and LSTATE */
+  Value jargs   = LLVMGetParam(state->function, 1);
+  Value stackio = LLVMConstInt(llvm_u32, JSTACKI, FALSE);
+  Value stackia = LLVMBuildInBoundsGEP(builder, jargs, &stackio, 1, "");
+  *pro->stacki  = LLVMBuildLoad(builder, stackia, "stacki");
+  build_jargs(state, pro);
 
   /* Load last_ret */
   LLVMBuildStore(builder, LLVMBuildLoad(builder, last_ret_addr, ""), last_ret);
@@ -579,20 +1062,64 @@ static void build_partial_prolog(state_t *state, prolog_t *pro,
 
 }
 
-static void build_full_prolog(state_t *s, prolog_t *p) {
+/**
+ * @brief Figures out the type of a fully compiled function
+ *
+ * That's u64 f(closure, u32 *jargs, p0, ..., pn), where jargs holds the same
+ * counts and stack indices as for a compiled region. Only the first
+ * JIT_FULL_ARGS parameters are passed as arguments, the rest are read off the
+ * lua stack at jargs[JARGVI]. The first value returned is the return value,
+ * the rest go to the lua stack at jargs[JRETVI], and the number of values
+ * returned is written back to jargs[JRETC].
+ *
+ * @param func the function being compiled
+ * @return the LLVM type of the compiled function
+ */
+static Type full_type(lfunc_t *func) {
+  u32 i, argc = (u32) MIN(func->num_parameters, JIT_FULL_ARGS) + 2;
+  Type targs[argc];
+  targs[0] = llvm_void_ptr;
+  targs[1] = llvm_u32_ptr;
+  for (i = 2; i < argc; i++) {
+    targs[i] = llvm_u64;
+  }
+  return LLVMFunctionType(llvm_u64, targs, argc, FALSE);
+}
+
+static void build_full_prolog(state_t *s, prolog_t *p, Value last_ret) {
   u32 i;
   lfunc_t *func = s->func;
-  /* These all don't matter in full function compilation */
-  *p->argc = *p->argvi = *p->retc = *p->retvi = *p->argca = *p->argvia =
-    lvc_32_zero;
+  build_jargs(s, p);
+  LLVMBuildStore(builder, lvc_32_zero, last_ret);
+
+  /* Allocate some lua stack, which captured registers live in */
+  Value args[2] = {
+    build_dynload(&vm_stack, NULL),
+    LLVMConstInt(llvm_u32, func->max_stack, FALSE)
+  };
+  *p->stacki = LLVMBuildCall(builder, llvm_vm_alloc, args, 2, "stacki");
+  s->base_addr = get_vm_stack_base();
+  s->stacki    = *p->stacki;
 
-  /* Place all arguments into their registers */
-  for (i = 0; i < func->num_parameters; i++) {
-    LLVMBuildStore(builder, LLVMGetParam(s->function, i + 1), s->regs[i]);
+  /* Place all arguments into their registers, those not passed as arguments
+     are still where the caller put them */
+  for (i = 0; i < func->num_parameters && i < JIT_FULL_ARGS; i++) {
+    build_regset(s, i, LLVMGetParam(s->function, i + 2));
+  }
+  for (; i < func->num_parameters; i++) {
+    Value idx  = LLVMConstInt(llvm_u32, i, FALSE);
+    Value have = LLVMBuildICmp(builder, LLVMIntULT, idx, *p->argc, "");
+    /* Slot 0 is always there to load from when the argument isn't */
+    idx = LLVMBuildSelect(builder, have,
+                          LLVMBuildAdd(builder, *p->argvi, idx, ""),
+                          lvc_32_zero, "");
+    Value val = LLVMBuildLoad(builder, get_stack_base(s->base_addr, idx, ""),
+                              "");
+    build_regset(s, i, LLVMBuildSelect(builder, have, val, lvc_nil, ""));
   }
   /* Nil-ify all other registers */
   for (; i < func->max_stack; i++) {
-    LLVMBuildStore(builder, lvc_nil, s->regs[i]);
+    build_regset(s, i, lvc_nil);
   }
   Value closure = LLVMGetParam(s->function, 0);
   /* Figure out the current parent */
@@ -602,13 +1129,6 @@ static void build_full_prolog(state_t *s, prolog_t *p) {
   /* Set ourselves as the currently running frame */
   *p->frame = build_frame(closure, parent);
   LLVMBuildStore(builder, *p->frame, running_addr);
-
-  /* Allocate some lua stack */
-  Value args[2] = {
-    build_dynload(&vm_stack, NULL),
-    LLVMConstInt(llvm_u32, func->max_stack, FALSE)
-  };
-  *p->stacki = LLVMBuildCall(builder, llvm_vm_alloc, args, 2, "stacki");
 }
 
 /**
@@ -625,58 +1145,424 @@ static void build_ref_dec(jfunc_t *jfun) {
 }
 
 /**
- * @brief JIT-Compile a function
+ * @brief Bumps the hotness counter of baseline code
  *
- * @param func the function to compile
- * @param start the beginning program counter to compile at
- * @param end the ending program counter to compile. The opcode at this
- *        counter will be compiled.
- * @param stack the current stack of the lua function
+ * @param jfun the compiled function being counted
+ * @return the new value of the counter
+ */
+static Value build_hotness(jfunc_t *jfun) {
+  Value addr = build_ptr(&jfun->hotness, llvm_u32_ptr);
+  Value cnt  = LLVMBuildLoad(builder, addr, "");
+  cnt = LLVMBuildAdd(builder, cnt, lvc_32_one, "");
+  LLVMBuildStore(builder, cnt, addr);
+  return cnt;
+}
+
+/**
+ * @brief Counts a side exit being taken, marking the code stale when the
+ *        exit has been taken too many times
  *
- * @return the compiled function, which can be run by passing it over
- *         to llvm_run()
+ * @param s the state of the translation
+ * @param jfun the compiled function the exit leaves
+ * @param pc the instruction the exit resumes the interpreter at
  */
-i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
-                 luav *stack, int full_compile) {
+static void build_side_exit(state_t *s, jfunc_t *jfun, u32 pc) {
+  Type  i8    = LLVMInt8Type();
+  Value addr  = build_ptr(&s->live->instrs[pc].exits, llvm_void_ptr);
+  Value cnt   = LLVMBuildLoad(builder, addr, "");
+  Value limit = LLVMConstInt(i8, JIT_EXIT_LIMIT, FALSE);
+  Value below = LLVMBuildICmp(builder, LLVMIntULT, cnt, limit, "");
+  Value next  = LLVMBuildAdd(builder, cnt,
+                             LLVMBuildZExt(builder, below, i8, ""), "");
+  LLVMBuildStore(builder, next, addr);
+
+  /* Only the exit reaching the limit asks for a recompile, one which was
+     already widened stays quiet */
+  Value hit = LLVMBuildAnd(builder, below,
+                           LLVMBuildICmp(builder, LLVMIntEQ, next, limit, ""),
+                           "");
+  Value stale_addr = build_ptr(&jfun->stale, llvm_void_ptr);
+  Value stale = LLVMBuildLoad(builder, stale_addr, "");
+  stale = LLVMBuildOr(builder, stale, LLVMBuildZExt(builder, hit, i8, ""), "");
+  LLVMBuildStore(builder, stale, stale_addr);
+}
+
+/**
+ * @brief Writes the registers compiled code may have changed back to the lua
+ *        stack, the rest still hold what was there on entry
+ *
+ * @param s the state of the translation
+ * @param dirty bitset of the registers which may have changed
+ * @param live bitset of the registers the interpreter may still read
+ */
+static void build_snapshot(state_t *s, u64 *dirty, u64 *live) {
+  u32 i;
+  Value stack = get_stack_base(s->base_addr, s->stacki, "");
+  for (i = 0; i < s->func->max_stack; i++) {
+    if (s->captured[i] || !BIT_TEST(dirty, i) || !BIT_TEST(live, i)) continue;
+    Value off  = LLVMConstInt(llvm_u32, i, FALSE);
+    Value addr = LLVMBuildInBoundsGEP(builder, stack, &off, 1, "");
+    LLVMBuildStore(builder, LLVMBuildLoad(builder, s->regs[i], ""), addr);
+  }
+}
+
+/**
+ * @brief Finds the registers compiled code may have written by the time it
+ *        reaches each instruction
+ *
+ * Only paths through compiled instructions are followed, but the sets are
+ * also filled in for the instructions right outside of them, which is where
+ * the code leaves to.
+ *
+ * @param func the function being compiled
+ * @param blocks the blocks of the compiled instructions, NULL elsewhere
+ * @param full whether the whole function is compiled, in which case nothing
+ *        on the lua stack is up to date on entry
+ * @param dirty filled in with one bitset per instruction
+ * @param words the number of u64 words in each bitset
+ */
+static void llvm_dirty(lfunc_t *func, BasicBlock *blocks, int full,
+                       u64 *dirty, u32 words) {
+  u32 i, j, k, lo, hi, n, succs[2];
+  u64 out[words];
+  int changed = TRUE;
+  memset(dirty, full ? 0xff : 0, func->num_instrs * words * sizeof(u64));
+  if (full) return;
+
+  while (changed) {
+    changed = FALSE;
+    for (i = 0; i < func->num_instrs; i++) {
+      if (blocks[i] == NULL) continue;
+      memcpy(out, &dirty[i * words], sizeof(out));
+      opcode_writes(func, i, &lo, &hi);
+      for (j = lo; j < hi; j++) BIT_SET(out, j);
+      n = opcode_successors(func, i, succs);
+      for (j = 0; j < n; j++) {
+        if (succs[j] >= func->num_instrs) continue;
+        u64 *in = &dirty[succs[j] * words];
+        for (k = 0; k < words; k++) {
+          if ((in[k] | out[k]) == in[k]) continue;
+          in[k] |= out[k];
+          changed = TRUE;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Finds the registers which may still be read once execution reaches
+ *        each instruction
+ *
+ * This covers the whole function rather than the compiled region, as the
+ * interpreter can go anywhere after compiled code leaves.
+ *
+ * @param func the function being compiled
+ * @param live filled in with one bitset per instruction
+ * @param words the number of u64 words in each bitset
+ */
+static void llvm_live(lfunc_t *func, u64 *live, u32 words) {
+  u32 i, j, k, lo, hi, n, succs[2];
+  u64 in[words];
+  u8 reads[func->max_stack];
+  int changed = TRUE;
+  memset(live, 0, func->num_instrs * words * sizeof(u64));
+
+  while (changed) {
+    changed = FALSE;
+    for (i = (u32) func->num_instrs; i-- > 0;) {
+      memset(in, 0, sizeof(in));
+      n = opcode_successors(func, i, succs);
+      for (j = 0; j < n; j++) {
+        if (succs[j] >= func->num_instrs) continue;
+        for (k = 0; k < words; k++) {
+          in[k] |= live[succs[j] * words + k];
+        }
+      }
+      /* TESTSET leaves its destination alone on one of its paths */
+      if (OP(func->instrs[i].instr) != OP_TESTSET) {
+        opcode_writes(func, i, &lo, &hi);
+        for (j = lo; j < hi; j++) BIT_CLEAR(in, j);
+      }
+      memset(reads, 0, sizeof(reads));
+      opcode_reads(func, i, reads);
+      for (j = 0; j < func->max_stack; j++) {
+        if (reads[j]) BIT_SET(in, j);
+      }
+      if (memcmp(in, &live[i * words], sizeof(in)) != 0) {
+        memcpy(&live[i * words], in, sizeof(in));
+        changed = TRUE;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Finds the array accesses whose bounds can be checked once on the way
+ *        into their loop instead of every time around it
+ *
+ * That takes an access keyed by the counter of a narrowed loop, into a table
+ * which the loop never replaces, in a loop which can't resize any table. Only
+ * calls and the slow paths of table stores could, and an array store has no
+ * slow path in compiled code unless it was widened. Anything else which
+ * changes a table happens in the interpreter after a side exit, and coming
+ * back in checks the bounds again.
+ *
+ * @param func the function being compiled
+ * @param blocks the blocks of the compiled instructions
+ * @param narrowed which FORLOOPs count with an integer
+ * @param loops filled in with the FORLOOP of each such access, 0 elsewhere
+ * @param words the number of u64 words in a bitset of registers
+ */
+static void llvm_array_loops(lfunc_t *func, BasicBlock *blocks, u8 *narrowed,
+                             u32 *loops, u32 words) {
+  u32 loop, pc, j, lo, hi;
+  u64 written[words];
+  memset(loops, 0, func->num_instrs * sizeof(u32));
+
+  for (loop = 0; loop < func->num_instrs; loop++) {
+    if (!narrowed[loop]) { continue; }
+    u32 code = func->instrs[loop].instr;
+    u32 body = (u32) ((i32) loop + 1 + SBX(code));
+    int safe = TRUE;
+    memset(written, 0, sizeof(written));
+    for (pc = body; pc < loop; pc++) {
+      instr_t *instr = &func->instrs[pc];
+      switch (OP(instr->instr)) {
+        case OP_CALL: case OP_TAILCALL: case OP_TFORLOOP: case OP_SETGLOBAL:
+        case OP_SETLIST:
+          safe = FALSE;
+          break;
+        case OP_SETTABLE:
+          if (instr->op != OP_SETTABLE_ARRAY_INT || JIT_WIDENED(instr)) {
+            safe = FALSE;
+          }
+          break;
+      }
+      opcode_writes(func, pc, &lo, &hi);
+      for (j = lo; j < hi; j++) BIT_SET(written, j);
+    }
+    if (!safe || BIT_TEST(written, A(code) + 3)) { continue; }
+
+    for (pc = body; pc < loop; pc++) {
+      instr_t *instr = &func->instrs[pc];
+      u32 site = instr->instr;
+      if (blocks[pc] == NULL || JIT_WIDENED(instr)) { continue; }
+      if (instr->op == OP_GETTABLE_ARRAY_INT) {
+        if (C(site) == A(code) + 3 && !BIT_TEST(written, B(site))) {
+          loops[pc] = loop;
+        }
+      } else if (instr->op == OP_SETTABLE_ARRAY_INT) {
+        if (B(site) == A(code) + 3 && !BIT_TEST(written, A(site))) {
+          loops[pc] = loop;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Decides whether a call to a fully compiled function is inlined
+ *
+ * Only small callees other than the caller itself are, and only once their
+ * optimized code is ready, since that's what gets copied. Others are called
+ * through their compiled code as before. The code inlined is whatever the
+ * callee has right now, so the call site guards that it's still the callee's
+ * code. Only called from the interpreter's thread, which is the one
+ * installing code.
+ *
+ * @param caller the function making the call
+ * @param callee the function traced at the call
+ * @return the callee's code to inline, or NULL
+ */
+static jfunc_t *llvm_inlinee(lfunc_t *caller, lfunc_t *callee) {
+  jfunc_t *jfun = callee->jfunc;
+  if (callee == caller || callee->num_instrs > JIT_INLINE_MAX ||
+      jfun == NULL || jfun->value == NULL || jfun->tier != JIT_TIER_OPT) {
+    return NULL;
+  }
+  return jfun;
+}
+
+/* Copies of the values of an inlined function, see build_inline() */
+typedef struct vmap {
+  u32   mask;
+  Value *from;
+  Value *to;
+} vmap_t;
+
+static void vmap_put(vmap_t *map, Value from, Value to) {
+  u32 i = (u32) (((size_t) from >> 4) * 2654435761u) & map->mask;
+  while (map->from[i] != NULL) {
+    i = (i + 1) & map->mask;
+  }
+  map->from[i] = from;
+  map->to[i]   = to;
+}
+
+static Value vmap_get(vmap_t *map, Value from) {
+  u32 i = (u32) (((size_t) from >> 4) * 2654435761u) & map->mask;
+  while (map->from[i] != NULL) {
+    if (map->from[i] == from) { return map->to[i]; }
+    i = (i + 1) & map->mask;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Builds a copy of a compiled function's body in place of a call to it
+ *
+ * Only the function being built is touched, unlike running an inlining pass
+ * over the whole module. The callee's allocas go in the caller's entry block
+ * so they're still promoted to registers, and each of its returns jumps to
+ * where the builder is left.
+ *
+ * What's copied is the callee's whole compiled function, so the copy still
+ * does everything a call would: the prolog, linking its frame into
+ * vm_running, gc_check(), the jfunc's reference count, and bailing out
+ * through vm_funi(). All that saves is the call itself, along with whatever
+ * the optimizer can fold between the two bodies.
+ *
+ * @param callee the LLVM function to copy
+ * @param args the arguments of the call, one for each of the callee's
+ * @return the value returned by the copy
+ */
+static Value build_inline(Value callee, Value *args) {
+  BasicBlock from   = LLVMGetInsertBlock(builder);
+  Value caller      = LLVMGetBasicBlockParent(from);
+  BasicBlock entry  = LLVMGetEntryBasicBlock(caller);
+  BasicBlock done   = insertbb(caller, from);
+  BasicBlock bb;
+  Value inst;
+  u32 i, n = LLVMCountParams(callee), size = 1;
+
+  for (bb = LLVMGetFirstBasicBlock(callee); bb != NULL;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    n++;
+    for (inst = LLVMGetFirstInstruction(bb); inst != NULL;
+         inst = LLVMGetNextInstruction(inst)) {
+      n++;
+    }
+  }
+  while (size < 2 * n) { size *= 2; }
+  vmap_t map = {size - 1, xcalloc(size, sizeof(Value)),
+                xcalloc(size, sizeof(Value))};
+  for (i = 0; i < LLVMCountParams(callee); i++) {
+    vmap_put(&map, LLVMGetParam(callee, i), args[i]);
+  }
+  for (bb = LLVMGetFirstBasicBlock(callee); bb != NULL;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    vmap_put(&map, LLVMBasicBlockAsValue(bb),
+             LLVMBasicBlockAsValue(LLVMInsertBasicBlock(done, "")));
+  }
+  LLVMBuildBr(builder, LLVMValueAsBasicBlock(
+                vmap_get(&map, LLVMBasicBlockAsValue(
+                               LLVMGetEntryBasicBlock(callee)))));
+
+  /* Copy every instruction, with operands still referring to the callee */
+  LLVMPositionBuilderAtEnd(builder, done);
+  Value ret = LLVMBuildPhi(builder, llvm_u64, "");
+  for (bb = LLVMGetFirstBasicBlock(callee); bb != NULL;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    BasicBlock copy = LLVMValueAsBasicBlock(
+                        vmap_get(&map, LLVMBasicBlockAsValue(bb)));
+    for (inst = LLVMGetFirstInstruction(bb); inst != NULL;
+         inst = LLVMGetNextInstruction(inst)) {
+      Value new;
+      LLVMPositionBuilderAtEnd(builder, copy);
+      if (LLVMIsAReturnInst(inst)) {
+        new = LLVMBuildBr(builder, done);
+      } else if (LLVMIsAPHINode(inst)) {
+        new = LLVMBuildPhi(builder, LLVMTypeOf(inst), "");
+      } else {
+        new = LLVMInstructionClone(inst);
+        if (LLVMIsAAllocaInst(inst)) {
+          LLVMPositionBuilderBefore(builder, LLVMGetFirstInstruction(entry));
+        }
+        LLVMInsertIntoBuilder(builder, new);
+      }
+      vmap_put(&map, inst, new);
+    }
+  }
+
+  /* Then point them at the copies */
+  for (bb = LLVMGetFirstBasicBlock(callee); bb != NULL;
+       bb = LLVMGetNextBasicBlock(bb)) {
+    BasicBlock copy = LLVMValueAsBasicBlock(
+                        vmap_get(&map, LLVMBasicBlockAsValue(bb)));
+    for (inst = LLVMGetFirstInstruction(bb); inst != NULL;
+         inst = LLVMGetNextInstruction(inst)) {
+      Value new = vmap_get(&map, inst);
+      if (LLVMIsAReturnInst(inst)) {
+        Value v = LLVMGetOperand(inst, 0);
+        Value mapped = vmap_get(&map, v);
+        LLVMAddIncoming(ret, mapped != NULL ? &mapped : &v, &copy, 1);
+      } else if (LLVMIsAPHINode(inst)) {
+        for (i = 0; i < LLVMCountIncoming(inst); i++) {
+          Value v = LLVMGetIncomingValue(inst, i);
+          Value mapped = vmap_get(&map, v);
+          BasicBlock in = LLVMValueAsBasicBlock(vmap_get(&map,
+                            LLVMBasicBlockAsValue(LLVMGetIncomingBlock(inst,
+                                                                       i))));
+          LLVMAddIncoming(new, mapped != NULL ? &mapped : &v, &in, 1);
+        }
+      } else {
+        for (i = 0; i < (u32) LLVMGetNumOperands(inst); i++) {
+          Value mapped = vmap_get(&map, LLVMGetOperand(inst, i));
+          if (mapped != NULL) { LLVMSetOperand(new, i, mapped); }
+        }
+      }
+    }
+  }
+  free(map.from);
+  free(map.to);
+  LLVMPositionBuilderAtEnd(builder, done);
+  return ret;
+}
+
+/**
+ * @brief Translate a compile request into machine code
+ *
+ * This only touches LLVM and the request, never the interpreter's view of the
+ * function, so it can run away from the thread executing lua.
+ *
+ * @param req the request to compile. On success its binary and value are
+ *        filled in, but nothing is installed into the function yet
+ * @return 0 on success, negative number on failure
+ */
+static i32 llvm_translate(jrequest_t *req) {
+  lfunc_t *func    = req->snap;
+  lfunc_t *live    = req->func;
+  jfunc_t *jfun    = req->jfun;
+  u32 start        = req->start;
+  u32 end          = req->end;
+  int full_compile = req->full;
   BasicBlock blocks[func->num_instrs];
   BasicBlock bail_blocks[func->num_instrs];
+  BasicBlock exit_blocks[func->num_instrs];
   BasicBlock err_blocks[func->num_instrs];
+  u32   words = (u32) (func->max_stack + 63) / 64;
+  u64   dirty[func->num_instrs * words];
+  u64   live_regs[func->num_instrs * words];
+  u8    narrowed[func->num_instrs];
+  Value ivars[func->max_stack];
+  u32   array_loops[func->num_instrs];
+  Value proven[func->num_instrs];
   Value regs[func->max_stack];
   Value consts[func->num_consts];
   u8    regtyps[func->max_stack];
+  u8    captured[func->max_stack];
   char name[20];
   u32 i, j;
 
-  if (full_compile) {
-    u32 found = 0;
-    for (i = 0; i < func->num_instrs; i++) {
-      if (OP(func->instrs[i].instr) == OP_RETURN && func->instrs[i].count > 0)
-        found++;
-    }
-    if (found == 0) return -1;
-  }
-
-  jfunc_t *jfun = gc_alloc(sizeof(jfunc_t), LJFUNC);
-  jfunc_t **dest;
-  memset(jfun, 0, sizeof(jfunc_t));
-
   /* Create the function and state */
   Value function;
   if (full_compile) {
-    Type targs[func->num_parameters + 1];
-    targs[0] = llvm_void_ptr;
-    for (i = 0; i < func->num_parameters; i++) {
-      targs[i + 1] = llvm_u64;
-    }
-    Type funtyp = LLVMFunctionType(llvm_u64, targs,
-                                   (u32) (func->num_parameters + 1), FALSE);
-    function = LLVMAddFunction(module, "compiled", funtyp);
-    dest = &func->jfunc;
+    function = LLVMAddFunction(module, "compiled", full_type(func));
   } else {
     Type params[2] = {llvm_void_ptr, LLVMPointerType(llvm_u32, 0)};
     Type funtyp    = LLVMFunctionType(llvm_u32, params, 2, FALSE);
     function = LLVMAddFunction(module, "test", funtyp);
-    dest = &func->instrs[start].jfunc;
   }
 
   Value closure = LLVMGetParam(function, 0);
@@ -684,7 +1570,9 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
     .regs     = regs,
     .consts   = consts,
     .types    = regtyps,
+    .captured = captured,
     .func     = func,
+    .live     = live,
     .function = function,
     .blocks   = blocks
   };
@@ -693,12 +1581,42 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
   /* Create the blocks and allocas */
   memset(blocks, 0, sizeof(blocks));
   memset(bail_blocks, 0, sizeof(bail_blocks));
+  memset(exit_blocks, 0, sizeof(exit_blocks));
   memset(err_blocks, 0, sizeof(err_blocks));
   for (i = start; i <= end; i++) {
     if (func->instrs[i].count == 0) { continue; }
     sprintf(name, "block%d", i);
     blocks[i] = LLVMAppendBasicBlock(function, name);
   }
+  llvm_dirty(func, blocks, full_compile, dirty, words);
+  llvm_live(func, live_regs, words);
+
+  /* Numeric for loops only ever seen counting with integers count with an
+     i64 instead of a double, unless that already failed too often */
+  memset(narrowed, 0, sizeof(narrowed));
+  for (i = start; i <= end; i++) {
+    u32 code = func->instrs[i].instr;
+    if (blocks[i] == NULL || OP(code) != OP_FORLOOP) { continue; }
+    u32 prep = (u32) ((i32) i + SBX(code));
+    narrowed[i] = (u8) (func->trace.instrs[prep][0] &&
+                        !JIT_WIDENED(&func->instrs[prep]));
+  }
+  llvm_array_loops(func, blocks, narrowed, array_loops, words);
+
+  /* Find all registers which a closure might hold an open upvalue for */
+  u8 has_captures = FALSE;
+  memset(captured, 0, sizeof(captured));
+  for (i = 0; i < func->num_instrs; i++) {
+    u32 code = func->instrs[i].instr;
+    if (OP(code) != OP_CLOSURE) { continue; }
+    for (j = 0; j < func->funcs[BX(code)]->num_upvalues; j++) {
+      u32 pseudo = func->instrs[++i].instr;
+      if (OP(pseudo) == OP_MOVE) {
+        captured[B(pseudo)] = TRUE;
+        has_captures = TRUE;
+      }
+    }
+  }
   LLVMPositionBuilderAtEnd(builder, startbb);
   LLVMBuildCall(builder, llvm_gc_check, NULL, 0, "");
   for (i = 0; i < func->num_consts; i++) {
@@ -707,7 +1625,27 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
   for (i = 0; i < func->max_stack; i++) {
     regs[i] = LLVMBuildAlloca(builder, llvm_u64, "");
   }
+  memset(ivars, 0, sizeof(ivars));
+  for (i = start; i <= end; i++) {
+    u32 a = A(func->instrs[i].instr);
+    if (narrowed[i] && ivars[a] == NULL) {
+      ivars[a] = LLVMBuildAlloca(builder, llvm_u64, "");
+    }
+  }
+  memset(proven, 0, sizeof(proven));
+  for (i = 0; i < func->num_instrs; i++) {
+    if (array_loops[i] == 0) { continue; }
+    proven[i] = LLVMBuildAlloca(builder, LLVMInt1Type(), "");
+    LLVMBuildStore(builder, LLVMConstInt(LLVMInt1Type(), 0, FALSE), proven[i]);
+  }
   Value ret_store = LLVMBuildAlloca(builder, llvm_u32, "");
+  /* Scratch vector for the operands of OP_CONCAT, which span at most the
+     entire set of registers */
+  Value concat_vec = LLVMBuildArrayAlloca(builder, llvm_u64,
+                        LLVMConstInt(llvm_u32, func->max_stack, FALSE), "");
+  /* Counts and stack indices passed to fully compiled callees */
+  Value call_jargs = LLVMBuildArrayAlloca(builder, llvm_u32,
+                        LLVMConstInt(llvm_u32, JARGS, FALSE), "");
   Value offset = LLVMConstInt(llvm_u64, offsetof(lclosure_t, last_ret), 0);
   Value ret_val  = LLVMBuildAlloca(builder, llvm_i32, "ret_val");
   Value last_ret = LLVMBuildAlloca(builder, llvm_i32, "last_ret");
@@ -715,10 +1653,11 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
   last_ret_addr = LLVMBuildBitCast(builder, last_ret_addr, llvm_u32_ptr, "");
 
   /* Create the function prolog */
-  Value stacki, retc, retvi, argc, argca, argvi, argvia, frame;
+  Value stacki, retc, retca, retvi, argc, argca, argvi, argvia, frame;
   prolog_t pro = {
     .stacki = &stacki,
     .retc   = &retc,
+    .retca  = &retca,
     .retvi  = &retvi,
     .argc   = &argc,
     .argca  = &argca,
@@ -729,7 +1668,7 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
   Value running_addr, old_parent;
   old_parent = build_dynload(&vm_running, &running_addr);
   if (full_compile) {
-    build_full_prolog(&s, &pro);
+    build_full_prolog(&s, &pro, last_ret);
   } else {
     build_partial_prolog(&s, &pro, last_ret_addr, last_ret);
   }
@@ -741,6 +1680,9 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
   Value cnt_val = LLVMBuildLoad(builder, cnt_addr, "");
   cnt_val = LLVMBuildAdd(builder, cnt_val, lvc_64_one, "");
   LLVMBuildStore(builder, cnt_val, cnt_addr);
+  if (req->tier == JIT_TIER_BASE && full_compile) {
+    build_hotness(jfun);
+  }
 
   /* Calculate closure->env */
   Value closure_env = build_dynidx(closure, offsetof(lclosure_t, env));
@@ -750,54 +1692,100 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
   Value upv_addr = LLVMBuildInBoundsGEP(builder, closure, &upv_off, 1,"");
   Value upvalues = LLVMBuildPointerCast(builder, upv_addr, llvm_u64_ptr, "");
   Value base_addr = get_vm_stack_base();
-  LLVMBuildBr(builder, blocks[start]);
-
-  /* Create exit block */
-  BasicBlock ret_block = LLVMAppendBasicBlock(function, "exit");
+  s.base_addr = base_addr;
+  s.stacki    = stacki;
+  BasicBlock prolog = LLVMGetInsertBlock(builder);
+
+  /* Create exit blocks. Errors, side exits and leaving off the end of the
+     region all first write back only what the exit's snapshot says may have
+     changed and is still live. A dead register may hold an object which was
+     only kept alive by the compiled code, and which a call since collected */
+  BasicBlock ret_block   = LLVMAppendBasicBlock(function, "exit");
+  BasicBlock leave_block = LLVMAppendBasicBlock(function, "leave");
   LLVMPositionBuilderAtEnd(builder, ret_block);
-  Value stack_ptr = get_stack_base(base_addr, stacki, "stack");
-  for (i = 0; i < func->max_stack; i++) {
-    Value off  = LLVMConstInt(llvm_u32, i, FALSE);
-    Value addr = LLVMBuildInBoundsGEP(builder, stack_ptr, &off, 1, "");
-    Value val  = LLVMBuildLoad(builder, regs[i], "");
-    LLVMBuildStore(builder, val, addr);
-  }
+  LLVMBuildBr(builder, leave_block);
+  LLVMPositionBuilderAtEnd(builder, leave_block);
   /* Update the return value */
   Value r = LLVMBuildLoad(builder, ret_val, "");
+  LLVMBuildStore(builder, LLVMBuildLoad(builder, last_ret, ""), last_ret_addr);
   if (full_compile) {
+    /* The interpreter finishes the call, returning where the caller wanted */
     Value vmargs[8] = {
       closure,
       stacki,
       lvc_32_zero,
       r,
-      lvc_32_zero,
-      lvc_32_zero,
-      lvc_32_one,
-      stacki
+      argc,
+      argvi,
+      retc,
+      retvi
     };
     Value running = build_ptr(&running_jfunc, llvm_void_ptr_ptr);
     LLVMBuildStore(builder, build_ptr(jfun, llvm_void_ptr), running);
-    Value retc = LLVMBuildCall(builder, LLVMGetNamedFunction(module, "vm_funi"),
-                               vmargs, 8, "");
-    Value addr = get_stack_base(get_vm_stack_base(), stacki, "");
+    Value got = LLVMBuildCall(builder, LLVMGetNamedFunction(module, "vm_funi"),
+                              vmargs, 8, "");
+    LLVMBuildStore(builder, got, retca);
+    Value addr = get_stack_base(get_vm_stack_base(), retvi, "");
     Value from_stack = LLVMBuildLoad(builder, addr, "");
 
-    Value cond = LLVMBuildICmp(builder, LLVMIntEQ, retc, lvc_32_one, "");
+    Value cond = LLVMBuildICmp(builder, LLVMIntNE, got, lvc_32_zero, "");
     Value ret = LLVMBuildSelect(builder, cond, from_stack, lvc_nil, "");
     build_ref_dec(jfun);
     LLVMBuildRet(builder, ret);
   } else {
-    LLVMBuildStore(builder, LLVMBuildLoad(builder, last_ret, ""), last_ret_addr);
     build_ref_dec(jfun);
     LLVMBuildRet(builder, r);
   }
 
-  /* Initialize the types of all stack members */
-  for (i = 0; i < func->max_stack; i++) {
-    if (lv_isupvalue(stack[i])) {
-      regtyps[i] = TRACE_UPVAL | lv_gettype(*lv_getupvalue(stack[i]));
-    } else {
-      regtyps[i] = lv_gettype(stack[i]);
+  /* Narrowed loops entered in the middle start counting from what's on the
+     stack. When that isn't an integer, leave before anything has changed and
+     count it against the loop's FORPREP */
+  LLVMPositionBuilderAtEnd(builder, prolog);
+  for (i = start; i <= end; i++) {
+    u32 code = func->instrs[i].instr;
+    if (!narrowed[i] || (u32) ((i32) i + 1 + SBX(code)) > start) { continue; }
+    u32 prep = (u32) ((i32) i + SBX(code));
+    BasicBlock ok   = LLVMAppendBasicBlock(function, "");
+    BasicBlock fail = LLVMInsertBasicBlock(ret_block, "");
+    LLVMBuildCondBr(builder,
+                    build_forguard(&s, A(code), llvm_fordir(func, i), TRUE),
+                    ok, fail);
+    LLVMPositionBuilderAtEnd(builder, fail);
+    build_side_exit(&s, jfun, prep);
+    { RETURN((i32) start, leave_block); }
+    LLVMPositionBuilderAtEnd(builder, ok);
+    LLVMBuildStore(builder, build_regint(&s, A(code)), ivars[A(code)]);
+    build_loop_bounds(&s, array_loops, proven, i, build_regint(&s, A(code)));
+  }
+
+  /* A whole function is compiled for the types of the arguments it was called
+     with, and leaves right away when called with anything else. That includes
+     calling itself in a tail call, which comes back here. Once that happened
+     often enough, the arguments can be anything */
+  BasicBlock entry = NULL;
+  int any_args = JIT_WIDENED(&func->instrs[0]);
+  if (full_compile) {
+    entry = LLVMAppendBasicBlock(function, "entry");
+    LLVMBuildBr(builder, entry);
+    LLVMPositionBuilderAtEnd(builder, entry);
+    for (i = 0; i < func->num_parameters && !any_args; i++) {
+      u8 typ = (u8) (req->types[i] & TRACE_TYPEMASK);
+      if (typ == LANY) { continue; }
+      BasicBlock ok = LLVMAppendBasicBlock(function, "");
+      LLVMBuildCondBr(builder, build_hastype(build_reg(&s, i), typ), ok,
+                      EXITBB(0));
+      LLVMPositionBuilderAtEnd(builder, ok);
+    }
+  }
+  LLVMBuildBr(builder, blocks[start]);
+
+  /* Initialize the types of all stack members. Only the parameters of a whole
+     function hold anything on entry */
+  memcpy(regtyps, req->types, sizeof(regtyps));
+  if (full_compile) {
+    for (i = 0; i < func->max_stack; i++) {
+      regtyps[i] = (u8) (i >= func->num_parameters ? LNIL :
+                         any_args ? LANY : regtyps[i]);
     }
   }
 
@@ -887,6 +1875,14 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
           cond      = LLVMBuildFCmp(builder,
                                      A(code) ? LLVMRealUNE : LLVMRealUEQ,
                                      bv, cv, "");
+        } else if (btyp == LSTRING && ctyp == LSTRING) {
+          /* Long strings aren't interned, so this can't be a pointer check */
+          Value fn = LLVMGetNamedFunction(module, "lstr_equal");
+          Value args[2] = {TOPTR(build_kregu(&s, B(code))),
+                           TOPTR(build_kregu(&s, C(code)))};
+          Value r = LLVMBuildCall(builder, fn, args, 2, "lstr_equal");
+          cond    = LLVMBuildICmp(builder, A(code) ? LLVMIntEQ : LLVMIntNE,
+                                  r, lvc_32_zero, "");
         } else if (btyp != LANY && ctyp != LANY) {
           Value bv  = build_kregu(&s, B(code));
           Value cv  = build_kregu(&s, C(code));
@@ -938,22 +1934,71 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
       case OP_FORLOOP: {
         STOP_ON(LTYPE(A(code)) != LNUMBER || LTYPE(A(code) + 1) != LNUMBER ||
                 LTYPE(A(code) + 2) != LNUMBER, "bad FORLOOP");
-        /* TODO - guard that R(A), R(A+1), R(A+2) are numbers */
-        Value a2v = build_kregf(&s, A(code) + 2);
-        Value av  = LLVMBuildFAdd(builder, build_kregf(&s, A(code)), a2v, "");
-        build_regset(&s, A(code), LLVMBuildBitCast(builder, av, llvm_u64, ""));
-
-        /* TODO - guard that the sign of R(A+2) is the same as in the trace */
+        u32 a = A(code);
+        u8 dir = llvm_fordir(func, i - 1);
         BasicBlock endbb = LLVMAppendBasicBlock(function, "endfor");
-        Value a1v  = build_kregf(&s, A(code) + 1);
-        LLVMRealPredicate pred = func->trace.instrs[i - 1][0] ? LLVMRealUGE
-                                                              : LLVMRealULE;
-        Value cond = LLVMBuildFCmp(builder, pred, av, a1v, "");
+        if (narrowed[i - 1]) {
+          /* The guards on the way into the loop make the limit and step
+             integers, and keep the index from overflowing */
+          Value iv = LLVMBuildLoad(builder, ivars[a], "");
+          iv = LLVMBuildNSWAdd(builder, iv, build_regint(&s, a + 2), "");
+          LLVMBuildStore(builder, iv, ivars[a]);
+          Value av = build_intnum(iv);
+          build_regset(&s, a, av);
+          Value limit = build_regint(&s, a + 1);
+          Value cond;
+          if (dir == TRACE_FOR_ANY) {
+            /* A step of zero leaves the loop, as in the interpreter */
+            Value step = build_regint(&s, a + 2);
+            Value zero = LLVMConstInt(llvm_u64, 0, FALSE);
+            Value up = LLVMBuildAnd(builder,
+                LLVMBuildICmp(builder, LLVMIntSGT, step, zero, ""),
+                LLVMBuildICmp(builder, LLVMIntSLE, iv, limit, ""), "");
+            Value dn = LLVMBuildAnd(builder,
+                LLVMBuildICmp(builder, LLVMIntSLT, step, zero, ""),
+                LLVMBuildICmp(builder, LLVMIntSGE, iv, limit, ""), "");
+            cond = LLVMBuildOr(builder, up, dn, "");
+          } else {
+            cond = LLVMBuildICmp(builder, dir == TRACE_FOR_DOWN ? LLVMIntSGE
+                                                                 : LLVMIntSLE,
+                                 iv, limit, "");
+          }
+          LLVMBuildCondBr(builder, cond, endbb, DSTBB(i));
+          LLVMPositionBuilderAtEnd(builder, endbb);
+          build_regset(&s, a + 3, av);
+          GOTOBB((u32) ((i32) i + SBX(code)));
+          break;
+        }
+
+        BasicBlock guarded = insertbb(function, blocks[i - 1]);
+        LLVMBuildCondBr(builder, build_forguard(&s, a, dir, FALSE),
+                        guarded, EXITBB(i - 1));
+        LLVMPositionBuilderAtEnd(builder, guarded);
+        Value a2v = build_kregf(&s, a + 2);
+        Value av  = LLVMBuildFAdd(builder, build_kregf(&s, a), a2v, "");
+        build_regset(&s, a, LLVMBuildBitCast(builder, av, llvm_u64, ""));
+
+        Value a1v  = build_kregf(&s, a + 1);
+        Value cond;
+        if (dir == TRACE_FOR_ANY) {
+          Value zero = LLVMConstReal(llvm_double, 0);
+          Value up = LLVMBuildAnd(builder,
+              LLVMBuildFCmp(builder, LLVMRealOGT, a2v, zero, ""),
+              LLVMBuildFCmp(builder, LLVMRealULE, av, a1v, ""), "");
+          Value dn = LLVMBuildAnd(builder,
+              LLVMBuildFCmp(builder, LLVMRealOLT, a2v, zero, ""),
+              LLVMBuildFCmp(builder, LLVMRealUGE, av, a1v, ""), "");
+          cond = LLVMBuildOr(builder, up, dn, "");
+        } else {
+          cond = LLVMBuildFCmp(builder, dir == TRACE_FOR_DOWN ? LLVMRealUGE
+                                                              : LLVMRealULE,
+                               av, a1v, "");
+        }
         LLVMBuildCondBr(builder, cond, endbb, DSTBB(i));
 
         LLVMPositionBuilderAtEnd(builder, endbb);
         av = LLVMBuildBitCast(builder, av, llvm_u64, "");
-        build_regset(&s, A(code) + 3, av);
+        build_regset(&s, a + 3, av);
         GOTOBB((u32) ((i32) i + SBX(code)));
         break;
       }
@@ -961,38 +2006,103 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
       case OP_FORPREP: {
         STOP_ON(LTYPE(A(code)) != LNUMBER || LTYPE(A(code) + 2) != LNUMBER,
                 "bad FORPREP");
-        /* TODO - guard that R(A) and R(A+2) are numbers */
-        Value a2v = build_kregf(&s, A(code) + 2);
-        Value av  = build_kregf(&s, A(code));
-        av = LLVMBuildFSub(builder, av, a2v, "");
-        build_regset(&s, A(code), LLVMBuildBitCast(builder, av, llvm_u64, ""));
-        SETTYPE(A(code), LNUMBER);
-        SETTYPE(A(code) + 1, LNUMBER);
-        SETTYPE(A(code) + 2, LNUMBER);
-        SETTYPE(A(code) + 3, LNUMBER);
-        GOTOBB((u32) ((i32) i + SBX(code)));
+        u32 a    = A(code);
+        u32 loop = (u32) ((i32) i + SBX(code));
+        int narrow = loop <= end && narrowed[loop];
+        u8 dir = llvm_fordir(func, loop);
+        BasicBlock guarded = insertbb(function, blocks[i - 1]);
+        Value ok = build_forguard(&s, a, dir, narrow);
+        LLVMBuildCondBr(builder, ok, guarded, EXITBB(i - 1));
+        LLVMPositionBuilderAtEnd(builder, guarded);
+        if (narrow) {
+          build_loop_bounds(&s, array_loops, proven, loop,
+                            build_regint(&s, a));
+          Value iv = LLVMBuildSub(builder, build_regint(&s, a),
+                                  build_regint(&s, a + 2), "");
+          LLVMBuildStore(builder, iv, ivars[a]);
+          build_regset(&s, a, build_intnum(iv));
+        } else {
+          Value a2v = build_kregf(&s, a + 2);
+          Value av  = build_kregf(&s, a);
+          av = LLVMBuildFSub(builder, av, a2v, "");
+          build_regset(&s, a, LLVMBuildBitCast(builder, av, llvm_u64, ""));
+        }
+        SETTYPE(a, LNUMBER);
+        SETTYPE(a + 1, LNUMBER);
+        SETTYPE(a + 2, LNUMBER);
+        SETTYPE(a + 3, LNUMBER);
+        GOTOBB(loop);
         break;
       }
 
       case OP_RETURN: {
         Value ret_stack = get_stack_base(base_addr, retvi, "retstack");
         if (full_compile) {
+          /* The first value is returned, the rest are copied to the caller's
+             stack before ours goes away */
+          Value ret, got;
+          if (B(code) == 0) {
+            Value stack = get_stack_base(base_addr, stacki, "");
+            i32 end_stores = get_varbase(&s, i);
+            if (end_stores < 0) { warn("bad B0 OP_RETURN"); EXIT_FAIL; }
+            for (j = A(code); j < (u32) end_stores; j++) {
+              Value offset = LLVMConstInt(llvm_u32, j, FALSE);
+              Value addr = LLVMBuildInBoundsGEP(builder, stack, &offset, 1, "");
+              LLVMBuildStore(builder, build_reg(&s, j), addr);
+            }
+            Value av = LLVMConstInt(llvm_u32, A(code), FALSE);
+            Value ret_base = LLVMBuildInBoundsGEP(builder, stack, &av, 1, "");
+            Value num_rets = LLVMBuildLoad(builder, last_ret, "");
+            num_rets = LLVMBuildSub(builder, num_rets, av, "");
+            Value cond = LLVMBuildICmp(builder, LLVMIntULE, num_rets, retc, "");
+            got = LLVMBuildSelect(builder, cond, num_rets, retc, "");
+            cond = LLVMBuildICmp(builder, LLVMIntNE, num_rets, lvc_32_zero, "");
+            ret = LLVMBuildSelect(builder, cond,
+                                  LLVMBuildLoad(builder, ret_base, ""),
+                                  lvc_nil, "");
+            Value args[5] = {
+              LLVMBuildBitCast(builder, ret_stack, llvm_void_ptr, ""),
+              LLVMBuildBitCast(builder, ret_base, llvm_void_ptr, ""),
+              LLVMBuildMul(builder, got, lvc_luav, ""),
+              LLVMConstInt(llvm_u32, 8, FALSE),
+              LLVMConstInt(LLVMInt1Type(), 0, FALSE)
+            };
+            LLVMBuildCall(builder, llvm_memmove, args, 5, "");
+          } else {
+            u32 num_ret = B(code) - 1;
+            ret = num_ret > 0 ? build_reg(&s, A(code)) : lvc_nil;
+            /* Values are copied downwards in order, so none is overwritten
+               before it's copied */
+            for (j = 1; j < num_ret; j++) {
+              Value offset = LLVMConstInt(llvm_u32, j, FALSE);
+              Value cond = LLVMBuildICmp(builder, LLVMIntULT, offset, retc, "");
+              BasicBlock store = insertbb(function, LLVMGetInsertBlock(builder));
+              BasicBlock next  = insertbb(function, store);
+              LLVMBuildCondBr(builder, cond, store, next);
+              LLVMPositionBuilderAtEnd(builder, store);
+              Value addr = LLVMBuildInBoundsGEP(builder, ret_stack, &offset, 1,
+                                                "");
+              LLVMBuildStore(builder, build_reg(&s, A(code) + j), addr);
+              LLVMBuildBr(builder, next);
+              LLVMPositionBuilderAtEnd(builder, next);
+            }
+            Value want = LLVMConstInt(llvm_u32, num_ret, FALSE);
+            Value cond = LLVMBuildICmp(builder, LLVMIntULE, want, retc, "");
+            got = LLVMBuildSelect(builder, cond, want, retc, "");
+          }
           LLVMBuildStore(builder, old_parent, running_addr);
           Value args[2] = {build_dynload(&vm_stack, NULL), stacki};
-          LLVMBuildCall(builder, llvm_vm_dealloc, args, 2, "");
-          switch(B(code)) {
-            case 1:
-              build_ref_dec(jfun);
-              LLVMBuildRet(builder, lvc_nil);
-              break;
-            case 2:
-              build_ref_dec(jfun);
-              LLVMBuildRet(builder, build_reg(&s, A(code)));
-              break;
-            default:
-              panic("should not be fully compilable");
+          if (has_captures) {
+            LLVMBuildCall(builder, llvm_vm_close, args, 2, "");
           }
-
+          /* Don't deallocate past the values returned */
+          Value top  = LLVMBuildAdd(builder, retvi, got, "");
+          Value past = LLVMBuildICmp(builder, LLVMIntUGT, top, stacki, "");
+          args[1] = LLVMBuildSelect(builder, past, top, stacki, "");
+          LLVMBuildCall(builder, llvm_vm_dealloc, args, 2, "");
+          LLVMBuildStore(builder, got, retca);
+          build_ref_dec(jfun);
+          LLVMBuildRet(builder, ret);
           break;
         } else if (B(code) == 0) {
           xassert(full_compile == FALSE);
@@ -1003,7 +2113,7 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
           for (j = A(code); j < (u32) end_stores; j++) {
             Value offset = LLVMConstInt(llvm_u32, j, FALSE);
             Value addr = LLVMBuildInBoundsGEP(builder, stack, &offset, 1, "");
-            Value val  = LLVMBuildLoad(builder, regs[j], "");
+            Value val  = build_reg(&s, j);
             LLVMBuildStore(builder, val, addr);
           }
           /* Memcpy our lua stack over to the return stack */
@@ -1105,13 +2215,39 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
 
       case OP_SETTABLE: {
         STOP_ON(LTYPE(A(code)) != LTABLE, "bad SETTABLE");
+        Value key = build_kregu(&s, B(code));
+        Value val = build_kregu(&s, C(code));
+        if (func->instrs[i - 1].op == OP_SETTABLE_ARRAY_INT) {
+          /* Like the interpreter, only overwriting one non-nil value with
+             another is done inline, which leaves the table's size alone */
+          int widened = JIT_WIDENED(&func->instrs[i - 1]);
+          BasicBlock miss = widened ? insertbb(function, blocks[i - 1])
+                                    : EXITBB(i - 1);
+          Value index = NULL, in_bounds = NULL, table;
+          ARRAY_KEY(i - 1, index, in_bounds);
+          Value slot = build_array_slot(&s, A(code), key, index, in_bounds,
+                                        miss, &table);
+          Value prev = build_tbaa(LLVMBuildLoad(builder, slot, ""), tbaa_slot);
+          Value keep = LLVMBuildAnd(builder,
+                         LLVMBuildICmp(builder, LLVMIntNE, prev, lvc_nil, ""),
+                         LLVMBuildICmp(builder, LLVMIntNE, val, lvc_nil, ""),
+                         "");
+          BasicBlock store = insertbb(function, LLVMGetInsertBlock(builder));
+          LLVMBuildCondBr(builder, keep, store, miss);
+          LLVMPositionBuilderAtEnd(builder, store);
+          build_tbaa(LLVMBuildStore(builder, val, slot), tbaa_slot);
+          Value vaddr = build_lhash_field(table, offsetof(lhash_t, version),
+                                          llvm_u64_ptr);
+          Value version = build_tbaa(LLVMBuildLoad(builder, vaddr, ""),
+                                     tbaa_version);
+          version = LLVMBuildAdd(builder, version, lvc_64_one, "");
+          build_tbaa(LLVMBuildStore(builder, version, vaddr), tbaa_version);
+          GOTOBB(i);
+          if (!widened) { break; }
+          LLVMPositionBuilderAtEnd(builder, miss);
+        }
         /* TODO: metatable? */
-        Value av = TOPTR(LLVMBuildLoad(builder, regs[A(code)], ""));
-        Value args[3] = {
-          av,
-          build_kregu(&s, B(code)),
-          build_kregu(&s, C(code))
-        };
+        Value args[3] = {TOPTR(build_reg(&s, A(code))), key, val};
         LLVMBuildCall(builder, llvm_lhash_set, args, 3, "");
         /* TODO: gc_check() */
         GOTOBB(i);
@@ -1120,9 +2256,38 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
 
       case OP_GETTABLE: {
         STOP_ON(LTYPE(B(code)) != LTABLE, "bad GETTABLE (t:%d)", LTYPE(B(code)));
-        Value table = TOPTR(build_reg(&s, B(code)));
         Value key = build_kregu(&s, C(code));
         int is_const = C(code) >= 256;
+        if (func->instrs[i - 1].op == OP_GETTABLE_ARRAY_INT) {
+          /* A nil from the array part still has to go through the metatable,
+             when there is one */
+          int widened = JIT_WIDENED(&func->instrs[i - 1]);
+          BasicBlock miss = widened ? insertbb(function, blocks[i - 1])
+                                    : EXITBB(i - 1);
+          Value index = NULL, in_bounds = NULL, table;
+          ARRAY_KEY(i - 1, index, in_bounds);
+          Value slot = build_array_slot(&s, B(code), key, index, in_bounds,
+                                        miss, &table);
+          Value val  = build_tbaa(LLVMBuildLoad(builder, slot, ""), tbaa_slot);
+          Value maddr = build_lhash_field(table, offsetof(lhash_t, metatable),
+                                          llvm_void_ptr_ptr);
+          Value meta = build_tbaa(LLVMBuildLoad(builder, maddr, ""), tbaa_meta);
+          Value found = LLVMBuildOr(builder,
+                          LLVMBuildICmp(builder, LLVMIntNE, val, lvc_nil, ""),
+                          LLVMBuildICmp(builder, LLVMIntEQ, meta, lvc_null, ""),
+                          "");
+          BasicBlock done = insertbb(function, LLVMGetInsertBlock(builder));
+          LLVMBuildCondBr(builder, found, done, miss);
+          LLVMPositionBuilderAtEnd(builder, done);
+          build_regset(&s, A(code), val);
+          GOTOBB(i);
+          if (!widened) {
+            SETTYPE(A(code), func->trace.instrs[i - 1][0]);
+            break;
+          }
+          LLVMPositionBuilderAtEnd(builder, miss);
+        }
+        Value table = TOPTR(build_reg(&s, B(code)));
         build_lhash_get(&s, i - 1, table, key, is_const, A(code));
         /* TODO: guard for type of A */
         SETTYPE(A(code), func->trace.instrs[i - 1][0]);
@@ -1210,7 +2375,6 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
            everything is already on the stack anyway and it'd just be a pain to
            do this in LLVM */
         if (B(code) == 0) {
-          xassert(full_compile == FALSE);
           /* Get the arguments for lhash_array */
           Value map = TOPTR(build_reg(&s, A(code)));
           Value stack = get_stack_base(base_addr, stacki, "");
@@ -1252,7 +2416,8 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
         Value offset = LLVMConstInt(llvm_u32, B(code), FALSE);
         Value addr   = LLVMBuildInBoundsGEP(builder, upvalues, &offset, 1, "");
         Value upv    = TOPTR(LLVMBuildLoad(builder, addr, ""));
-        /* Interpret the luav as an upvalue and load it */
+        /* Interpret the luav as an upvalue and load its current location */
+        upv = build_dynidx(upv, offsetof(lupvalue_t, v));
         upv = LLVMBuildBitCast(builder, upv, llvm_u64_ptr, "");
         upv = LLVMBuildLoad(builder, upv, "");
         build_regset(&s, A(code), upv);
@@ -1266,7 +2431,8 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
         Value offset = LLVMConstInt(llvm_u32, B(code), FALSE);
         Value addr   = LLVMBuildInBoundsGEP(builder, upvalues, &offset, 1, "");
         Value upv    = TOPTR(LLVMBuildLoad(builder, addr, ""));
-        /* Store register A into the pointer pointed to */
+        /* Store register A into the upvalue's current location */
+        upv = build_dynidx(upv, offsetof(lupvalue_t, v));
         upv = LLVMBuildBitCast(builder, upv, llvm_u64_ptr, "");
         LLVMBuildStore(builder, build_reg(&s, A(code)), upv);
         GOTOBB(i);
@@ -1274,14 +2440,11 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
       }
 
       case OP_CLOSE: {
-        for (j = A(code); j < func->max_stack; j++) {
-          if (TRACE_ISUPVAL(regtyps[j])) {
-            Value upv = build_reg(&s, j);
-            /* Clear the upvalue information */
-            regtyps[j] = (u8) (TYPE(j) & ~TRACE_UPVAL);
-            build_regset(&s, j, upv);
-          }
-        }
+        Value args[2] = {
+          build_dynload(&vm_stack, NULL),
+          LLVMBuildAdd(builder, stacki, LLVMConstInt(llvm_u32, A(code), 0), "")
+        };
+        LLVMBuildCall(builder, llvm_vm_close, args, 2, "");
         GOTOBB(i);
         break;
       }
@@ -1297,20 +2460,19 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
         upvalues2 = LLVMBuildBitCast(builder, upvalues2, llvm_u64_ptr, "");
 
         /* Prepare all upvalues */
-        fn = LLVMGetNamedFunction(module, "lupvalue_alloc");
+        fn = LLVMGetNamedFunction(module, "lupvalue_find");
         for (j = 0; j < child->num_upvalues; j++) {
           u32 pseudo = func->instrs[i++].instr;
           Value tostore = NULL;
           if (OP(pseudo) == OP_MOVE) {
-            /* Using a register */
-            tostore = LLVMBuildLoad(builder, regs[B(pseudo)], "");
-
-            /* If we aren't already an upvalue, make an upvalue for ourselves */
-            if (!TRACE_ISUPVAL(regtyps[B(pseudo)])) {
-              tostore = LLVMBuildCall(builder, fn, &tostore, 1, "");
-              LLVMBuildStore(builder, tostore, regs[B(pseudo)]);
-              regtyps[B(pseudo)] |= TRACE_UPVAL;
-            }
+            /* Using a register, which lives in its stack slot */
+            assert(captured[B(pseudo)]);
+            Value slot = LLVMConstInt(llvm_u32, B(pseudo), FALSE);
+            Value fargs[2] = {
+              build_dynload(&vm_stack, NULL),
+              LLVMBuildAdd(builder, stacki, slot, "")
+            };
+            tostore = LLVMBuildCall(builder, fn, fargs, 2, "");
           } else {
             /* Using one of our upvalues */
             Value off = LLVMConstInt(llvm_u32, B(pseudo), FALSE);
@@ -1338,15 +2500,55 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
           warn("Bad OP_TAILCALL (B0)");
           EXIT_FAIL;
         }
-        assert(!full_compile);
         u32 num_args = B(code) - 1;
         u32 end_stores = A(code) + 1  + num_args;
 
         STOP_ON(LTYPE(A(code)) != LFUNCTION,
                 "reall bad TAILCALL (%x)", LTYPE(A(code)));
 
-        // copy arguments from c stack to lua stack
         u32 a = A(code);
+        if (full_compile) {
+          /* A function calling itself starts over with the new arguments, and
+             any other tail call is left to the interpreter, which makes it
+             without growing the C stack. Varargs would have to be moved into
+             place for a vararg function, so it always leaves. */
+          if (func->is_vararg) {
+            LLVMBuildBr(builder, BAILBB(i - 1));
+            break;
+          }
+          BasicBlock again = insertbb(function, blocks[i - 1]);
+          Value self = LLVMBuildPtrToInt(builder, closure, llvm_u64, "");
+          self = LLVMBuildOr(builder, self,
+                             LLVMConstInt(llvm_u64, LUAV_PACK(LFUNCTION, 0),
+                                          FALSE), "");
+          Value same = LLVMBuildICmp(builder, LLVMIntEQ, build_reg(&s, a),
+                                     self, "");
+          LLVMBuildCondBr(builder, same, again, BAILBB(i - 1));
+
+          LLVMPositionBuilderAtEnd(builder, again);
+          Value params[func->num_parameters + 1];
+          for (j = 0; j < func->num_parameters; j++) {
+            params[j] = j < num_args ? build_reg(&s, a + j + 1) : lvc_nil;
+          }
+          if (has_captures) {
+            Value args[2] = {build_dynload(&vm_stack, NULL), stacki};
+            LLVMBuildCall(builder, llvm_vm_close, args, 2, "");
+          }
+          /* The collector only sees the arguments on the lua stack */
+          Value stack = get_stack_base(base_addr, stacki, "");
+          for (j = 0; j < func->max_stack; j++) {
+            Value val = j < func->num_parameters ? params[j] : lvc_nil;
+            Value off = LLVMConstInt(llvm_u32, j, FALSE);
+            build_regset(&s, j, val);
+            LLVMBuildStore(builder, val,
+                           LLVMBuildInBoundsGEP(builder, stack, &off, 1, ""));
+          }
+          LLVMBuildCall(builder, llvm_gc_check, NULL, 0, "");
+          LLVMBuildBr(builder, entry);
+          break;
+        }
+
+        // copy arguments from c stack to lua stack
         Value stack = get_stack_base(base_addr, stacki, "");
         for (j = a; j < end_stores; j++) {
           Value off  = LLVMConstInt(llvm_u64, j, 0);
@@ -1363,12 +2565,10 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
       }
 
       case OP_CALL: {
-        /* TODO: varargs, multiple returns, etc... */
         u32 num_args = B(code) - 1;
         u32 num_rets = C(code) - 1;
         u32 end_stores;
         if (B(code) == 0) {
-          xassert(full_compile == FALSE);
           i32 tmp = get_varbase(&s, i);
           if (tmp < 0) { warn("B0 OP_CALL bad"); EXIT_FAIL; }
           end_stores = (u32) tmp;
@@ -1380,12 +2580,18 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
         STOP_ON(LTYPE(a) != LFUNCTION,
                 "really bad CALL (%x)", LTYPE(A(code)));
 
+        /* Once the guesses about the callee have failed often enough, the
+           call is compiled to handle whatever shows up */
+        int widened = JIT_WIDENED(&func->instrs[i - 1]);
+
         // check if we're calling a fully compiled function
         lclosure_t *lclos = func->trace.misc[i - 1].closure;
-        if (lclos != NULL && lclos->type == LUAF_LUA &&
-            (lclos->function.lua->jfunc != NULL ||
-             (lclos->function.lua == func && full_compile)) &&
+        u8 traced = req->calls[i - 1 - req->start];
+        if (!widened && (traced & JCALL_DIRECT) &&
             (C(code) == 1 || C(code) == 2) && B(code) != 0) {
+          lfunc_t *nfunc = lclos->function.lua;
+          jfunc_t *inlined = req->inlined != NULL ?
+                             req->inlined[i - 1 - req->start] : NULL;
           BasicBlock ck2 = insertbb(function, blocks[i - 1]);
           BasicBlock call = insertbb(function, ck2);
           // guard that it's still a lua function
@@ -1396,7 +2602,7 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
           Value type = LLVMBuildLoad(builder, type_addr, "");
           Value type_lua = LLVMConstInt(llvm_u32, LUAF_LUA, 0);
           Value is_lua = LLVMBuildICmp(builder, LLVMIntEQ, type, type_lua, "");
-          LLVMBuildCondBr(builder, is_lua, ck2, BAILBB(i - 1));
+          LLVMBuildCondBr(builder, is_lua, ck2, EXITBB(i - 1));
           // guard that it's still fully compiled
           LLVMPositionBuilderAtEnd(builder, ck2);
           Value lfunc = build_dynidx(closure, offsetof(lclosure_t, function.lua));
@@ -1406,39 +2612,71 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
           Value jfunc = build_dynidx(lfunc, offsetof(lfunc_t, jfunc));
           Value jfunc2 = LLVMBuildPtrToInt(builder, jfunc, llvm_u64, "");
           Value nonnull = LLVMBuildICmp(builder, LLVMIntNE, jfunc2, lvc_64_zero, "");
+          if (inlined != NULL) {
+            /* Inlined code must still be the callee's code */
+            Value want = LLVMConstInt(llvm_u64, (size_t) inlined, FALSE);
+            nonnull = LLVMBuildICmp(builder, LLVMIntEQ, jfunc2, want, "");
+          } else {
+            /* A real call needs room on the C stack, otherwise the
+               interpreter makes it without recursing (see VM_CSTACK_ROOM) */
+            Value limit = LLVMConstInt(llvm_u64, (size_t) &vm_cstack_limit, 0);
+            limit = LLVMConstIntToPtr(limit, llvm_u64_ptr);
+            limit = LLVMBuildLoad(builder, limit, "");
+            Value sp = LLVMBuildPtrToInt(builder, call_jargs, llvm_u64, "");
+            Value room = LLVMBuildICmp(builder, LLVMIntUGT, sp, limit, "");
+            nonnull = LLVMBuildAnd(builder, nonnull, room, "");
+          }
           Value cont = LLVMBuildAnd(builder, same, nonnull, "");
-          LLVMBuildCondBr(builder, cont, call, BAILBB(i - 1));
+          LLVMBuildCondBr(builder, cont, call, EXITBB(i - 1));
 
           // call the fully compiled function
-          lfunc_t *nfunc = lclos->function.lua;
           LLVMPositionBuilderAtEnd(builder, call);
           Value stack = get_stack_base(base_addr, stacki, "");
           for (j = 0; j < func->max_stack; j++) {
-            u8 typ = LTYPE(j);
-            if (typ == LNUMBER || typ == LBOOLEAN || typ == LNIL) continue;
+            if ((j < a || j > a + num_args) && !CALL_KEEP(j)) continue;
             Value off  = LLVMConstInt(llvm_u64, j, 0);
             Value addr = LLVMBuildInBoundsGEP(builder, stack, &off, 1, "");
             LLVMBuildStore(builder, build_reg(&s, j), addr);
           }
-          u32 argc = (u32) nfunc->num_parameters + 1;
-          Type argtyps[argc];
+          Value counts[JARGS] = {
+            [JSTACKI] = lvc_32_zero,
+            [JARGC]   = LLVMConstInt(llvm_u32, num_args, FALSE),
+            [JARGVI]  = LLVMBuildAdd(builder, stacki,
+                                     LLVMConstInt(llvm_u32, a + 1, FALSE), ""),
+            [JRETC]   = LLVMConstInt(llvm_u32, num_rets, FALSE),
+            [JRETVI]  = LLVMBuildAdd(builder, stacki,
+                                     LLVMConstInt(llvm_u32, a, FALSE), "")
+          };
+          for (j = 0; j < JARGS; j++) {
+            Value off = LLVMConstInt(llvm_u32, j, FALSE);
+            LLVMBuildStore(builder, counts[j],
+                           LLVMBuildInBoundsGEP(builder, call_jargs, &off, 1,
+                                                ""));
+          }
+          u32 argc = (u32) MIN(nfunc->num_parameters, JIT_FULL_ARGS) + 2;
           Value args[argc];
-          argtyps[0] = llvm_void_ptr;
           args[0] = closure;
-          for (j = 0; j < nfunc->num_parameters; j++) {
+          args[1] = call_jargs;
+          for (j = 0; j + 2 < argc; j++) {
             if (j >= num_args) {
-              args[j + 1] = lvc_nil;
+              args[j + 2] = lvc_nil;
             } else {
               assert(a + j + 1 < func->max_stack);
-              args[j + 1] = build_reg(&s, a + j + 1);
+              args[j + 2] = build_reg(&s, a + j + 1);
             }
-            argtyps[j + 1] = llvm_u64;
           }
-          Type funtyp = LLVMFunctionType(llvm_u64, argtyps, argc, FALSE);
-          jfunc = build_dynidx(jfunc, offsetof(jfunc_t, binary));
-          jfunc = LLVMBuildPointerCast(builder, jfunc,
-                                       LLVMPointerType(funtyp, 0), "");
-          Value ret = LLVMBuildCall(builder, jfunc, args, argc, "");
+          Value ret;
+          if (inlined != NULL) {
+            /* Pasting the callee's IR in here lets its registers join the
+               caller's */
+            ret = build_inline(inlined->value, args);
+          } else {
+            jfunc = build_dynidx(jfunc, offsetof(jfunc_t, binary));
+            jfunc = LLVMBuildPointerCast(builder, jfunc,
+                                         LLVMPointerType(full_type(nfunc), 0),
+                                         "");
+            ret = LLVMBuildCall(builder, jfunc, args, argc, "");
+          }
           if (C(code) == 2) {
             build_regset(&s, A(code), ret);
           }
@@ -1451,13 +2689,8 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
 
         // copy arguments from c stack to lua stack
         Value stack = get_stack_base(base_addr, stacki, "");
-        /* TODO: figure out a better method for garbage collection to preserve
-                 all of our alloca instances without storing everything */
         for (j = 0; j < end_stores; j++) {
-          if ((j < a || j > a + num_args)) {
-            u8 typ = LTYPE(j);
-            if (typ == LNUMBER || typ == LBOOLEAN || typ == LNIL) continue;
-          }
+          if ((j < a || j > a + num_args) && !CALL_KEEP(j)) continue;
           Value off  = LLVMConstInt(llvm_u64, j, 0);
           Value addr = LLVMBuildInBoundsGEP(builder, stack, &off, 1, "");
           Value val  = build_reg(&s, j);
@@ -1471,7 +2704,6 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
         Value av = LLVMConstInt(llvm_u32, a, FALSE);
         Value lnumargs;
         if (B(code) == 0) {
-          xassert(full_compile == FALSE);
           Value tmp = LLVMBuildLoad(builder, last_ret, "");
           lnumargs = LLVMBuildSub(builder, tmp, av, "");
           lnumargs = LLVMBuildSub(builder, lnumargs, lvc_32_one, "");
@@ -1497,18 +2729,22 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
         Value typ = LLVMBuildLoad(builder, typaddr, "");
         Value ctyp = LLVMConstInt(llvm_u32, LUAF_C, FALSE);
         Value isc = LLVMBuildICmp(builder, LLVMIntEQ, typ, ctyp, "");
-        assert(lclos != NULL);
-        if (lclos->type == LUAF_LUA) {
-          BasicBlock lfunc = insertbb(function, blocks[i - 1]);
-          LLVMBuildCondBr(builder, isc, BAILBB(i - 1), lfunc);
+        assert(widened || (traced & JCALL_TRACED));
+        int lua_arm = widened || (traced & JCALL_LUA);
+        int c_arm   = widened || !(traced & JCALL_LUA);
+        BasicBlock lfunc = lua_arm ? insertbb(function, blocks[i - 1])
+                                   : EXITBB(i - 1);
+        BasicBlock cfunc = c_arm ? insertbb(function, blocks[i - 1])
+                                 : EXITBB(i - 1);
+        LLVMBuildCondBr(builder, isc, cfunc, lfunc);
+        if (lua_arm) {
           /* Call a lua function */
           LLVMPositionBuilderAtEnd(builder, lfunc);
           Value callret = LLVMBuildCall(builder, llvm_vm_fun, args, 5, "");
           LLVMBuildStore(builder, callret, ret_store);
           LLVMBuildBr(builder, after);
-        } else {
-          BasicBlock cfunc = insertbb(function, blocks[i - 1]);
-          LLVMBuildCondBr(builder, isc, cfunc, BAILBB(i - 1));
+        }
+        if (c_arm) {
           /* Call a C function */
           LLVMPositionBuilderAtEnd(builder, cfunc);
           Value cur = build_dynidxa(cframe, offsetof(lframe_t, closure));
@@ -1653,38 +2889,51 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
       }
 
       case OP_VARARG: {
-        assert(!full_compile);
         /* TODO - guard return value types */
 
         /* Figure out where we should load things from */
-        xassert(func->trace.instrs[i - 1][0] != TRACEMAX);
         Value params = LLVMConstInt(llvm_u32, func->num_parameters, FALSE);
         Value basi = LLVMBuildAdd(builder, argvi, params, "");
-        Value base = get_stack_base(base_addr, basi, "");
 
         /* B == 0 => memcpy */
         if (B(code) == 0) {
-          xassert(full_compile == FALSE);
-          Value stack = get_stack_base(base_addr, stacki, "");
-          Value dest  = LLVMConstInt(llvm_u32, A(code), FALSE);
-          dest        = LLVMBuildInBoundsGEP(builder, stack, &dest, 1, "");
+          Value av    = LLVMConstInt(llvm_u32, A(code), FALSE);
           Value cnt   = LLVMBuildSub(builder, argc, params, "");
           Value cond  = LLVMBuildICmp(builder, LLVMIntULT, argc, params, "");
           cnt         = LLVMBuildSelect(builder, cond, lvc_32_zero, cnt, "");
 
-          /* TODO: conditionally call vm_stack_grow */
+          /* Grow the stack if there are more varargs than registers */
+          BasicBlock grow = insertbb(function, blocks[i - 1]);
+          BasicBlock copy = insertbb(function, grow);
+          Value lstack = build_dynload(&vm_stack, NULL);
+          Value soff  = LLVMConstInt(llvm_u64, offsetof(lstack_t, size), 0);
+          Value saddr = LLVMBuildInBoundsGEP(builder, lstack, &soff, 1, "");
+          saddr = LLVMBuildPointerCast(builder, saddr, llvm_u32_ptr, "");
+          Value size  = LLVMBuildLoad(builder, saddr, "");
+          Value need  = LLVMBuildAdd(builder, LLVMBuildAdd(builder, stacki, av,
+                                                           ""), cnt, "");
+          cond = LLVMBuildICmp(builder, LLVMIntUGT, need, size, "");
+          LLVMBuildCondBr(builder, cond, grow, copy);
+          LLVMPositionBuilderAtEnd(builder, grow);
+          Value gargs[2] = {lstack, LLVMBuildSub(builder, need, size, "")};
+          LLVMBuildCall(builder, LLVMGetNamedFunction(module, "vm_stack_grow"),
+                        gargs, 2, "");
+          LLVMBuildBr(builder, copy);
+
           /* memcpy(dest, base, ...) */
+          LLVMPositionBuilderAtEnd(builder, copy);
+          Value stack = get_stack_base(base_addr, stacki, "");
+          Value dest  = LLVMBuildInBoundsGEP(builder, stack, &av, 1, "");
           Value args[5] = {
             LLVMBuildBitCast(builder, dest, llvm_void_ptr, ""),
-            LLVMBuildBitCast(builder, base, llvm_void_ptr, ""),
+            LLVMBuildBitCast(builder, get_stack_base(base_addr, basi, ""),
+                             llvm_void_ptr, ""),
             LLVMBuildMul(builder, cnt, lvc_luav, ""),
             LLVMConstInt(llvm_u32, 8, FALSE),
             LLVMConstInt(LLVMInt1Type(), 0, FALSE)
           };
           LLVMBuildCall(builder, llvm_memcpy, args, 5, "");
-          Value lr = LLVMBuildAdd(builder, cnt,
-                                  LLVMConstInt(llvm_u32, A(code), FALSE), "");
-          LLVMBuildStore(builder, lr, last_ret);
+          LLVMBuildStore(builder, LLVMBuildAdd(builder, cnt, av, ""), last_ret);
           GOTOBB(i);
           break;
         }
@@ -1693,14 +2942,39 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
         u32 limit = B(code) - 1;
         u32 targc = func->trace.instrs[i - 1][0];
 
+        /* Without a count to guess, or once the guess failed often enough in
+           a whole function, whatever was passed is loaded */
+        if (targc == TRACEMAX ||
+            (full_compile && JIT_WIDENED(&func->instrs[i - 1]))) {
+          for (j = 0; j < limit; j++) {
+            Value idx  = LLVMConstInt(llvm_u32, func->num_parameters + j,
+                                      FALSE);
+            Value have = LLVMBuildICmp(builder, LLVMIntULT, idx, argc, "");
+            idx = LLVMBuildSelect(builder, have,
+                                  LLVMBuildAdd(builder, argvi, idx, ""),
+                                  lvc_32_zero, "");
+            Value jval = LLVMBuildLoad(builder,
+                                       get_stack_base(base_addr, idx, ""), "");
+            build_regset(&s, A(code) + j,
+                         LLVMBuildSelect(builder, have, jval, lvc_nil, ""));
+            SETTYPE(A(code) + j, LANY);
+          }
+          GOTOBB(i);
+          break;
+        }
+
+        /* A whole function is called with different counts, so guessing wrong
+           only leaves, but a region is only ever entered from one call */
         BasicBlock load = insertbb(function, blocks[i - 1]);
         Value cond = LLVMBuildICmp(builder, LLVMIntEQ, argc,
                                    LLVMConstInt(llvm_u32, targc, FALSE), "");
-        LLVMBuildCondBr(builder, cond, load, ERRBB(i - 1));
+        LLVMBuildCondBr(builder, cond, load,
+                        full_compile ? EXITBB(i - 1) : ERRBB(i - 1));
         u32 tmax = targc < func->num_parameters ? 0 :
                     targc - func->num_parameters;
 
         LLVMPositionBuilderAtEnd(builder, load);
+        Value base = get_stack_base(base_addr, basi, "");
         /* Load all args provided */
         for (j = 0; j < limit && j < tmax; j++) {
           Value joff = LLVMConstInt(llvm_u32, j, FALSE);
@@ -1723,22 +2997,23 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
       }
 
       case OP_CONCAT: {
-        /* TODO: have a C function which takes a vector of strings and
-                 concatenates them? */
         for (j = B(code); j <= C(code); j++) {
           STOP_ON(LTYPE(j) != LSTRING && LTYPE(j) != LNUMBER,
                   "bad CONCAT (%x)", LTYPE(j));
         }
         if (j != C(code) + 1) break;
-        Value fn = LLVMGetNamedFunction(module, "lv_concat");
-        Value args[2];
-
-        Value cur = build_reg(&s, B(code));
-        for (j = B(code) + 1; j <= C(code); j++) {
-          args[0] = cur;
-          args[1] = build_reg(&s, j);
-          cur = LLVMBuildCall(builder, fn, args, 2, "");
+        /* Pack the operands into a vector, and concatenate them all at once */
+        for (j = B(code); j <= C(code); j++) {
+          Value off  = LLVMConstInt(llvm_u32, j - B(code), 0);
+          Value addr = LLVMBuildInBoundsGEP(builder, concat_vec, &off, 1, "");
+          LLVMBuildStore(builder, build_reg(&s, j), addr);
         }
+        Value args[2] = {
+          concat_vec,
+          LLVMConstInt(llvm_u32, C(code) - B(code) + 1, FALSE)
+        };
+        Value fn = LLVMGetNamedFunction(module, "lv_concatn");
+        Value cur = LLVMBuildCall(builder, fn, args, 2, "");
 
         build_regset(&s, A(code), cur);
         SETTYPE(A(code), LSTRING);
@@ -1869,18 +3144,334 @@ i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
     }
   }
 
+  /* Baseline loops count their iterations. They go back to the interpreter
+     once when they get hot, so it can ask for the optimizing tier, and again
+     once that's ready, so it can switch over in the middle of the loop */
+  if (req->tier == JIT_TIER_BASE && !full_compile) {
+    BasicBlock head = blocks[start];
+    BasicBlock hot  = LLVMInsertBasicBlock(head, "hot");
+    LLVMReplaceAllUsesWith(LLVMBasicBlockAsValue(head),
+                           LLVMBasicBlockAsValue(hot));
+    LLVMPositionBuilderAtEnd(builder, hot);
+    BasicBlock bail = BAILBB(start);
+    Value cnt = build_hotness(jfun);
+    Value limit = LLVMConstInt(llvm_u32, TIER_UP_COUNT, FALSE);
+    Value now_hot = LLVMBuildICmp(builder, LLVMIntEQ, cnt, limit, "");
+    Type i8_ptr = LLVMPointerType(LLVMInt8Type(), 0);
+    Value sup = LLVMBuildLoad(builder, build_ptr(&jfun->superseded, i8_ptr), "");
+    LLVMSetVolatile(sup, TRUE);
+    Value ready = LLVMBuildICmp(builder, LLVMIntNE, sup,
+                                LLVMConstInt(LLVMInt8Type(), 0, FALSE), "");
+    LLVMBuildCondBr(builder, LLVMBuildOr(builder, now_hot, ready, ""),
+                    bail, head);
+  }
+
   //LLVMDumpValue(function);
-  LLVMRunFunctionPassManager(pass_manager, function);
+  LLVMRunFunctionPassManager(req->tier == JIT_TIER_BASE ? pass_baseline
+                                                        : pass_manager,
+                             function);
   //LLVMDumpValue(function);
+  req->value = function;
+  req->binary = LLVMGetPointerToGlobal(ex_engine, function);
+  if (req->binary == NULL) {
+    EXIT_FAIL;
+  }
   if (full_compile)
     fprintf(stderr, "fully ");
-  fprintf(stderr, "compiled %d => %d (line:%d)\n", start, end, func->start_line);
-  jfun->value = function;
-  jfun->binary = LLVMGetPointerToGlobal(ex_engine, function);
-  *dest = jfun;
+  fprintf(stderr, "compiled %d => %d (line:%d, tier:%d)\n", start, end,
+          func->start_line, req->tier);
   return 0;
 }
 
+/**
+ * @brief Makes the result of a finished request visible to the interpreter
+ *
+ * @param req the finished request
+ */
+static void llvm_install(jrequest_t *req) {
+  lfunc_t *func = req->func;
+  jfunc_t **dest = req->full ? &func->jfunc : &func->instrs[req->start].jfunc;
+  if (req->result < 0) {
+    if (req->prev != NULL) {
+      /* Nothing better is coming, so the old code stops asking */
+      req->prev->no_tier_up = TRUE;
+      req->prev->stale      = FALSE;
+    } else {
+      func->instrs[req->start].count = INVAL_RUN_COUNT;
+    }
+    return;
+  }
+  req->jfun->value  = req->value;
+  req->jfun->binary = req->binary;
+  req->jfun->tier   = req->tier;
+  /* Inlined code is guarded on by address, so it lives as long as this */
+  if (req->inlined != NULL) {
+    u32 i;
+    for (i = 0; i <= req->end - req->start; i++) {
+      if (req->inlined[i] != NULL) req->inlined[i]->ref_count++;
+    }
+    req->jfun->inlined     = req->inlined;
+    req->jfun->num_inlined = req->end - req->start + 1;
+    req->inlined = NULL;
+  }
+  /* The interpreter may have thrown out the code this was meant to replace,
+     in which case the new code likely won't fare any better. The compiler
+     thread reads the functions' code too, so it's published last */
+  if (*dest == req->prev) {
+    __atomic_store_n(dest, req->jfun, __ATOMIC_RELEASE);
+    if (req->prev != NULL) req->prev->superseded = TRUE;
+  }
+}
+
+/**
+ * @brief Allocates a request to compile part of a function
+ *
+ * @param func the function to compile
+ * @param snapshot whether the request needs its own copy of the function's
+ *        counts and traces, because it's compiled while func keeps running
+ */
+static jrequest_t *jrequest_alloc(lfunc_t *func, u32 start, u32 end,
+                                  luav *stack, int full, int snapshot) {
+  u32 i;
+  jrequest_t *req = xcalloc(1, sizeof(jrequest_t));
+  req->func  = func;
+  req->snap  = func;
+  req->start = start;
+  req->end   = end;
+  req->full  = full;
+  req->state = JREQ_QUEUED;
+  req->types = xmalloc(func->max_stack);
+  for (i = 0; i < func->max_stack; i++) {
+    req->types[i] = lv_gettype(stack[i]);
+  }
+  if (snapshot) {
+    lfunc_t *snap = xmalloc(sizeof(lfunc_t));
+    *snap = *func;
+    snap->instrs = xmalloc(func->num_instrs * sizeof(instr_t));
+    snap->trace.instrs = xmalloc(func->num_instrs * sizeof(traceinfo_t));
+    snap->trace.misc = xmalloc(func->num_instrs * sizeof(misc_t));
+    memcpy(snap->instrs, func->instrs, func->num_instrs * sizeof(instr_t));
+    memcpy(snap->trace.instrs, func->trace.instrs,
+           func->num_instrs * sizeof(traceinfo_t));
+    memcpy(snap->trace.misc, func->trace.misc,
+           func->num_instrs * sizeof(misc_t));
+    req->snap = snap;
+  }
+
+  /* The generated code refers to its handle, so it's created up front */
+  req->jfun = gc_alloc(sizeof(jfunc_t), LJFUNC);
+  memset(req->jfun, 0, sizeof(jfunc_t));
+  return req;
+}
+
+/**
+ * @brief Frees a request along with its snapshot, if any
+ */
+static void jrequest_free(jrequest_t *req) {
+  if (req->snap != req->func) {
+    free(req->snap->instrs);
+    free(req->snap->trace.instrs);
+    free(req->snap->trace.misc);
+    free(req->snap);
+  }
+  free(req->types);
+  free(req->calls);
+  free(req->inlined);
+  free(req);
+}
+
+/**
+ * @brief Decides how each call in a request's region is made
+ *
+ * A call to a lua function which has compiled code, or a recursive call in a
+ * full compile, goes straight into the compiled code. An optimizing request
+ * also picks which of those callees are inlined. The choices are made on the
+ * interpreter's thread, where the callees' code can't change underneath
+ * them, and the compiler thread only looks at what's recorded here. What's
+ * inlined is kept alive by llvm_gc() until the request is installed.
+ */
+static void jrequest_calls(jrequest_t *req) {
+  u32 i, n = req->end - req->start + 1;
+  req->calls = xcalloc(n, sizeof(u8));
+  for (i = req->start; i <= req->end; i++) {
+    if (OP(req->snap->instrs[i].instr) != OP_CALL) continue;
+    lclosure_t *lclos = req->snap->trace.misc[i].closure;
+    if (lclos == NULL) continue;
+    req->calls[i - req->start] = JCALL_TRACED;
+    if (lclos->type != LUAF_LUA) continue;
+    req->calls[i - req->start] |= JCALL_LUA;
+    lfunc_t *callee = lclos->function.lua;
+    if (callee->jfunc == NULL && !(callee == req->func && req->full)) continue;
+    req->calls[i - req->start] |= JCALL_DIRECT;
+
+    if (req->tier != JIT_TIER_OPT) continue;
+    jfunc_t *jfun = llvm_inlinee(req->func, callee);
+    if (jfun == NULL) continue;
+    if (req->inlined == NULL) {
+      req->inlined = xcalloc(n, sizeof(jfunc_t*));
+    }
+    req->inlined[i - req->start] = jfun;
+  }
+}
+
+/**
+ * @brief JIT-Compile a function
+ *
+ * With JIT_ASYNC the work is handed to the compiler thread and this returns
+ * immediately. The compiled code shows up in the function's jfunc pointers
+ * once llvm_publish() finds it finished.
+ *
+ * @param func the function to compile
+ * @param start the beginning program counter to compile at
+ * @param end the ending program counter to compile. The opcode at this
+ *        counter will be compiled.
+ * @param stack the current stack of the lua function
+ * @param full_compile whether the whole function is compiled as a callable
+ *
+ * @return 0 if the function was compiled or queued, negative if it can't be
+ */
+i32 llvm_compile(struct lfunc *func, u32 start, u32 end,
+                 luav *stack, int full_compile) {
+  u32 i;
+  jfunc_t *prev = full_compile ? func->jfunc : func->instrs[start].jfunc;
+  u8 tier = (JIT_TIERED && prev == NULL) ? JIT_TIER_BASE : JIT_TIER_OPT;
+  if (full_compile) {
+    u32 found = 0;
+    for (i = 0; i < func->num_instrs; i++) {
+      if (OP(func->instrs[i].instr) == OP_RETURN && func->instrs[i].count > 0)
+        found++;
+    }
+    if (found == 0) return -1;
+  }
+
+  /* Already on its way? */
+  jrequest_t *req;
+  for (req = jit_requests; req != NULL; req = req->next) {
+    if (req->func == func && req->start == start &&
+        req->full == full_compile && req->tier == tier)
+      return 0;
+  }
+  if (jit_running && jit_pending >= JIT_MAX_PENDING) return 0;
+
+  if (!jit_running) {
+    req = jrequest_alloc(func, start, end, stack, full_compile, FALSE);
+    req->tier = tier;
+    req->prev = prev;
+    jrequest_calls(req);
+    req->result = llvm_translate(req);
+    llvm_install(req);
+    i32 ret = req->result;
+    jrequest_free(req);
+    return ret;
+  }
+
+  req = jrequest_alloc(func, start, end, stack, full_compile, TRUE);
+  req->tier = tier;
+  req->prev = prev;
+  jrequest_calls(req);
+  pthread_mutex_lock(&jit_lock);
+  req->next = jit_requests;
+  jit_requests = req;
+  jit_pending++;
+  pthread_cond_signal(&jit_cond);
+  pthread_mutex_unlock(&jit_lock);
+  return 0;
+}
+
+/**
+ * @brief Installs all compilations which the compiler thread has finished
+ *
+ * Only called from the interpreter at points where it's about to look for
+ * compiled code, so functions never change underneath a running instruction.
+ */
+void llvm_publish() {
+  if (!jit_running || !__atomic_load_n(&jit_finished, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&jit_lock);
+  __atomic_store_n(&jit_finished, FALSE, __ATOMIC_RELAXED);
+  jrequest_t **cur = &jit_requests;
+  while (*cur != NULL) {
+    jrequest_t *req = *cur;
+    if (req->state != JREQ_DONE) {
+      cur = &req->next;
+      continue;
+    }
+    *cur = req->next;
+    jit_pending--;
+    llvm_install(req);
+    jrequest_free(req);
+  }
+  pthread_mutex_unlock(&jit_lock);
+}
+
+/**
+ * @brief Body of the compiler thread, which owns all of LLVM
+ *
+ * Requests are compiled oldest first. Functions garbage collected in the
+ * meantime are deleted from the module in between compilations.
+ */
+static void *llvm_worker(void *arg) {
+  pthread_mutex_lock(&jit_lock);
+  while (!jit_stop) {
+    while (jit_garbage != NULL) {
+      jgarbage_t *g = jit_garbage;
+      jit_garbage = g->next;
+      LLVMFreeMachineCodeForFunction(ex_engine, g->value);
+      LLVMDeleteFunction(g->value);
+      free(g);
+    }
+
+    jrequest_t *req, *next = NULL;
+    for (req = jit_requests; req != NULL; req = req->next) {
+      if (req->state == JREQ_QUEUED) next = req;
+    }
+    if (next == NULL) {
+      pthread_cond_wait(&jit_cond, &jit_lock);
+      continue;
+    }
+
+    next->state = JREQ_COMPILING;
+    pthread_mutex_unlock(&jit_lock);
+    next->result = llvm_translate(next);
+    pthread_mutex_lock(&jit_lock);
+    next->state = JREQ_DONE;
+    __atomic_store_n(&jit_finished, TRUE, __ATOMIC_RELEASE);
+    /* Running baseline code can now hand over to the interpreter, which
+       installs the new code */
+    if (next->result >= 0 && next->prev != NULL) {
+      __atomic_store_n(&next->prev->superseded, TRUE, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&jit_lock);
+  return arg;
+}
+
+/**
+ * @brief Keeps everything outstanding requests refer to alive
+ *
+ * The compiler thread reads the function and any closures whose calls it
+ * compiles, and the generated code refers to its jfunc handle and the code
+ * it inlines.
+ */
+static void llvm_gc() {
+  jrequest_t *req;
+  u32 i;
+  for (req = jit_requests; req != NULL; req = req->next) {
+    gc_traverse_pointer(req->func, LFUNC);
+    gc_traverse_pointer(req->jfun, LANY);
+    gc_traverse_pointer(req->prev, LANY);
+    for (i = 0; req->inlined != NULL && i <= req->end - req->start; i++) {
+      gc_traverse_pointer(req->inlined[i], LANY);
+    }
+    for (i = req->start; i <= req->end; i++) {
+      if (OP(req->snap->instrs[i].instr) == OP_CALL) {
+        gc_traverse_pointer(req->snap->trace.misc[i].closure, LFUNCTION);
+      }
+    }
+  }
+}
+
 Value build_pow(LLVMBuilderRef builder, Value bv, Value cv, const char* name) {
   Value fn = LLVMGetNamedFunction(module, "llvm.pow.f64");
   xassert(fn != NULL);
@@ -1909,7 +3500,19 @@ i32 llvm_run(jfunc_t *function, lclosure_t *closure, u32 *args) {
  * @return 0 on success, negative number on failure
  */
 void llvm_free(jfunc_t *func) {
-  if (func->value != NULL) {
+  u32 i;
+  for (i = 0; i < func->num_inlined; i++) {
+    if (func->inlined[i] != NULL) func->inlined[i]->ref_count--;
+  }
+  free(func->inlined);
+  if (func->value != NULL && jit_running) {
+    jgarbage_t *g = xmalloc(sizeof(jgarbage_t));
+    g->value = func->value;
+    pthread_mutex_lock(&jit_lock);
+    g->next = jit_garbage;
+    jit_garbage = g;
+    pthread_mutex_unlock(&jit_lock);
+  } else if (func->value != NULL) {
     // TODO - does this actually delete everything?
     LLVMFreeMachineCodeForFunction(ex_engine, func->value);
     LLVMDeleteFunction(func->value);
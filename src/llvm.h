@@ -10,6 +10,13 @@ typedef struct jfunc {
   void *binary;
   void *value;
   u64  ref_count;
+  u32  hotness;     //<! Times baseline code was entered or looped
+  u8   tier;        //<! JIT_TIER_* the code was compiled at
+  u8   superseded;  //<! Set once code from a better tier is ready
+  u8   stale;       //<! Set once a side exit was taken JIT_EXIT_LIMIT times
+  u8   no_tier_up;  //<! Set once compiling at the optimizing tier failed
+  struct jfunc **inlined; //<! Code inlined at each call, see llvm_install()
+  u32  num_inlined;
 } jfunc_t;
 
 #include "lstate.h"
@@ -20,15 +27,38 @@ typedef struct jfunc {
 #define JRETC   3
 #define JRETVI  4
 #define JARGS   5
+// Fully compiled functions take this many of their parameters as arguments,
+// and read the rest off the lua stack like varargs. vm_fun() passes this many
+#define JIT_FULL_ARGS 4
 
 // This the value to set an instruction's run count to if
 // it can't be compiled yet
 #define INVAL_RUN_COUNT 250
 // Code won't be compiled unless it's been run this many times
 #define COMPILE_COUNT 3
+// Code is first compiled quickly, and recompiled with every optimization
+// once it's been entered (or its loop has iterated) TIER_UP_COUNT times
+#define JIT_TIER_BASE 0
+#define JIT_TIER_OPT  1
+#define TIER_UP_COUNT 1000
+#define JIT_TIER_UP(jfun)                                          \
+  ((jfun)->tier == JIT_TIER_BASE && (jfun)->hotness >= TIER_UP_COUNT && \
+   !(jfun)->no_tier_up)
+// Once compiled code leaves through the same side exit this many times, the
+// region is recompiled without the failing assumption
+#define JIT_EXIT_LIMIT 16
+#define JIT_WIDENED(instr) ((instr)->exits >= JIT_EXIT_LIMIT)
+#define JIT_RECOMPILE(jfun) (JIT_TIER_UP(jfun) || (jfun)->stale)
+// Fully compiled callees with at most this many instructions are inlined into
+// their optimized callers
+#define JIT_INLINE_MAX 32
+// Most compilations queued for the background thread at once
+#define JIT_MAX_PENDING 16
 
 void llvm_init();
 void llvm_destroy();
+void llvm_stop();
+void llvm_publish();
 
 i32  llvm_compile(struct lfunc *func, u32 start, u32 end, luav *stack, int full);
 i32  llvm_run(jfunc_t *func, struct lclosure *closure, u32 *args);
@@ -8,7 +8,7 @@
 #include "util.h"
 
 #define LOAD_FACTOR 60
-#define STRING_HASHMAP_CAP 251
+#define STRING_HASHMAP_CAP 256 /* must be a power of two */
 #define NONEMPTY(p) ((size_t)(p) > 1)
 #define LSTR_EMPTY ((lstring_t*) 1)
 
@@ -21,10 +21,13 @@ smap_t smap = {NULL, STRING_HASHMAP_CAP, 0};
 
 static int initialized = 0; //<! Sanity check
 static lstring_t *empty;    //<! Unique empty string
+static lstring_t *singles[256]; //<! Preinterned strings of one byte each
+static lstring_t **pinned;  //<! Permanent strings not in the map (long ones)
+static size_t pinned_cnt;   //<! Number of permanent long strings
 
 static void smap_insert(lstring_t *str);
 static void smap_ins(smap_t *map, lstring_t *str);
-static ssize_t smap_lookup(lstring_t *str);
+static ssize_t smap_lookup(u32 hash, const char *data, size_t size);
 static u32 smap_hash(u8 *str, size_t size);
 static void lstring_gc();
 
@@ -33,10 +36,20 @@ EARLY(0) static void lstr_init() {
   initialized = 1;
   empty = lstr_literal("", 1);
   gc_add_hook(lstring_gc);
+
+  u32 i;
+  for (i = 0; i < 256; i++) {
+    lstring_t *str = lstr_alloc(1);
+    str->data[0] = (char) i;
+    str->data[1] = 0;
+    str->permanent = TRUE;
+    singles[i] = lstr_add(str);
+  }
 }
 
 DESTROY static void lstr_destroy() {
   free(smap.table);
+  free(pinned);
   smap.table = NULL;
 }
 
@@ -47,6 +60,9 @@ static void lstring_gc() {
       gc_traverse_pointer(smap.table[i], LSTRING);
     }
   }
+  for (i = 0; i < pinned_cnt; i++) {
+    gc_traverse_pointer(pinned[i], LSTRING);
+  }
 }
 
 /**
@@ -68,6 +84,7 @@ lstring_t *lstr_alloc(size_t size) {
   str->data[0] = 0;
   str->hash    = 0;
   str->permanent = 0;
+  str->numeric = LSTR_NUM_UNKNOWN;
   return str;
 }
 
@@ -89,7 +106,9 @@ lstring_t *lstr_realloc(lstring_t *str, size_t size) {
  * @brief Add a new string to the global table
  *
  * If the string is already located in the global table, then the provided
- * string is ignored and the global string is returned.
+ * string is ignored and the global string is returned. Long strings are never
+ * added to the table and are returned as-is, their hash is computed lazily by
+ * lstr_hash() if they're ever used as a key.
  *
  * @param str the gc-allocated string
  * @return the canonical representation of the provided string
@@ -98,10 +117,13 @@ lstring_t *lstr_add(lstring_t *str) {
   xassert(initialized);
   assert(str->hash == 0);
   assert(str->data[str->length] == 0);
+  if (lstr_islong(str)) {
+    return str;
+  }
   // compute the hash of the string
   str->hash = smap_hash((u8*) str->data, str->length);
   // lookup the string in the hashset (see if it's already stored)
-  ssize_t found = smap_lookup(str);
+  ssize_t found = smap_lookup(str->hash, str->data, str->length);
   if (found >= 0) {
     return smap.table[found];
   }
@@ -110,6 +132,45 @@ lstring_t *lstr_add(lstring_t *str) {
   return str;
 }
 
+/**
+ * @brief Get the canonical string with the given contents
+ *
+ * Unlike lstr_add(), this takes the contents from anywhere (normally the
+ * middle of another string), so a new string is only allocated if there isn't
+ * already one with these contents. Single bytes are all preinterned, so they
+ * never allocate.
+ *
+ * @param mem the contents of the string
+ * @param size the length of the contents
+ * @return the canonical lstring_t with the provided contents
+ */
+lstring_t *lstr_intern(const char *mem, size_t size) {
+  xassert(initialized);
+  if (size == 0) {
+    return empty;
+  } else if (size == 1) {
+    return singles[(u8) mem[0]];
+  }
+
+  lstring_t *str;
+  u32 hash = 0;
+  if (size <= LSTR_SHORT_MAX) {
+    hash = smap_hash((u8*) mem, size);
+    ssize_t found = smap_lookup(hash, mem, size);
+    if (found >= 0) {
+      return smap.table[found];
+    }
+  }
+  str = lstr_alloc(size);
+  memcpy(str->data, mem, size);
+  str->data[size] = 0;
+  if (hash != 0) {
+    str->hash = hash;
+    smap_insert(str);
+  }
+  return str;
+}
+
 /**
  * @brief Creates a new lua string based off the literal C-string
  *
@@ -120,9 +181,14 @@ lstring_t *lstr_literal(char *cstr, int retain) {
   size_t size = strlen(cstr);
   lstring_t *str = lstr_alloc(size);
   str->length = size;
-  str->permanent = (u32) retain;
+  str->permanent = (u8) retain;
   memcpy(str->data, cstr, size + 1);
   lstring_t *actual = lstr_add(str);
+  /* Long strings aren't rooted by the string table, so keep track of them */
+  if (retain && lstr_islong(actual)) {
+    pinned = xrealloc(pinned, (pinned_cnt + 1) * sizeof(pinned[0]));
+    pinned[pinned_cnt++] = actual;
+  }
   return actual;
 }
 
@@ -141,6 +207,45 @@ int lstr_compare(lstring_t *s1, lstring_t *s2) {
   return s1->length > s2->length;
 }
 
+/**
+ * @brief Tests whether two strings have the same contents
+ *
+ * Short strings are interned, so this only needs to look at the contents when
+ * both strings are long.
+ *
+ * @param s1 the first string
+ * @param s2 the second string
+ * @return TRUE if the two strings are equal
+ */
+int lstr_equal(lstring_t *s1, lstring_t *s2) {
+  if (s1 == s2) {
+    return TRUE;
+  }
+  if (!lstr_islong(s1) || s1->length != s2->length) {
+    return FALSE;
+  }
+  if (s1->hash != 0 && s2->hash != 0 && s1->hash != s2->hash) {
+    return FALSE;
+  }
+  return memcmp(s1->data, s2->data, s1->length) == 0;
+}
+
+/**
+ * @brief Returns the hash of a string, computing it if necessary
+ *
+ * Interned strings already have their hash, but long strings only compute it
+ * the first time they're needed (normally when they're used as a table key).
+ *
+ * @param str the string to hash
+ * @return the hash of the string's contents
+ */
+u32 lstr_hash(lstring_t *str) {
+  if (str->hash == 0) {
+    str->hash = smap_hash((u8*) str->data, str->length);
+  }
+  return str->hash;
+}
+
 // lstring hash map stuff =====================================================
 
 static void smap_insert(lstring_t *str) {
@@ -150,7 +255,7 @@ static void smap_insert(lstring_t *str) {
     // create the new hashmap
     smap_t new_map;
     new_map.size = 0;
-    new_map.capacity = smap.capacity * 2 + 1;
+    new_map.capacity = smap.capacity * 2;
     new_map.table = xcalloc(new_map.capacity, sizeof(new_map.table[0]));
     // copy the old data into the new map
     for (i = 0; i < smap.capacity; i++) {
@@ -166,45 +271,126 @@ static void smap_insert(lstring_t *str) {
   smap_ins(&smap, str);
 }
 
+/*
+ * The probe sequence is triangular, which only visits every slot when the
+ * capacity is a power of two.
+ */
 static void smap_ins(smap_t *map, lstring_t *str) {
-  size_t cap = map->capacity;
-  size_t idx = str->hash % cap;
+  size_t mask = map->capacity - 1;
+  size_t idx = str->hash & mask;
   size_t step = 1;
   while (map->table[idx] != NULL) {
-    idx = (idx + step) % cap;
+    idx = (idx + step) & mask;
     step++;
   }
   map->table[idx] = str;
   map->size++;
 }
 
-static ssize_t smap_lookup(lstring_t *str) {
+static ssize_t smap_lookup(u32 hash, const char *data, size_t size) {
   lstring_t *s;
-  size_t cap = smap.capacity;
-  size_t idx = str->hash % cap;
+  size_t mask = smap.capacity - 1;
+  size_t idx = hash & mask;
   size_t step = 1;
   while ((s = smap.table[idx]) != NULL) {
     if (s != LSTR_EMPTY &&
-        str->length == s->length &&
-        memcmp(str->data, s->data, str->length) == 0)
+        hash == s->hash &&
+        size == s->length &&
+        memcmp(data, s->data, size) == 0)
       return (ssize_t) idx;
-    idx = (idx + step) % cap;
+    idx = (idx + step) & mask;
     step++;
   }
   return -1;
 }
 
+/* Constants for the string hash (the default wyhash secret) */
+static const u64 smap_secret[4] = {
+  UINT64_C(0xa0761d6478bd642f), UINT64_C(0xe7037ed1a0b428db),
+  UINT64_C(0x8ebc6af09c88c6e3), UINT64_C(0x589965cc75374cc3)
+};
+
+static inline void smap_mum(u64 *a, u64 *b) {
+  __uint128_t r = (__uint128_t) *a * *b;
+  *a = (u64) r;
+  *b = (u64) (r >> 64);
+}
+
+static inline u64 smap_mix(u64 a, u64 b) {
+  smap_mum(&a, &b);
+  return a ^ b;
+}
+
+static inline u64 smap_r8(u8 *p) {
+  u64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline u64 smap_r4(u8 *p) {
+  u32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/**
+ * @brief Hash the full contents of a string
+ *
+ * This is wyhash: every byte of the string contributes to the hash, so long
+ * strings which only differ in a few places don't all land in the same bucket.
+ * Strings longer than 48 bytes are consumed in three independent lanes of 16
+ * bytes each, which keeps the multipliers busy in parallel.
+ *
+ * @param str the bytes to hash
+ * @param size the number of bytes
+ * @return the hash of the string, never 0 (0 marks an un-interned string)
+ */
 static u32 smap_hash(u8 *str, size_t size) {
-  // figure out a step value
-  size_t step = (size >> 5) + 1;
-  // compute the hash
-  u32 hash = lv_hash((luav) size);
-  u8 *end = str + size;
-  while (str < end) {
-    hash = hash ^ ((hash << 5) + (hash >> 2) + *str);
-    str += step;
+  u64 seed = smap_mix(smap_secret[0], smap_secret[1]);
+  u64 a, b;
+  size_t i = size;
+
+  if (size <= 16) {
+    if (size >= 4) {
+      size_t mid = (size >> 3) << 2;
+      a = (smap_r4(str) << 32) | smap_r4(str + mid);
+      b = (smap_r4(str + size - 4) << 32) | smap_r4(str + size - 4 - mid);
+    } else if (size > 0) {
+      a = ((u64) str[0] << 16) | ((u64) str[size >> 1] << 8) | str[size - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (i > 48) {
+      u64 seed1 = seed, seed2 = seed;
+      do {
+        seed  = smap_mix(smap_r8(str) ^ smap_secret[1],
+                         smap_r8(str + 8) ^ seed);
+        seed1 = smap_mix(smap_r8(str + 16) ^ smap_secret[2],
+                         smap_r8(str + 24) ^ seed1);
+        seed2 = smap_mix(smap_r8(str + 32) ^ smap_secret[3],
+                         smap_r8(str + 40) ^ seed2);
+        str += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+      seed = smap_mix(smap_r8(str) ^ smap_secret[1], smap_r8(str + 8) ^ seed);
+      str += 16;
+      i -= 16;
+    }
+    a = smap_r8(str + i - 16);
+    b = smap_r8(str + i - 8);
   }
-  return hash;
+
+  a ^= smap_secret[1];
+  b ^= seed;
+  smap_mum(&a, &b);
+  u64 hash = smap_mix(a ^ smap_secret[0] ^ size, b ^ smap_secret[1]);
+  u32 folded = (u32) hash ^ (u32) (hash >> 32);
+  return folded == 0 ? 1 : folded;
 }
 
 /**
@@ -216,10 +402,10 @@ static u32 smap_hash(u8 *str, size_t size) {
  * @param str the string to remove.
  */
 void lstr_remove(lstring_t *str) {
-  if (smap.table == NULL) {
+  if (smap.table == NULL || lstr_islong(str)) {
     return;
   }
-  ssize_t idx = smap_lookup(str);
+  ssize_t idx = smap_lookup(str->hash, str->data, str->length);
   if (idx >= 0 && smap.table[idx] == str) {
     smap.table[idx] = LSTR_EMPTY;
   }
@@ -9,18 +9,32 @@
 typedef struct lstring {
   size_t  length;
   u32     hash;
-  u32     permanent;
+  u8      permanent;
+  u8      numeric;    //<! One of LSTR_NUM_*, whether number is valid
+  double  number;     //<! Cached value of the string parsed in base 10
   char    data[1];
 } lstring_t;
 
+#define LSTR_NUM_UNKNOWN 0  /* The string hasn't been parsed as a number yet */
+#define LSTR_NUM_VALID   1  /* The string is a number, and it's cached */
+#define LSTR_NUM_INVALID 2  /* The string isn't a number */
+
+/* Strings longer than this aren't interned. They're hashed lazily, and are
+   compared by their contents instead of by pointer */
+#define LSTR_SHORT_MAX 40
+#define lstr_islong(s) ((s)->length > LSTR_SHORT_MAX)
+
 #define LSTR(s) lv_string(lstr_literal(s, TRUE))
 
 lstring_t *lstr_alloc(size_t size);
 lstring_t *lstr_realloc(lstring_t *str, size_t size);
 lstring_t *lstr_add(lstring_t *str);
+lstring_t *lstr_intern(const char *mem, size_t size);
 void       lstr_remove(lstring_t *str);
 lstring_t *lstr_literal(char *cstr, int keep);
 int        lstr_compare(lstring_t *s1, lstring_t *s2);
+int        lstr_equal(lstring_t *s1, lstring_t *s2);
+u32        lstr_hash(lstring_t *str);
 lstring_t *lstr_concat(lstring_t *s1, lstring_t *s2);
 
 lstring_t *lstr_empty();
@@ -128,6 +128,12 @@ int lv_compare(luav v1, luav v2) {
   err_rawstr(errbuf, TRUE);
 }
 
+/* Exactly representable powers of ten */
+static const double lv_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
 /**
  * @brief Cast a luav into a number
  *
@@ -153,7 +159,99 @@ double lv_castnumberb(luav number, u32 base, u32 argnum) {
   return num;
 }
 
-int lv_parsenum(lstring_t *str, u32 base, double *value) {
+/**
+ * @brief Parse a plain decimal or hexadecimal number without any libc calls
+ *
+ * Decimal numbers with at most 19 significant digits are accumulated in an
+ * integer, and when both that and the power of ten it's scaled by are exactly
+ * representable as doubles, one correctly rounded multiply or divide gives
+ * the right answer. Anything else, including malformed input, is left to the
+ * slow path to decide.
+ *
+ * @param s the beginning of the string
+ * @param end the end of the string
+ * @param value filled in with the number parsed
+ * @return 0 if the number was parsed, or -1 if the slow path must be taken
+ */
+static int lv_parsefast(const char *s, const char *end, double *value) {
+  u64 w = 0;
+  int digits = 0, exp10 = 0, neg = 0, any = 0;
+  double num;
+
+  while (s < end && isspace((u8) *s)) s++;
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = *s++ == '-';
+  }
+
+  if (end - s > 2 && s[0] == '0' && (s[1] | 0x20) == 'x') {
+    for (s += 2; s < end && isxdigit((u8) *s); s++) {
+      if (++digits > 16) { return -1; }
+      u32 d = (u32) (isdigit((u8) *s) ? *s - '0' : (*s | 0x20) - 'a' + 10);
+      w = w * 16 + d;
+    }
+    if (digits == 0) { return -1; }
+    num = (double) w;
+  } else {
+    for (; s < end && isdigit((u8) *s); s++, any = 1) {
+      if (w != 0 || *s != '0') {
+        if (++digits > 19) { return -1; }
+        w = w * 10 + (u64) (*s - '0');
+      }
+    }
+    if (s < end && *s == '.') {
+      for (s++; s < end && isdigit((u8) *s); s++, any = 1) {
+        exp10--;
+        if (w != 0 || *s != '0') {
+          if (++digits > 19) { return -1; }
+          w = w * 10 + (u64) (*s - '0');
+        }
+      }
+    }
+    if (!any) { return -1; }
+    if (s < end && (*s | 0x20) == 'e') {
+      int eneg = 0, e = 0;
+      s++;
+      if (s < end && (*s == '-' || *s == '+')) {
+        eneg = *s++ == '-';
+      }
+      if (s == end || !isdigit((u8) *s)) { return -1; }
+      for (; s < end && isdigit((u8) *s); s++) {
+        if (e < 10000) { e = e * 10 + (*s - '0'); }
+      }
+      exp10 += eneg ? -e : e;
+    }
+
+    if (w > (1ULL << 53)) {
+      return -1;
+    } else if (w == 0) {
+      num = 0;
+    } else if (exp10 < -22) {
+      return -1;
+    } else if (exp10 < 0) {
+      num = (double) w / lv_pow10[-exp10];
+    } else if (exp10 <= 22) {
+      num = (double) w * lv_pow10[exp10];
+    } else {
+      /* Move some of the power of ten into w if it stays exact */
+      for (; exp10 > 22 && w <= (1ULL << 53) / 10; exp10--) {
+        w *= 10;
+      }
+      if (exp10 > 22) { return -1; }
+      num = (double) w * lv_pow10[exp10];
+    }
+  }
+
+  while (s < end && isspace((u8) *s)) s++;
+  if (s != end) { return -1; }
+  *value = neg ? -num : num;
+  return 0;
+}
+
+/**
+ * @brief Parse a string as a number with the C library, accepting everything
+ *        strtod() or strtoull() do
+ */
+static int lv_parseslow(lstring_t *str, u32 base, double *value) {
   char *end;
   double num = base == 10 ? strtod(str->data, &end) :
                             (double) strtoull(str->data, &end, (int) base);
@@ -167,6 +265,170 @@ int lv_parsenum(lstring_t *str, u32 base, double *value) {
   return -1;
 }
 
+/**
+ * @brief Parse a string as a number
+ *
+ * The result of parsing in base 10 is cached on the string, so coercing the
+ * same string over and over is cheap.
+ *
+ * @param str the string to parse
+ * @param base the base to parse in
+ * @param value filled in with the number parsed
+ * @return 0 on success, or -1 if the string isn't a number
+ */
+int lv_parsenum(lstring_t *str, u32 base, double *value) {
+  if (base != 10) {
+    return lv_parseslow(str, base, value);
+  }
+  if (str->numeric == LSTR_NUM_UNKNOWN) {
+    double num;
+    if (lv_parsefast(str->data, str->data + str->length, &num) == 0 ||
+        lv_parseslow(str, 10, &num) == 0) {
+      str->number  = num;
+      str->numeric = LSTR_NUM_VALID;
+    } else {
+      str->numeric = LSTR_NUM_INVALID;
+    }
+  }
+  if (str->numeric == LSTR_NUM_INVALID) {
+    return -1;
+  }
+  *value = str->number;
+  return 0;
+}
+
+static const char lv_digits2[] =
+  "000102030405060708091011121314151617181920212223242526272829"
+  "303132333435363738394041424344454647484950515253545556575859"
+  "606162636465666768697071727374757677787980818283848586878889"
+  "90919293949596979899";
+
+/**
+ * @brief Write the decimal digits of an integer, without a terminator
+ *
+ * @return the location just after the last digit written
+ */
+static char *lv_fmtint(char *dst, u64 n) {
+  char tmp[20];
+  char *p = tmp + sizeof(tmp);
+  while (n >= 100) {
+    p -= 2;
+    memcpy(p, &lv_digits2[(n % 100) * 2], 2);
+    n /= 100;
+  }
+  if (n >= 10) {
+    p -= 2;
+    memcpy(p, &lv_digits2[n * 2], 2);
+  } else {
+    *--p = (char) ('0' + n);
+  }
+  size_t len = (size_t) (tmp + sizeof(tmp) - p);
+  memcpy(dst, p, len);
+  return dst + len;
+}
+
+/**
+ * @brief Format a number exactly as snprintf() with LUA_NUMBER_FMT would
+ *
+ * Integers which fit in the 14 significant digits are written out directly.
+ * Other numbers in a wide range around 1 are scaled by a single exact power of
+ * ten so that the 14 digits to print are the integer part, and then rounded.
+ * The scaling introduces at most a tiny error, so whenever the part being
+ * rounded off is close enough to one half that the error could matter, or the
+ * number is out of that range, this falls back on snprintf().
+ *
+ * @param buf the destination, which must hold at least LUA_NUMBER_SIZE bytes
+ * @param num the number to format
+ * @return the length of the formatted string, which is null-terminated
+ */
+size_t lv_fmtnum(char *buf, double num) {
+  char *dst = buf;
+  double mag = fabs(num);
+
+  if (mag < 1e14 && num == (double) (i64) num) {
+    if (signbit(num)) {
+      *dst++ = '-';
+    }
+    dst = lv_fmtint(dst, (u64) mag);
+    *dst = 0;
+    return (size_t) (dst - buf);
+  } else if (!(mag >= 1e-8 && mag < 1e35)) {
+    return (size_t) snprintf(buf, LUA_NUMBER_SIZE, LUA_NUMBER_FMT, num);
+  }
+
+  /* Find the decimal exponent, estimated from the binary one */
+  int exp2, exp10, k;
+  frexp(mag, &exp2);
+  exp10 = (int) floor((exp2 - 1) * 0.30102999566398120);
+  double scaled;
+  while (1) {
+    k = 13 - exp10;
+    scaled = k >= 0 ? mag * lv_pow10[k] : mag / lv_pow10[-k];
+    if (scaled >= 1e14) {
+      exp10++;
+    } else if (scaled < 1e13) {
+      exp10--;
+    } else {
+      break;
+    }
+  }
+
+  double whole = floor(scaled);
+  double frac = scaled - whole;
+  if (fabs(frac - 0.5) < 0.03) {
+    return (size_t) snprintf(buf, LUA_NUMBER_SIZE, LUA_NUMBER_FMT, num);
+  }
+  u64 digits = (u64) whole + (frac > 0.5);
+  if (digits == 100000000000000ULL) {
+    digits /= 10;
+    exp10++;
+  }
+
+  char d[14];
+  lv_fmtint(d, digits);
+  int nd = 14;
+  while (d[nd - 1] == '0') {
+    nd--;
+  }
+
+  if (num < 0) {
+    *dst++ = '-';
+  }
+  if (exp10 >= 0 && exp10 < 14) {
+    memcpy(dst, d, (size_t) exp10 + 1);
+    dst += exp10 + 1;
+    if (nd > exp10 + 1) {
+      *dst++ = '.';
+      memcpy(dst, d + exp10 + 1, (size_t) (nd - exp10 - 1));
+      dst += nd - exp10 - 1;
+    }
+  } else if (exp10 < 0 && exp10 >= -4) {
+    *dst++ = '0';
+    *dst++ = '.';
+    memset(dst, '0', (size_t) (-exp10 - 1));
+    dst += -exp10 - 1;
+    memcpy(dst, d, (size_t) nd);
+    dst += nd;
+  } else {
+    *dst++ = d[0];
+    if (nd > 1) {
+      *dst++ = '.';
+      memcpy(dst, d + 1, (size_t) nd - 1);
+      dst += nd - 1;
+    }
+    *dst++ = 'e';
+    *dst++ = exp10 < 0 ? '-' : '+';
+    u64 ex = (u64) abs(exp10);
+    if (ex < 10) {
+      /* Exponents always have at least two digits */
+      *dst++ = '0';
+    }
+    dst = lv_fmtint(dst, ex);
+  }
+  *dst = 0;
+  return (size_t) (dst - buf);
+}
+
 lstring_t* lv_caststring(luav number, u32 argnum) {
   if (lv_isstring(number)) {
     return (lstring_t*) lv_getptr(number);
@@ -174,11 +436,8 @@ lstring_t* lv_caststring(luav number, u32 argnum) {
     err_badtype(argnum, LSTRING, lv_gettype(number));
   }
 
-  static char buf[20];
-  int len = snprintf(buf, sizeof(buf) - 1, LUA_NUMBER_FMT, lv_cvt(number));
-  lstring_t *str = lstr_alloc((size_t) len);
-  memcpy(str->data, buf, (size_t) len + 1);
-  return lstr_add(str);
+  char buf[LUA_NUMBER_SIZE];
+  return lstr_intern(buf, lv_fmtnum(buf, lv_cvt(number)));
 }
 
 /**
@@ -192,5 +451,60 @@ lstring_t* lv_caststring(luav number, u32 argnum) {
  * @return the concatenated string
  */
 luav lv_concat(luav v1, luav v2) {
-  return lv_string(lstr_concat(lv_caststring(v1, 0), lv_caststring(v2, 1)));
+  luav vals[2] = {v1, v2};
+  return lv_concatn(vals, 2);
+}
+
+/**
+ * @brief Concatenate a vector of lua-values into one string
+ *
+ * All numbers are formatted up front and the total length is computed before
+ * anything is copied, so the result is built in a single allocation and
+ * interned once, regardless of how many operands there are. Like lv_concat,
+ * metamethods are not consulted, and any value which isn't a string or a
+ * number causes an error.
+ *
+ * @param vals the values to concatenate, in order
+ * @param cnt the number of values in the vector
+ * @return the concatenated string
+ */
+luav lv_concatn(luav *vals, u32 cnt) {
+  char nums[cnt][LUA_NUMBER_SIZE];
+  size_t lens[cnt];
+  char *ptrs[cnt];
+  size_t total = 0;
+  u32 i, nonempty = 0;
+  luav last = LUAV_NIL;
+
+  for (i = 0; i < cnt; i++) {
+    if (lv_isstring(vals[i])) {
+      lstring_t *str = lv_getptr(vals[i]);
+      ptrs[i] = str->data;
+      lens[i] = str->length;
+    } else if (lv_isnumber(vals[i])) {
+      ptrs[i] = nums[i];
+      lens[i] = lv_fmtnum(nums[i], lv_cvt(vals[i]));
+    } else {
+      err_badtype(i, LSTRING, lv_gettype(vals[i]));
+    }
+    if (lens[i] > 0) {
+      nonempty++;
+      last = vals[i];
+    }
+    total += lens[i];
+  }
+
+  /* Concatenating with empty strings doesn't need a new string */
+  if (nonempty == 1 && lv_isstring(last)) {
+    return last;
+  }
+
+  lstring_t *str = lstr_alloc(total);
+  char *dst = str->data;
+  for (i = 0; i < cnt; i++) {
+    memcpy(dst, ptrs[i], lens[i]);
+    dst += lens[i];
+  }
+  *dst = 0;
+  return lv_string(lstr_add(str));
 }
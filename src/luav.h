@@ -101,11 +101,12 @@ struct lclosure* lv_getfunction(luav value, u32 argnum);
 struct lthread*  lv_getthread(luav value, u32 argnum);
 #define lv_getbool(v, _) ((u8) ((v) != LUAV_NIL && (v) != LUAV_FALSE))
 #define lv_getupvalue(v) \
-  ({ assert(lv_isupvalue(v)); (luav*) (size_t) LUAV_DATA(v); })
+  ({ assert(lv_isupvalue(v)); (struct lupvalue*) (size_t) LUAV_DATA(v); })
 
 #define lv_getptr(v)  ((void*) (size_t) ((v) & LUAV_DATA_MASK))
 
-int lv_parsenum(struct lstring *str, u32 base, double *value);
+int    lv_parsenum(struct lstring *str, u32 base, double *value);
+size_t lv_fmtnum(char *buf, double num);
 
 #define lv_hash(lv) (((u32) (lv) ^ (u32) ((lv) >> 32) ^ 0xfc83d6a5))
 #define lv_nilify(mem, count) memset((mem), 0xff, (count) * sizeof(luav))
@@ -114,6 +115,7 @@ int lv_parsenum(struct lstring *str, u32 base, double *value);
 u8   lv_gettype(luav value);
 int  lv_compare(luav v1, luav v2);
 luav lv_concat(luav v1, luav v2);
+luav lv_concatn(luav *vals, u32 cnt);
 
 static inline double lv_cvt(u64 bits) {
   union { double converted; u64 bits; } cvt;
@@ -134,4 +136,44 @@ static inline double lv_castnumber(luav n, u32 argnum) {
   return lv_castnumberb(n, 10, argnum);
 }
 
+/**
+ * @brief Primitive equality of two values, without metamethods
+ *
+ * Short strings are interned so they are equal only if they are the same
+ * pointer, but long strings are not, so those have to compare their contents.
+ * Table keys always have their hash, so a probe past a different long string
+ * is normally rejected here without calling lstr_equal().
+ */
+static inline int lv_rawequal(luav v1, luav v2) {
+  if (v1 == v2) {
+    return TRUE;
+  }
+  if (!lv_isstring(v1) || !lv_isstring(v2)) {
+    return FALSE;
+  }
+  lstring_t *s1 = lv_getptr(v1);
+  lstring_t *s2 = lv_getptr(v2);
+  if (!lstr_islong(s1) || s1->length != s2->length) {
+    return FALSE;
+  }
+  if (s1->hash != 0 && s2->hash != 0 && s1->hash != s2->hash) {
+    return FALSE;
+  }
+  return lstr_equal(s1, s2);
+}
+
+/**
+ * @brief Hash a value for use as a key in a table, consistent with
+ *        lv_rawequal()
+ */
+static inline u32 lv_keyhash(luav key) {
+  if (lv_isstring(key)) {
+    lstring_t *str = lv_getptr(key);
+    if (lstr_islong(str)) {
+      return lstr_hash(str);
+    }
+  }
+  return lv_hash(key);
+}
+
 #endif /* _LUAV_H_ */
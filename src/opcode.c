@@ -2,6 +2,7 @@
 
 #include "config.h"
 #include "opcode.h"
+#include "util.h"
 
 char rkbuf1[32];
 char rkbuf2[32];
@@ -119,3 +120,144 @@ void opcode_dump(FILE *out, uint32_t code) {
       exit(1);
   }
 }
+
+/**
+ * @brief Finds the instructions which can run right after an instruction
+ *
+ * @param func the function the instruction belongs to
+ * @param pc the index of the instruction
+ * @param succs filled in with the indices of the successors
+ * @return the number of successors, at most 2
+ */
+u32 opcode_successors(lfunc_t *func, u32 pc, u32 succs[2]) {
+  u32 code = func->instrs[pc].instr;
+  switch (OP(code)) {
+    case OP_JMP:
+    case OP_FORPREP:
+      succs[0] = (u32) ((i32) pc + 1 + SBX(code));
+      return 1;
+    case OP_FORLOOP:
+      succs[0] = pc + 1;
+      succs[1] = (u32) ((i32) pc + 1 + SBX(code));
+      return 2;
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_TEST:
+    case OP_TESTSET:
+    case OP_TFORLOOP:
+      succs[0] = pc + 1;
+      succs[1] = pc + 2;
+      return 2;
+    case OP_LOADBOOL:
+      succs[0] = C(code) ? pc + 2 : pc + 1;
+      return 1;
+    case OP_RETURN:
+    case OP_TAILCALL:
+      return 0;
+    case OP_CLOSURE:
+      /* Skip the pseudo-instructions naming the upvalues */
+      succs[0] = pc + 1 + func->funcs[BX(code)]->num_upvalues;
+      return 1;
+    case OP_SETLIST:
+      /* With C of 0, the next word is the real C */
+      succs[0] = C(code) == 0 ? pc + 2 : pc + 1;
+      return 1;
+    default:
+      succs[0] = pc + 1;
+      return 1;
+  }
+}
+
+/**
+ * @brief Finds the registers which an instruction may write to
+ *
+ * @param func the function the instruction belongs to
+ * @param pc the index of the instruction
+ * @param lo filled in with the first register written
+ * @param hi filled in with one past the last register written, so nothing is
+ *        written when equal to lo
+ */
+void opcode_writes(lfunc_t *func, u32 pc, u32 *lo, u32 *hi) {
+  u32 code = func->instrs[pc].instr;
+  u32 a = A(code);
+  *lo = a;
+  switch (OP(code)) {
+    case OP_MOVE:     case OP_LOADK:    case OP_LOADBOOL: case OP_GETUPVAL:
+    case OP_GETGLOBAL: case OP_GETTABLE: case OP_NEWTABLE: case OP_ADD:
+    case OP_SUB:      case OP_MUL:      case OP_DIV:      case OP_MOD:
+    case OP_POW:      case OP_UNM:      case OP_NOT:      case OP_LEN:
+    case OP_CONCAT:   case OP_CLOSURE:  case OP_TESTSET:  case OP_FORPREP:
+      *hi = a + 1; break;
+    case OP_LOADNIL:  *hi = B(code) + 1; break;
+    case OP_SELF:     *hi = a + 2; break;
+    case OP_FORLOOP:  *hi = a + 4; break;
+    case OP_TFORLOOP: *lo = a + 2; *hi = a + 3 + C(code); break;
+    case OP_CALL:
+      *hi = C(code) == 0 ? func->max_stack : a + C(code) - 1;
+      break;
+    case OP_VARARG:
+      *hi = B(code) == 0 ? func->max_stack : a + B(code) - 1;
+      break;
+    default:
+      *hi = a; break;
+  }
+  *hi = MIN(*hi, func->max_stack);
+  *lo = MIN(*lo, *hi);
+}
+
+/**
+ * @brief Finds the registers which an instruction may read
+ *
+ * @param func the function the instruction belongs to
+ * @param pc the index of the instruction
+ * @param regs flags of func->max_stack registers, those read are set to 1 and
+ *        the rest are left alone
+ */
+void opcode_reads(lfunc_t *func, u32 pc, u8 *regs) {
+  u32 code = func->instrs[pc].instr;
+  u32 a = A(code), b = B(code), c = C(code);
+  u32 i, lo = 0, hi = 0;
+  switch (OP(code)) {
+    case OP_MOVE:    case OP_UNM:     case OP_NOT:     case OP_LEN:
+    case OP_TESTSET:
+      lo = b; hi = b + 1; break;
+    case OP_SETGLOBAL: case OP_SETUPVAL: case OP_TEST:
+      lo = a; hi = a + 1; break;
+    case OP_SETTABLE:
+      regs[a] = 1;
+      /* fall through */
+    case OP_ADD:     case OP_SUB:     case OP_MUL:     case OP_DIV:
+    case OP_MOD:     case OP_POW:     case OP_EQ:      case OP_LT:
+    case OP_LE:
+      if (b < 256) regs[b] = 1;
+      if (c < 256) regs[c] = 1;
+      break;
+    case OP_GETTABLE: case OP_SELF:
+      regs[b] = 1;
+      if (c < 256) regs[c] = 1;
+      break;
+    case OP_CONCAT:   lo = b; hi = c + 1; break;
+    case OP_FORLOOP:  case OP_FORPREP: case OP_TFORLOOP:
+      lo = a; hi = a + 3; break;
+    case OP_CALL:     case OP_TAILCALL:
+      lo = a; hi = b == 0 ? (u32) func->max_stack : a + b; break;
+    case OP_RETURN:
+      lo = a; hi = b == 0 ? (u32) func->max_stack : a + b - 1; break;
+    case OP_SETLIST:
+      lo = a; hi = b == 0 ? (u32) func->max_stack : a + b + 1; break;
+    case OP_CLOSURE:
+      /* Upvalues which are locals are named by pseudo-instructions */
+      for (i = 1; i <= func->funcs[BX(code)]->num_upvalues; i++) {
+        u32 pseudo = func->instrs[pc + i].instr;
+        if (OP(pseudo) == OP_MOVE) regs[B(pseudo)] = 1;
+      }
+      break;
+    default:
+      break;
+  }
+  hi = MIN(hi, func->max_stack);
+  for (i = lo; i < hi; i++) {
+    regs[i] = 1;
+  }
+}
@@ -44,6 +44,31 @@
 #define OP_CLOSURE 36
 #define OP_VARARG 37
 
+/* Versions of the opcodes above specialized to the operand types an
+   instruction has been seen running with. These never appear in bytecode, the
+   interpreter only stores them in instr_t.op (see VM_QUICKEN in vm.c) */
+#define OP_ADD_NUM_NUM 38
+#define OP_ADD_NUM_K 39
+#define OP_SUB_NUM_NUM 40
+#define OP_SUB_NUM_K 41
+#define OP_MUL_NUM_NUM 42
+#define OP_MUL_NUM_K 43
+#define OP_DIV_NUM_NUM 44
+#define OP_DIV_NUM_K 45
+#define OP_MOD_NUM_NUM 46
+#define OP_MOD_NUM_K 47
+#define OP_LT_NUM_NUM 48
+#define OP_LT_NUM_K 49
+#define OP_LT_K_NUM 50
+#define OP_LE_NUM_NUM 51
+#define OP_LE_NUM_K 52
+#define OP_LE_K_NUM 53
+#define OP_GETTABLE_ARRAY_INT 54
+#define OP_GETTABLE_STRKEY 55
+#define OP_SETTABLE_ARRAY_INT 56
+#define OP_FORLOOP_NUM 57
+#define NUM_OPCODES 58
+
 #define A_SIZE 8
 #define B_SIZE 9
 #define C_SIZE 9
@@ -60,5 +85,8 @@
 
 void opcode_dump(FILE *out, uint32_t code);
 void opcode_dump_idx(FILE *out, lfunc_t *func, size_t idx);
+u32  opcode_successors(lfunc_t *func, u32 pc, u32 succs[2]);
+void opcode_writes(lfunc_t *func, u32 pc, u32 *lo, u32 *hi);
+void opcode_reads(lfunc_t *func, u32 pc, u8 *regs);
 
 #endif /* _OPCODE_H */
@@ -172,9 +172,14 @@ static int luac_parse_func(lfunc_t *func, int fd, char *filename, u8 st_size) {
   for (i = 0; i < func->num_instrs; i++) {
     func->instrs[i].instr = xread4(fd);
     func->instrs[i].count = 0;
+    func->instrs[i].op = (u8) OP(func->instrs[i].instr);
+    func->instrs[i].deopts = 0;
+    func->instrs[i].exits = 0;
     func->instrs[i].jfunc = NULL;
   }
   trace_init(&func->trace, func->num_instrs);
+  func->icache = gc_alloc(func->num_instrs * sizeof(icache_t), LANY);
+  memset(func->icache, 0, func->num_instrs * sizeof(icache_t));
   func->jfunc = NULL;
 
   // compute the predecessor information
@@ -196,25 +201,14 @@ static int luac_parse_func(lfunc_t *func, int fd, char *filename, u8 st_size) {
     }
   }
 
-  // check if this function is fully compilable
-  u8 compilable = (func->num_parameters < 6);
+  // check if this function is fully compilable, everything but a tail call
+  // passing on however many values the instruction before it left is
+  u8 compilable = TRUE;
   for (pc = 0; (u32) pc < func->num_instrs; pc++) {
-    if (!compilable) break;
     u32 instr = func->instrs[pc].instr;
-    switch (OP(instr)) {
-      case OP_TAILCALL:
-      case OP_VARARG:
-        compilable = FALSE;
-        break;
-      case OP_SETLIST:
-        compilable = (B(instr) != 0);
-        break;
-      case OP_CALL:
-        compilable = (B(instr) != 0 && C(instr) != 0);
-        break;
-      case OP_RETURN:
-        compilable = (B(instr) == 1 || B(instr) == 2);
-        break;
+    if (OP(instr) == OP_TAILCALL && B(instr) == 0) {
+      compilable = FALSE;
+      break;
     }
   }
   func->compilable = compilable;
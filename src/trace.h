@@ -6,11 +6,14 @@
 
 #define TRACELIMIT 8
 #define TRACEMAX   255
-#define TRACE_UPVAL (1 << 7)
 #define TRACE_CONST (1 << 6)
-#define TRACE_ISUPVAL(v) ((v) & TRACE_UPVAL)
 #define TRACE_ISCONST(v) ((v) & TRACE_CONST)
 #define TRACE_TYPEMASK 0xf
+/* Directions a numeric for loop has been seen stepping in, OR'd together in
+   the trace of its FORLOOP */
+#define TRACE_FOR_UP   1
+#define TRACE_FOR_DOWN 2
+#define TRACE_FOR_ANY  (TRACE_FOR_UP | TRACE_FOR_DOWN)
 
 struct lclosure;
 
@@ -3,6 +3,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 
 #include "debug.h"
 #include "error.h"
@@ -20,21 +21,15 @@
 #define STACKI(n) (stack + (n))
 #define STACK(n) vm_stack->base[STACKI(n)]
 #define CONST(n) ({ assert((n) < func->num_consts); func->consts[n]; })
-#define REG(n)                                                                \
-  ({                                                                          \
-    assert(&STACK(n) < vm_stack->top);                                        \
-    luav _tmp = STACK(n);                                                     \
-    lv_isupvalue(_tmp) ? *lv_getupvalue(_tmp) : _tmp;                         \
+#define REG(n)                                             \
+  ({                                                       \
+    assert(&STACK(n) < vm_stack->top);                     \
+    STACK(n);                                              \
   })
 #define SETREG(n, v)                                       \
   ({                                                       \
     assert(&STACK(n) < vm_stack->top);                     \
-    luav tmp = STACK(n);                                   \
-    if (lv_isupvalue(tmp)) {                               \
-      *lv_getupvalue(tmp) = v;                             \
-    } else {                                               \
-      STACK(n) = v;                                        \
-    }                                                      \
+    STACK(n) = (v);                                        \
   })
 #define KREG(n) ((n) >= 256 ? CONST((n) - 256) : REG(n))
 #define UPVALUE(closure, n)                                \
@@ -43,17 +38,114 @@
     (closure)->upvalues[n];                                \
   })
 #define SETTRACE(traceidx, val) \
-      if (JIT_ON) { func->trace.instrs[pc][traceidx] = lv_gettype(val); }
+      if (JIT_ON) { func->trace.instrs[PC][traceidx] = lv_gettype(val); }
+/* Adds the direction of a FORLOOP's step to the directions it has stepped */
+#define TRACE_FORDIR(step) {                                       \
+    u8 *__dir = &func->trace.instrs[PC][0];                        \
+    *__dir = (u8) ((*__dir == LANY ? 0 : *__dir) |                 \
+                   ((step) < 0 ? TRACE_FOR_DOWN : TRACE_FOR_UP));  \
+  }
 #define SETTRACETABLE(tbl, val)                             \
       if (JIT_CACHE_TABLE) {                                \
-        func->trace.misc[pc].table.pointer = (tbl);         \
-        func->trace.misc[pc].table.version = (tbl)->version;\
-        func->trace.misc[pc].table.value   = (val);         \
+        func->trace.misc[PC].table.pointer = (tbl);         \
+        func->trace.misc[PC].table.version = (tbl)->version;\
+        func->trace.misc[PC].table.value   = (val);         \
       }
 #define COMPILABLE(instr) ((instr)->count < INVAL_RUN_COUNT &&  \
                            (instr)->count > COMPILE_COUNT &&    \
                            JIT_ON)
 
+/* Index into the array part of `hash` for the number `n`, or 0 if `n` is not
+   an integer within the array part, mirroring the check in lhash_get */
+#define ARRAY_INDEX(hash, n)                               \
+  ({                                                       \
+    double _n = (n);                                       \
+    i32 _index = (i32) _n;                                 \
+    ((double) _index == _n && _index > 0 &&                \
+     (u32) _index < (hash)->acap) ? _index : 0;            \
+  })
+
+/* Whether `v` is a number holding an integer which fits in an i32, which
+   compiled for loops need in order to count with integers */
+#define IS_I32(v)                                                  \
+  ({                                                               \
+    luav _v = (v);                                                 \
+    lv_isnumber(_v) && lv_cvt(_v) >= INT32_MIN &&                  \
+      lv_cvt(_v) <= INT32_MAX && lv_cvt(_v) == (i32) lv_cvt(_v);   \
+  })
+
+/* Index of the instruction currently being executed */
+#define PC ((u32) (cur - func->instrs))
+
+#ifndef NDEBUG
+#define VM_TRACE()                                         \
+  if (flags.print) {                                       \
+    printf("[%d] ", func->lines[PC]);                      \
+    opcode_dump(stdout, code);                             \
+    printf("\n");                                          \
+  }
+#else
+#define VM_TRACE()
+#endif
+
+/* Loads the next instruction into `code`, counting how often it runs */
+#define VM_FETCH()                                         \
+  ({                                                       \
+    assert(instrs < func->instrs + func->num_instrs);      \
+    cur = instrs++;                                        \
+    cur->count++;                                          \
+    code = cur->instr;                                     \
+    VM_TRACE();                                            \
+  })
+
+/* Each handler ends in VM_NEXT to run the following instruction, or VM_LOOP
+   after a backward jump so a compiled version of the loop can be used. The
+   handler run is picked by instr_t.op rather than the opcode in `code` so that
+   instructions can be specialized in place. */
+#if VM_COMPUTED_GOTO
+#define VM_CASE(op)     L_##op
+#define VM_DEFAULT      L_DEFAULT
+#define VM_DISPATCH(op) goto *vm_labels[op]
+#define VM_NEXT         do { VM_FETCH(); VM_DISPATCH(cur->op); } while (0)
+#else
+#define VM_CASE(op)     case op
+#define VM_DEFAULT      default
+#define VM_DISPATCH(op) do { opc = (op); goto redispatch; } while (0)
+#define VM_NEXT         goto dispatch
+#endif
+#define VM_LOOP         goto jit_check
+
+/* Return `n` values, already stored at retvi, from the running function. If
+   it was called from within this invocation of vm_funi its caller resumes,
+   otherwise vm_funi itself returns. */
+#define VM_RETURN(n)                                       \
+  do {                                                     \
+    got = (n);                                             \
+    if (depth == 0) {                                      \
+      return got;                                          \
+    }                                                      \
+    goto resume_caller;                                    \
+  } while (0)
+
+/* Once an instruction has run a few times with operands of the types a
+   specialized handler expects, the generic handler rewrites it to use that
+   handler instead. The specialized handler checks its assumptions and on a
+   mismatch reverts the instruction and reruns it generically, and an
+   instruction which keeps reverting is left generic for good. */
+#define VM_QUICKEN(qop)                                    \
+  do {                                                     \
+    if (VM_QUICKENING && cur->count >= QUICKEN_COUNT &&    \
+        cur->deopts < QUICKEN_MAX_DEOPTS) {                \
+      cur->op = (qop);                                     \
+    }                                                      \
+  } while (0)
+#define VM_DEOPT()                                         \
+  do {                                                     \
+    cur->op = (u8) OP(code);                               \
+    cur->deopts++;                                         \
+    VM_DISPATCH(OP(code));                                 \
+  } while (0)
+
 lhash_t *userdata_meta;      //<! metatables for all existing userdata
 lhash_t *lua_globals;        //<! default global environment
 lhash_t *global_env = NULL;  //<! current global environment
@@ -62,15 +154,17 @@ lstack_t *vm_stack;          //<! current stack, changes on thread switches
 static lstack_t init_stack;  //<! initial stack
 int jit_bailed;              //<! Did the jit just bail out because of error?
 jfunc_t *running_jfunc;      //<! Compiled function which bailed
+char *vm_cstack_limit;       //<! lowest C stack address to run compiled code
 
-static u32 op_close(u32 upc, luav *upv);
 static int meta_unary(luav operand, luav method, u32 reti);
 static int meta_binary(luav operand, luav method, luav lv, luav rv, u32 reti);
 static int meta_eq(luav operand1, luav operand2, luav method, luav *ret);
 static luav meta_lhash_get(luav operand, luav key);
+static luav icache_get(icache_t *ic, lhash_t *hash, luav key);
 static void meta_lhash_set(luav operand, luav key, luav val);
 static u32  meta_call(luav value, u32 argc, u32 argvi, u32 retc, u32 retvi);
 static luav meta_concat(luav v1, luav v2);
+static luav meta_concatn(u32 base, u32 cnt);
 static void vm_gc();
 
 /**
@@ -86,6 +180,16 @@ EARLY(100) static void vm_setup() {
   vm_stack_init(&init_stack, VM_STACK_INIT);
   vm_stack = &init_stack;
   gc_add_hook(vm_gc);
+
+  /* Compiled lua functions call each other on the C stack, so they can only
+     go as deep as the main thread's stack has room for */
+  struct rlimit lim;
+  size_t size = 8 * 1024 * 1024;
+  if (getrlimit(RLIMIT_STACK, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY) {
+    size = (size_t) lim.rlim_cur;
+  }
+  size = size > 2 * VM_CSTACK_RESERVE ? size - VM_CSTACK_RESERVE : size / 2;
+  vm_cstack_limit = (char*) __builtin_frame_address(0) - size;
 }
 
 DESTROY static void vm_destroy() {
@@ -145,6 +249,9 @@ void vm_stack_init(lstack_t *stack, u32 size) {
   stack->limit = size;
   stack->base  = xmalloc(sizeof(luav) * size);
   stack->top   = stack->base;
+  stack->open  = NULL;
+  stack->ci    = NULL;
+  stack->ci_free = NULL;
 }
 
 /**
@@ -154,6 +261,14 @@ void vm_stack_init(lstack_t *stack, u32 size) {
  * @return 0 on success, negative error code on failure
  */
 void vm_stack_destroy(lstack_t *stack) {
+  /* closures may outlive the stack, so they get their own copies */
+  vm_stack_close(stack, 0);
+  vm_stack_unwind(stack, NULL);
+  while (stack->ci_free != NULL) {
+    lcallinfo_t *ci = stack->ci_free;
+    stack->ci_free = ci->prev;
+    free(ci);
+  }
   free(stack->base);
   // zero things out just be be safe
   stack->size  = 0;
@@ -162,6 +277,64 @@ void vm_stack_destroy(lstack_t *stack) {
   stack->top   = NULL;
 }
 
+/**
+ * @brief Push a call info for a call made within the interpreter loop
+ *
+ * @param stack the stack the call is running on
+ * @return the call info to save the caller's state in
+ */
+static lcallinfo_t* vm_callinfo_push(lstack_t *stack) {
+  lcallinfo_t *ci = stack->ci_free;
+  if (ci != NULL) {
+    stack->ci_free = ci->prev;
+  } else {
+    ci = xmalloc(sizeof(lcallinfo_t));
+  }
+  ci->prev = stack->ci;
+  stack->ci = ci;
+  return ci;
+}
+
+/**
+ * @brief Pop the innermost call info once its callee has returned
+ *
+ * @param stack the stack the call was running on
+ */
+static void vm_callinfo_pop(lstack_t *stack) {
+  lcallinfo_t *ci = stack->ci;
+  assert(ci != NULL);
+  stack->ci = ci->prev;
+  ci->prev = stack->ci_free;
+  stack->ci_free = ci;
+}
+
+/**
+ * @brief Pop all call infos of calls which were abandoned by an error
+ *
+ * @param stack the stack the calls were running on
+ * @param ci the innermost call info which is still live
+ */
+void vm_stack_unwind(lstack_t *stack, lcallinfo_t *ci) {
+  while (stack->ci != ci) {
+    vm_callinfo_pop(stack);
+  }
+}
+
+/**
+ * @brief Reallocate the slots of a stack, moving open upvalues along with it
+ *
+ * @param stack the stack to resize
+ * @param limit the new number of slots in the stack
+ */
+static void vm_stack_resize(lstack_t *stack, u32 limit) {
+  lupvalue_t *up;
+  stack->limit = limit;
+  stack->base = xrealloc(stack->base, limit * sizeof(luav));
+  for (up = stack->open; up != NULL; up = up->next) {
+    up->v = &stack->base[up->index];
+  }
+}
+
 /**
  * @brief Grow a stack by a given amount
  *
@@ -174,8 +347,11 @@ void vm_stack_destroy(lstack_t *stack) {
 void vm_stack_grow(lstack_t *stack, u32 amt) {
   stack->size += amt;
   if (stack->size >= stack->limit) {
-    stack->limit *= 2;
-    stack->base = xrealloc(stack->base, stack->limit * sizeof(luav));
+    u32 limit = stack->limit * 2;
+    while (stack->size >= limit) {
+      limit *= 2;
+    }
+    vm_stack_resize(stack, limit);
   }
   stack->top = stack->base + stack->size;
   lv_nilify(&stack->base[stack->size - amt], amt);
@@ -203,14 +379,37 @@ u32 vm_stack_alloc(lstack_t *stack, u32 amt) {
  * @param base the return value from a previous call to vm_stack_alloc()
  */
 void vm_stack_dealloc(lstack_t *stack, u32 base) {
+  assert(stack->open == NULL || stack->open->index < base);
   stack->size = base;
-  if (stack->size > VM_STACK_INIT && stack->size < stack->limit / 2) {
-    stack->limit /= 2;
-    stack->base = xrealloc(stack->base, stack->limit * sizeof(luav));
+  /* Only shrink once the stack is well below half of its limit, so that calls
+     and returns going back and forth across a boundary don't reallocate the
+     stack every time. Afterwards the stack can still double before growing
+     again. */
+  if (stack->limit > VM_STACK_INIT &&
+      stack->size < stack->limit / VM_STACK_SHRINK) {
+    vm_stack_resize(stack, stack->limit / 2);
   }
   stack->top = stack->base + stack->size;
 }
 
+/**
+ * @brief Close all open upvalues which point at or above a slot of a stack
+ *
+ * This needs to happen whenever locals go out of scope, at which point the
+ * closures which captured them keep the last value of the local.
+ *
+ * @param stack the stack whose upvalues should be closed
+ * @param base the lowest slot going out of scope
+ */
+void vm_stack_close(lstack_t *stack, u32 base) {
+  lupvalue_t *up;
+  while ((up = stack->open) != NULL && up->index >= base) {
+    up->value = *up->v;
+    up->v = &up->value;
+    stack->open = up->next;
+  }
+}
+
 /**
  * @brief Allocate a new closure from an existing one
  *
@@ -233,15 +432,32 @@ lclosure_t* lclosure_alloc(lclosure_t *parent, u32 idx) {
 }
 
 /**
- * @brief Allocate a new upvalue for the given luav
+ * @brief Find the open upvalue for a stack slot, creating it if necessary
+ *
+ * All closures capturing the same local variable share one upvalue, so the
+ * list of open upvalues is searched before a new one is created.
  *
- * @param val the luav to create an upvalue for
- * @return the luav representing the upvalue for the given value
+ * @param stack the stack containing the local variable
+ * @param index the stack slot of the local variable
+ * @return the luav representing the upvalue for the given slot
  */
-luav lupvalue_alloc(luav val) {
-  luav *ptr = gc_alloc(sizeof(luav), LUPVALUE);
-  *ptr = val;
-  return lv_upvalue(ptr);
+luav lupvalue_find(lstack_t *stack, u32 index) {
+  lupvalue_t **prev = &stack->open;
+  lupvalue_t *up;
+  assert(index < stack->size);
+  while ((up = *prev) != NULL && up->index >= index) {
+    if (up->index == index) {
+      return lv_upvalue(up);
+    }
+    prev = &up->next;
+  }
+  up = gc_alloc(sizeof(lupvalue_t), LUPVALUE);
+  up->v     = &stack->base[index];
+  up->value = LUAV_NIL;
+  up->index = index;
+  up->next  = *prev;
+  *prev = up;
+  return lv_upvalue(up);
 }
 
 /**
@@ -262,6 +478,29 @@ void vm_run(lfunc_t *func) {
   vm_fun(closure, 0, 0, 0, 0);
 }
 
+/**
+ * @brief Request a full compile of a function once it has run enough, or a
+ *        recompile of its code once that's due
+ *
+ * @param func the function about to be called
+ * @param argvi where its arguments are on the stack
+ */
+static void vm_full_compile(lfunc_t *func, u32 argvi) {
+  if (JIT_ASYNC) llvm_publish();
+  if (func->compilable && COMPILABLE(&func->instrs[0]) &&
+      func->jfunc== NULL && JIT_FULL_COMPILE) {
+    i32 ret = llvm_compile(func, 0, (u32) (func->num_instrs - 1),
+                           &vm_stack->base[argvi], TRUE);
+    if (ret < 0) {
+      func->instrs[0].count = INVAL_RUN_COUNT;
+    }
+  }
+  if (func->jfunc != NULL && JIT_RECOMPILE(func->jfunc)) {
+    llvm_compile(func, 0, (u32) (func->num_instrs - 1),
+                 &vm_stack->base[argvi], TRUE);
+  }
+}
+
 /**
  * @brief Run a function, dispatching based off the type of the function
  *
@@ -272,26 +511,31 @@ void vm_run(lfunc_t *func) {
 u32 vm_fun(lclosure_t *closure, LSTATE) {
   if (closure->type == LUAF_LUA) {
     lfunc_t *func = closure->function.lua;
-    if (func->compilable && COMPILABLE(&func->instrs[0]) &&
-        func->jfunc== NULL && JIT_FULL_COMPILE) {
-      i32 ret = llvm_compile(func, 0, (u32) (func->num_instrs - 1),
-                             &vm_stack->base[argvi], TRUE);
-      if (ret < 0) {
-        func->instrs[0].count = INVAL_RUN_COUNT;
-      }
-    }
+    vm_full_compile(func, argvi);
 
     // Call the fully compiled function if we can
-    if (func->jfunc != NULL && JIT_FULL_COMPILE && JIT_FULL_RUN) {
-      luav args[6] = {[0 ... 5] = LUAV_NIL};
-      memcpy(args, &vm_stack->base[argvi], argc * sizeof(luav));
+    if (func->jfunc != NULL && JIT_FULL_COMPILE && JIT_FULL_RUN &&
+        VM_CSTACK_ROOM(__builtin_frame_address(0))) {
+      luav args[JIT_FULL_ARGS] = {[0 ... JIT_FULL_ARGS - 1] = LUAV_NIL};
+      memcpy(args, &vm_stack->base[argvi],
+             MIN(argc, JIT_FULL_ARGS) * sizeof(luav));
+      u32 jargs[JARGS] = {
+        [JSTACKI] = 0,
+        [JARGC]   = argc,
+        [JARGVI]  = argvi,
+        [JRETC]   = retc,
+        [JRETVI]  = retvi
+      };
       luav (*f)() = func->jfunc->binary;
-      luav ret = f(closure, args[0], args[1], args[2],
-                            args[3], args[4], args[5]);
-      if (retc >= 1) {
+      int old_jit_bailed = jit_bailed;
+      jit_bailed = 0;
+      luav ret = f(closure, jargs, args[0], args[1], args[2], args[3]);
+      jit_bailed = old_jit_bailed;
+      /* The rest of the values returned are already on the stack */
+      if (jargs[JRETC] >= 1) {
         vm_stack->base[retvi] = ret;
       }
-      return 1;
+      return jargs[JRETC];
     }
   }
 
@@ -313,9 +557,12 @@ u32 vm_fun(lclosure_t *closure, LSTATE) {
 }
 
 u32 vm_funi(lclosure_t *closure, u32 stack, u32 init, u32 pc, LSTATE) {
-  u32 i, a, b, c, limit;
+  u32 i, a, b, c, limit, got;
   luav temp;
   lfunc_t *func;
+  /* Number of lua calls made without leaving this loop which are still
+     running, see OP_CALL */
+  u32 depth = 0;
   /* TAILCALL works by packing all of the arguments into the current stack
      frame, and then growing the stack for the next call frame. This means
      that the stack to deallocate to can change, so keep a copy of the absolute
@@ -324,7 +571,9 @@ u32 vm_funi(lclosure_t *closure, u32 stack, u32 init, u32 pc, LSTATE) {
   if (pc != 0) {
     assert(closure->type == LUAF_LUA);
     assert(running_jfunc != NULL);
-    if (running_jfunc == closure->function.lua->jfunc) {
+    /* Side exits are counted and recompiled away, only an error means the
+       compiled code can't be trusted anymore */
+    if (jit_bailed && running_jfunc == closure->function.lua->jfunc) {
       closure->function.lua->jfunc = NULL;
     }
   }
@@ -341,7 +590,7 @@ top:
       if (stack != stack_orig) {
         vm_stack_dealloc(vm_stack, stack_orig);
       }
-      return ret;
+      VM_RETURN(ret);
     }
 
     assert(closure->env != NULL);
@@ -359,32 +608,63 @@ top:
     }
     memcpy(&STACK(0), &vm_stack->base[argvi], sizeof(luav) * argc);
     assert(&STACK(argc) <= vm_stack->top);
-    lv_nilify(&STACK(argc), vm_stack->size - argc - stack);
+    /* The rest of the frame was just allocated by vm_stack_alloc(), which
+       already filled it with nils */
   }
   instr_t *instrs = &func->instrs[pc];
+  instr_t *cur;
+  u32 code;
   vm_running->pc = &instrs;
   assert((((size_t) instrs) & 3) == 0);
-  /* Core VM loop, also really slow VM loop... */
-  while (1) {
-    assert(instrs < func->instrs + func->num_instrs);
+#if VM_COMPUTED_GOTO
+  static void *const vm_labels[64] = {
+    &&L_OP_MOVE,     &&L_OP_LOADK,     &&L_OP_LOADBOOL,  &&L_OP_LOADNIL,
+    &&L_OP_GETUPVAL, &&L_OP_GETGLOBAL, &&L_OP_GETTABLE,  &&L_OP_SETGLOBAL,
+    &&L_OP_SETUPVAL, &&L_OP_SETTABLE,  &&L_OP_NEWTABLE,  &&L_OP_SELF,
+    &&L_OP_ADD,      &&L_OP_SUB,       &&L_OP_MUL,       &&L_OP_DIV,
+    &&L_OP_MOD,      &&L_OP_POW,       &&L_OP_UNM,       &&L_OP_NOT,
+    &&L_OP_LEN,      &&L_OP_CONCAT,    &&L_OP_JMP,       &&L_OP_EQ,
+    &&L_OP_LT,       &&L_OP_LE,        &&L_OP_TEST,      &&L_OP_TESTSET,
+    &&L_OP_CALL,     &&L_OP_TAILCALL,  &&L_OP_RETURN,    &&L_OP_FORLOOP,
+    &&L_OP_FORPREP,  &&L_OP_TFORLOOP,  &&L_OP_SETLIST,   &&L_OP_CLOSE,
+    &&L_OP_CLOSURE,  &&L_OP_VARARG,
+    &&L_OP_ADD_NUM_NUM,        &&L_OP_ADD_NUM_K,
+    &&L_OP_SUB_NUM_NUM,        &&L_OP_SUB_NUM_K,
+    &&L_OP_MUL_NUM_NUM,        &&L_OP_MUL_NUM_K,
+    &&L_OP_DIV_NUM_NUM,        &&L_OP_DIV_NUM_K,
+    &&L_OP_MOD_NUM_NUM,        &&L_OP_MOD_NUM_K,
+    &&L_OP_LT_NUM_NUM,         &&L_OP_LT_NUM_K,    &&L_OP_LT_K_NUM,
+    &&L_OP_LE_NUM_NUM,         &&L_OP_LE_NUM_K,    &&L_OP_LE_K_NUM,
+    &&L_OP_GETTABLE_ARRAY_INT, &&L_OP_GETTABLE_STRKEY,
+    &&L_OP_SETTABLE_ARRAY_INT, &&L_OP_FORLOOP_NUM,
+    [NUM_OPCODES ... 63] = &&L_DEFAULT
+  };
+#endif
+
+  /* Compiled code only ever starts at the top of the function or at the top
+     of a loop, so the JIT is only consulted on entry and on backward jumps */
+jit_check:
+  if (JIT_ON) {
     pc = (u32) (instrs - func->instrs);
+    if (JIT_ASYNC) llvm_publish();
 
     // check if we should compile
-    if (JIT_ON && (pc == 0 || func->preds[pc] != -1) && COMPILABLE(instrs) &&
-        instrs->jfunc == NULL) {
+    if ((pc == 0 || func->preds[pc] != -1) &&
+        ((instrs->jfunc == NULL && COMPILABLE(instrs)) ||
+         (instrs->jfunc != NULL && JIT_RECOMPILE(instrs->jfunc)))) {
       i32 end_index = func->preds[pc];
       if (end_index < 0) {
         end_index = (i32) func->num_instrs - 1;
       }
       i32 success = llvm_compile(func, pc, (u32) end_index,
                                  &STACK(0), FALSE);
-      if (success < 0) {
+      if (success < 0 && instrs->jfunc == NULL) {
         instrs->count = INVAL_RUN_COUNT;
       }
     }
 
     // check if there's a compiled version available
-    if (JIT_ON && instrs->jfunc != NULL) {
+    if (instrs->jfunc != NULL) {
       u32 stack_stuff[JARGS] = {
         [JSTACKI] = stack,
         [JARGC]   = argc,
@@ -403,10 +683,12 @@ top:
         // the function returned
         u32 rcount = (u32) (-ret - 2);
         vm_running = vm_running->caller; // reset the currently running frame
+        vm_stack_close(vm_stack, stack_orig);
         /* make sure we don't deallocate past the arguments returned */
         vm_stack_dealloc(vm_stack, MAX(retvi + rcount, stack_orig));
-        return rcount;
+        VM_RETURN(rcount);
       } else if (ret == -1) {
+        vm_stack_close(vm_stack, stack);
         closure = lv_getfunction(STACK(stack_stuff[JARGVI]), 0);
         argvi = STACKI(stack_stuff[JARGVI]) + 1;
         argc  = stack_stuff[JARGC];
@@ -424,522 +706,733 @@ top:
       }
       // the function ended, but it's still in this lfunc
       instrs = &func->instrs[ret];
-      if ((u32) ret != pc)
-        continue;
+      if ((u32) ret != pc) {
+        goto jit_check;
+      }
+    }
+  }
+  VM_NEXT;
+
+#if !VM_COMPUTED_GOTO
+  u8 opc;
+dispatch:
+  VM_FETCH();
+  opc = cur->op;
+redispatch:
+  switch (opc)
+#endif
+  {
+    /* R[A] = GLOBALS[CONST[BX]] */
+    VM_CASE(OP_GETGLOBAL): {
+      luav key = CONST(BX(code));
+      assert(lv_isstring(key));
+      luav val = icache_get(&func->icache[PC], closure->env, key);
+      SETTRACETABLE(closure->env, val);
+      SETREG(A(code), val);
+      SETTRACE(0, val);
+      VM_NEXT;
     }
 
-    u32 code = (instrs++)->instr;
-
-#ifndef NDEBUG
-    if (flags.print) {
-      printf("[%d] ", func->lines[pc]);
-      opcode_dump(stdout, code);
-      printf("\n");
+    /* GLOBALS[CONST[BX]] = R[A] */
+    VM_CASE(OP_SETGLOBAL): {
+      luav key = CONST(BX(code));
+      luav value = REG(A(code));
+      meta_lhash_set(lv_table(closure->env), key, value);
+      gc_check();
+      VM_NEXT;
     }
-#endif
 
-    /* Dispatch based on what we're supposed to be doing */
-    switch (OP(code)) {
-      /* R[A] = GLOBALS[CONST[BX]] */
-      case OP_GETGLOBAL: {
-        luav key = CONST(BX(code));
-        assert(lv_isstring(key));
-        luav val = meta_lhash_get(lv_table(closure->env), key);
-        SETTRACETABLE(closure->env, val);
-        SETREG(A(code), val);
-        SETTRACE(0, val);
-        break;
+    /* R[A] = R[B][R[C]] */
+    VM_CASE(OP_GETTABLE): {
+      luav table = REG(B(code));
+      luav key = KREG(C(code));
+      luav val;
+      if (lv_istable(table)) {
+        lhash_t *hash = lv_getptr(table);
+        if (C(code) >= 256 && lv_isstring(key)) {
+          val = icache_get(&func->icache[PC], hash, key);
+          VM_QUICKEN(OP_GETTABLE_STRKEY);
+        } else {
+          val = meta_lhash_get(table, key);
+          if (lv_isnumber(key) && ARRAY_INDEX(hash, lv_cvt(key)) > 0) {
+            VM_QUICKEN(OP_GETTABLE_ARRAY_INT);
+          }
+        }
+        SETTRACETABLE(hash, val);
+      } else {
+        val = meta_lhash_get(table, key);
       }
+      SETREG(A(code), val);
+      SETTRACE(0, val);
+      VM_NEXT;
+    }
 
-      /* GLOBALS[CONST[BX]] = R[A] */
-      case OP_SETGLOBAL: {
-        luav key = CONST(BX(code));
-        luav value = REG(A(code));
-        meta_lhash_set(lv_table(closure->env), key, value);
-        gc_check();
-        break;
-      }
+    /* R[A] = R[B][R[C]], R[B] a table and R[C] in its array part */
+    VM_CASE(OP_GETTABLE_ARRAY_INT): {
+      luav table = REG(B(code));
+      luav key = KREG(C(code));
+      if (!lv_istable(table) || !lv_isnumber(key)) VM_DEOPT();
+      lhash_t *hash = lv_getptr(table);
+      i32 index = ARRAY_INDEX(hash, lv_cvt(key));
+      if (index <= 0) VM_DEOPT();
+      luav val = hash->array[index];
+      if (val == LUAV_NIL && hash->metatable != NULL)
+        val = meta_lhash_get(table, key);
+      SETTRACETABLE(hash, val);
+      SETREG(A(code), val);
+      SETTRACE(0, val);
+      VM_NEXT;
+    }
+
+    /* R[A] = R[B][CONST[C]], R[B] a table and CONST[C] a string */
+    VM_CASE(OP_GETTABLE_STRKEY): {
+      luav table = REG(B(code));
+      if (!lv_istable(table)) VM_DEOPT();
+      lhash_t *hash = lv_getptr(table);
+      luav val = icache_get(&func->icache[PC], hash, CONST(C(code) - 256));
+      SETTRACETABLE(hash, val);
+      SETREG(A(code), val);
+      SETTRACE(0, val);
+      VM_NEXT;
+    }
 
-      /* R[A] = R[B][R[C]] */
-      case OP_GETTABLE: {
-        luav table = REG(B(code));
-        luav key = KREG(C(code));
-        luav val = meta_lhash_get(table, key);
-        if (lv_istable(table))
-          SETTRACETABLE((lhash_t*) lv_getptr(table), val);
-        SETREG(A(code), val);
-        SETTRACE(0, val);
-        break;
+    /* R[A][R[B]] = R[C] */
+    VM_CASE(OP_SETTABLE): {
+      luav table = REG(A(code));
+      luav key = KREG(B(code));
+      luav value = KREG(C(code));
+      meta_lhash_set(table, key, value);
+      if (lv_istable(table) && lv_isnumber(key) &&
+          ARRAY_INDEX((lhash_t*) lv_getptr(table), lv_cvt(key)) > 0) {
+        VM_QUICKEN(OP_SETTABLE_ARRAY_INT);
       }
+      gc_check();
+      VM_NEXT;
+    }
 
-      /* R[A][R[B]] = R[C] */
-      case OP_SETTABLE: {
-        luav table = REG(A(code));
-        luav key = KREG(B(code));
-        luav value = KREG(C(code));
+    /* R[A][R[B]] = R[C], R[A] a table and R[B] in its array part. Only
+       overwriting one non-nil value with another is done inline, as that's
+       the case that neither changes the table's size nor can hit __newindex */
+    VM_CASE(OP_SETTABLE_ARRAY_INT): {
+      luav table = REG(A(code));
+      luav key = KREG(B(code));
+      if (!lv_istable(table) || !lv_isnumber(key)) VM_DEOPT();
+      lhash_t *hash = lv_getptr(table);
+      i32 index = ARRAY_INDEX(hash, lv_cvt(key));
+      if (index <= 0) VM_DEOPT();
+      luav value = KREG(C(code));
+      if (hash->array[index] == LUAV_NIL || value == LUAV_NIL) {
         meta_lhash_set(table, key, value);
-        gc_check();
-        break;
+        VM_NEXT;
       }
+      hash->array[index] = value;
+      hash->version++;
+      VM_NEXT;
+    }
+
+    /* R[A] = UPVALUES[B], see OP_CLOSURE */
+    VM_CASE(OP_GETUPVAL):
+      temp = UPVALUE(closure, B(code));
+      luav val = *lv_getupvalue(temp)->v;
+      SETREG(A(code), val);
+      SETTRACE(0, val);
+      VM_NEXT;
+
+    /* UPVALUES[B] = R[A], see OP_CLOSURE */
+    VM_CASE(OP_SETUPVAL):
+      temp = UPVALUE(closure, B(code));
+      *lv_getupvalue(temp)->v = REG(A(code));
+      VM_NEXT;
+
+    /* R[A] = CONST[BX] */
+    VM_CASE(OP_LOADK): {
+      luav val = CONST(BX(code));
+      SETREG(A(code), val);
+      VM_NEXT;
+    }
 
-      /* R[A] = UPVALUES[B], see OP_CLOSURE */
-      case OP_GETUPVAL:
-        temp = UPVALUE(closure, B(code));
-        luav val = *lv_getupvalue(temp);
-        SETREG(A(code), val);
-        SETTRACE(0, val);
-        break;
-
-      /* UPVALUES[B] = R[A], see OP_CLOSURE */
-      case OP_SETUPVAL:
-        temp = UPVALUE(closure, B(code));
-        *lv_getupvalue(temp) = REG(A(code));
-        break;
-
-      /* R[A] = CONST[BX] */
-      case OP_LOADK: {
-        luav val = CONST(BX(code));
-        SETREG(A(code), val);
-        break;
+    /* R[A..B] = nil */
+    VM_CASE(OP_LOADNIL):
+      for (i = A(code); i <= B(code); i++) {
+        SETREG(i, LUAV_NIL);
       }
+      VM_NEXT;
 
-      /* R[A..B] = nil */
-      case OP_LOADNIL:
-        for (i = A(code); i <= B(code); i++) {
-          SETREG(i, LUAV_NIL);
+    /* R[A] = R[B] */
+    VM_CASE(OP_MOVE): {
+      luav val = REG(B(code));
+      SETREG(A(code), val);
+      VM_NEXT;
+    }
+
+    /* Call a closure in a register, with a glob of parameters, receiving a
+       glob of return values */
+    VM_CASE(OP_CALL): {
+      a = A(code); b = B(code); c = C(code);
+      luav av = REG(a);
+      /* Trace which function we're calling */
+      func->trace.misc[PC].closure = lv_isfunction(av) ?
+                                     lv_getfunction(av, 0) : NULL;
+      /* If we don't know how many arguments we're giving, then it's the last
+         number of arguments received from some previous instruction */
+      u32 num_args = b == 0 ? closure->last_ret - a - 1 : b - 1;
+      /* If we don't know how many return values we want, just say we want
+         everything ever, our stack will be grown for us by whomever is
+         returning value to us */
+      u32 want_ret = c == 0 ? UINT_MAX : c - 1;
+      lhash_t *meta = getmetatable(av);
+
+      /* Dispatch metatable __call if we can, otherwise run lua functions in
+         this same loop and recurse on vm_fun for everything else */
+      if (meta != NULL) {
+        got = meta_call(av, num_args, STACKI(a + 1),
+                            want_ret, STACKI(a));
+      } else {
+        lclosure_t *closure2 = lv_getfunction(REG(a), 0);
+        /* Only compiled code runs on the C stack, lua functions which are
+           still interpreted run in this loop however deep the calls go */
+        if (closure2->type == LUAF_LUA && JIT_FULL_COMPILE) {
+          vm_full_compile(closure2->function.lua, STACKI(a + 1));
+        }
+        if (closure2->type != LUAF_LUA ||
+            (JIT_FULL_RUN && closure2->function.lua->jfunc != NULL &&
+             VM_CSTACK_ROOM(__builtin_frame_address(0)))) {
+          got = vm_fun(closure2, num_args, STACKI(a + 1), want_ret,
+                       STACKI(a));
+          goto call_return;
         }
-        break;
+        /* Save our state for when the callee returns (see resume_caller),
+           and become the callee */
+        lcallinfo_t *ci = vm_callinfo_push(vm_stack);
+        ci->closure    = closure;
+        ci->instrs     = instrs;
+        ci->stack      = stack;
+        ci->stack_orig = stack_orig;
+        ci->argc       = argc;
+        ci->argvi      = argvi;
+        ci->retc       = retc;
+        ci->retvi      = retvi;
+        vm_running->pc = &ci->instrs;
+        ci->frame.caller = vm_running;
+        vm_running = &ci->frame;
+        depth++;
+
+        closure = closure2;
+        argc    = num_args;
+        argvi   = STACKI(a + 1);
+        retc    = want_ret;
+        retvi   = STACKI(a);
+        stack   = vm_stack_alloc(vm_stack, closure->function.lua->max_stack);
+        stack_orig = stack;
+        pc      = 0;
+        init    = 1;
+        goto top;
+      }
+    call_return:
+      /* If we didn't get all the return values we wanted, then we need to
+         make sure we set all extra values to nil */
+      for (i = got; i < c - 1 && &STACK(a + i) < vm_stack->top; i++) {
+        SETREG(a + i, LUAV_NIL);
+      }
+      func->trace.instrs[PC][0] = (u8) MIN(got, TRACEMAX);
+      for (i = a; i < a + got && i - a < TRACELIMIT - 1; i++) {
+        SETTRACE(i - a + 1, REG(i));
+      }
+      /* Save how many things we just got, in case the next instruction
+         doesn't know how many things it wants */
+      closure->last_ret = a + got;
+      VM_NEXT;
+    }
 
-      /* R[A] = R[B] */
-      case OP_MOVE: {
-        luav val = REG(B(code));
-        SETREG(A(code), val);
-        break;
+    /* Only exit point of the VM loop, returns a glob of parameters */
+    VM_CASE(OP_RETURN):
+      a = A(code);
+      b = B(code);
+      /* If we don't know what we're returning, then some previous instruction
+         received a glob of parameters and kept track of what it got */
+      limit = b == 0 ? closure->last_ret - a : b - 1;
+      /* the RETURN opcode implicitly performs a CLOSE operation */
+      vm_stack_close(vm_stack, stack_orig);
+      /* TODO: does this need to grow the stack? */
+      for (i = 0; i < limit && i < retc; i++) {
+        vm_stack->base[retvi + i] = REG(a + i);
+      }
+      /* reset the currently running frame */
+      vm_running = vm_running->caller;
+      /* make sure we don't deallocate past the arguments returned */
+      vm_stack_dealloc(vm_stack, MAX(retvi + i, stack_orig));
+      VM_RETURN(i);
+
+    /* Slightly optimized version of a CALL, but doesn't need any extra stack.
+       Implemented as a goto to the top of the VM loop, redoing all
+       intiaizliation.
+
+       Interesting part is preserving stacks. Arguments to the function need
+       to be on a separate portion of the stack than the running function's
+       stack frame, because it can call the VARARG instruction halfway in the
+       function to grab the arguments. To do this, all arguments to the
+       function are packed on the stack starting from stack_orig, and then
+       the new stack is allocated from the top of that stack. */
+    VM_CASE(OP_TAILCALL): {
+      a = A(code);
+      b = B(code);
+      assert(C(code) == 0);
+      /* Figure out how big our glob is and where it's located */
+      argc = (b == 0 ? closure->last_ret : a + b) - a - 1;
+      argvi = STACKI(a + 1);
+      luav av = REG(a);
+      lhash_t *meta = getmetatable(av);
+      /* Our frame is about to be overwritten by the arguments */
+      vm_stack_close(vm_stack, stack);
+      /* As with CALL, dispatch the __call metamethod */
+      if (meta != NULL) {
+        /* TODO: bad error message? */
+        closure = lv_getfunction(lhash_get(meta, META_CALL), 0);
+        /* metamethod __call requires one extra argument, the table itself */
+        vm_stack_grow(vm_stack, 1);
+        memmove(&vm_stack->base[stack_orig + 1], &vm_stack->base[argvi],
+                argc * sizeof(luav));
+        vm_stack->base[stack_orig] = av;
+        argc++;
+      } else {
+        closure = lv_getfunction(av, 0);
+        memmove(&vm_stack->base[stack_orig], &vm_stack->base[argvi],
+                argc * sizeof(luav));
       }
+      argvi = stack_orig;
+      /* Bring the stack down to the top of our args */
+      vm_stack_dealloc(vm_stack, argvi + argc);
 
-      /* Call a closure in a register, with a glob of parameters, receiving a
-         glob of return values */
-      case OP_CALL: {
-        a = A(code); b = B(code); c = C(code);
-        luav av = REG(a);
-        /* Trace which function we're calling */
-        func->trace.misc[pc].closure = lv_isfunction(av) ?
-                                       lv_getfunction(av, 0) : NULL;
-        /* If we don't know how many arguments we're giving, then it's the last
-           number of arguments received from some previous instruction */
-        u32 num_args = b == 0 ? closure->last_ret - a - 1 : b - 1;
-        /* If we don't know how many return values we want, just say we want
-           everything ever, our stack will be grown for us by whomever is
-           returning value to us */
-        u32 want_ret = c == 0 ? UINT_MAX : c - 1;
-        u32 got;
-        lhash_t *meta = getmetatable(av);
-
-        /* Dispatch metatable __call if we can, otherwise recurse on vm_fun */
-        if (meta != NULL) {
-          got = meta_call(av, num_args, STACKI(a + 1),
-                              want_ret, STACKI(a));
-        } else {
-          lclosure_t *closure2 = lv_getfunction(REG(a), 0);
-          got = vm_fun(closure2, num_args, STACKI(a + 1), want_ret, STACKI(a));
-        }
-        /* If we didn't get all the return values we wanted, then we need to
-           make sure we set all extra values to nil */
-        for (i = got; i < c - 1 && &STACK(a + i) < vm_stack->top; i++) {
-          SETREG(a + i, LUAV_NIL);
-        }
-        func->trace.instrs[pc][0] = (u8) MIN(got, TRACEMAX);
-        for (i = a; i < a + got && i - a < TRACELIMIT - 1; i++) {
-          SETTRACE(i - a + 1, REG(i));
-        }
-        /* Save how many things we just got, in case the next instruction
-           doesn't know how many things it wants */
-        closure->last_ret = a + got;
-        break;
+      /* reallocate stack for lua functions */
+      if (closure->type == LUAF_LUA) {
+        stack = vm_stack_alloc(vm_stack, closure->function.lua->max_stack);
       }
+      pc = 0;
+      init = 1;
+      goto top;
+    }
 
-      /* Only exit point of the VM loop, returns a glob of parameters */
-      case OP_RETURN:
-        func->instrs[pc].count++;
-        a = A(code);
-        b = B(code);
-        /* If we don't know what we're returning, then some previous instruction
-           received a glob of parameters and kept track of what it got */
-        limit = b == 0 ? closure->last_ret - a : b - 1;
-        /* the RETURN opcode implicitly performs a CLOSE operation */
-        op_close(vm_stack->size - stack, vm_stack->base + stack);
-        /* TODO: does this need to grow the stack? */
-        for (i = 0; i < limit && i < retc; i++) {
-          vm_stack->base[retvi + i] = REG(a + i);
-        }
-        /* reset the currently running frame */
-        vm_running = vm_running->caller;
-        /* make sure we don't deallocate past the arguments returned */
-        vm_stack_dealloc(vm_stack, MAX(retvi + i, stack_orig));
-        return i;
-
-      /* Slightly optimized version of a CALL, but doesn't need any extra stack.
-         Implemented as a goto to the top of the VM loop, redoing all
-         intiaizliation.
-
-         Interesting part is preserving stacks. Arguments to the function need
-         to be on a separate portion of the stack than the running function's
-         stack frame, because it can call the VARARG instruction halfway in the
-         function to grab the arguments. To do this, all arguments to the
-         function are packed on the stack starting from stack_orig, and then
-         the new stack is allocated from the top of that stack. */
-      case OP_TAILCALL: {
-        func->instrs[pc].count++;
-        a = A(code);
-        b = B(code);
-        assert(C(code) == 0);
-        /* Figure out how big our glob is and where it's located */
-        argc = (b == 0 ? closure->last_ret : a + b) - a - 1;
-        argvi = STACKI(a + 1);
-        luav av = REG(a);
-        lhash_t *meta = getmetatable(av);
-        /* As with CALL, dispatch the __call metamethod */
-        if (meta != NULL) {
-          /* TODO: bad error message? */
-          closure = lv_getfunction(lhash_get(meta, META_CALL), 0);
-          /* metamethod __call requires one extra argument, the table itself */
-          vm_stack_grow(vm_stack, 1);
-          memmove(&vm_stack->base[stack_orig + 1], &vm_stack->base[argvi],
-                  argc * sizeof(luav));
-          vm_stack->base[stack_orig] = av;
-          argc++;
+    /* Create a lua function type, so it can be called. Possibly creates
+       upvalues for the function, which are variables that are defined outside
+       the scope of the function, but used inside the function.
+
+       Upvalues are implemented as a special type of luav that is a pointer
+       to an lupvalue_t. These values are never exposed in lua, because they're
+       only stored in the upvalues array of closures. While the function which
+       created the closure is still running, the upvalue points directly at
+       the stack slot of the captured local so both the function and the
+       closure see each other's updates. The upvalue is closed by a CLOSE or
+       RETURN instruction once the local goes out of scope. */
+    VM_CASE(OP_CLOSURE): {
+      lclosure_t *closure2 = lclosure_alloc(closure, BX(code));
+
+      for (i = 0; i < closure2->function.lua->num_upvalues; i++) {
+        u32 pseudo = (instrs++)->instr;
+        luav upvalue;
+        if (OP(pseudo) == OP_MOVE) {
+          upvalue = lupvalue_find(vm_stack, STACKI(B(pseudo)));
         } else {
-          closure = lv_getfunction(av, 0);
-          memmove(&vm_stack->base[stack_orig], &vm_stack->base[argvi],
-                  argc * sizeof(luav));
+          upvalue = UPVALUE(closure, B(pseudo));
         }
-        argvi = stack_orig;
-        /* Bring the stack down to the top of our args */
-        vm_stack_dealloc(vm_stack, argvi + argc);
 
-        /* reallocate stack for lua functions */
-        if (closure->type == LUAF_LUA) {
-          stack = vm_stack_alloc(vm_stack, closure->function.lua->max_stack);
-        }
-        pc = 0;
-        init = 1;
-        goto top;
+        /* The allocated closure needs a reference to the upvalue */
+        closure2->upvalues[i] = upvalue;
       }
+      SETREG(A(code), lv_function(closure2));
+      gc_check();
+      VM_NEXT;
+    }
 
-      /* Create a lua function type, so it can be called. Possibly creates
-         upvalues for the function, which are variables that are defined outside
-         the scope of the function, but used inside the function.
-
-         Upvalues are implemented as a special type of luav that is a pointer
-         to another luav. These values are never exposed in lua, because they're
-         normally only stored in the upvalues array of closures. The only
-         difference is the fact that future references to the upvalue created
-         in the function that created the closure must update the upvalue, or
-         use the value that had been altered by a closure.
-
-         Hence, the values on the stack that are converted to upvalues are
-         replaced on the stack as an upvalue.*/
-      case OP_CLOSURE: {
-        lclosure_t *closure2 = lclosure_alloc(closure, BX(code));
-
-        for (i = 0; i < closure2->function.lua->num_upvalues; i++) {
-          u32 pseudo = (instrs++)->instr;
-          luav upvalue;
-          if (OP(pseudo) == OP_MOVE) {
-            /* Can't use the REG macro because we don't want to duplicate
-               upvalues. If the register on the stack is an upvalue, we want to
-               use the same upvalue... */
-            assert(&STACK(B(pseudo)) < vm_stack->top);
-            temp = STACK(B(pseudo));
-            if (lv_isupvalue(temp)) {
-              upvalue = temp;
-            } else {
-              /* If the stack register is not an upvalue, we need to promote it
-                 to an upvalue, thereby scribbling over our stack variable so
-                 it's now considered an upvalue */
-              upvalue = lupvalue_alloc(temp);
-              STACK(B(pseudo)) = upvalue;
-            }
-          } else {
-            upvalue = UPVALUE(closure, B(pseudo));
-          }
+    VM_CASE(OP_CLOSE):
+      vm_stack_close(vm_stack, STACKI(A(code)));
+      VM_NEXT;
 
-          /* The allocated closure needs a reference to the upvalue */
-          closure2->upvalues[i] = upvalue;
-        }
-        SETREG(A(code), lv_function(closure2));
-        gc_check();
-        break;
+    VM_CASE(OP_JMP):
+      instrs += SBX(code);
+      if (SBX(code) < 0) {
+        VM_LOOP;
       }
+      VM_NEXT;
+
+    VM_CASE(OP_EQ): {
+      luav res;
+      luav bv = KREG(B(code));
+      luav cv = KREG(C(code));
+      u32 eq = (u32) ((bv != LUAV_NAN) && lv_rawequal(bv, cv));
+      if (!eq && meta_eq(bv, cv, META_EQ, &res))
+        eq = lv_getbool(res, 0);
+      if (eq != A(code))
+        instrs++;
+      VM_NEXT;
+    }
 
-      case OP_CLOSE:
-        a = A(code);
-        op_close(vm_stack->size - stack - a, &STACK(a));
-        break;
-
-      case OP_JMP:
-        instrs += SBX(code);
-        break;
-
-      case OP_EQ: {
-        luav res;
-        luav bv = KREG(B(code));
-        luav cv = KREG(C(code));
-        u32 eq = (u32) ((bv != LUAV_NAN) && (bv == cv));
-        if (!eq && meta_eq(bv, cv, META_EQ, &res))
-          eq = lv_getbool(res, 0);
-        if (eq != A(code))
-          instrs++;
-        break;
+    #define BINOP_LT(a,b)  ((a) <  (b))
+    #define BINOP_LE(a,b)  ((a) <= (b))
+    #define META_COMPARE(op, idx, qnn, qnk, qkn) {                    \
+      u32 lt; luav res;                                               \
+      luav bv = KREG(B(code)); luav cv = KREG(C(code));               \
+      if (lv_isnumber(bv) && lv_isnumber(cv)) {                       \
+        lt = (u8) op(lv_cvt(bv), lv_cvt(cv));                         \
+        if (B(code) < 256) {                                          \
+          VM_QUICKEN(C(code) < 256 ? (qnn) : (qnk));                  \
+        } else if (C(code) < 256) {                                   \
+          VM_QUICKEN(qkn);                                            \
+        }                                                             \
+      } else if (lv_sametyp(bv, cv) && lv_isstring(bv)) {             \
+        lt = (u8) op(lv_compare(bv, cv), 0);                          \
+      } else if (meta_eq(bv, cv, idx, &res)) {                        \
+        lt = lv_getbool(res, 0);                                      \
+      } else if (idx == META_LE && meta_eq(cv, bv, META_LT, &res)) {  \
+        lt = (u8) !lv_getbool(res, 0);                                \
+      } else {                                                        \
+        lt = (u8) op(lv_compare(bv, cv), 0);                          \
+      }                                                               \
+      if (lt != A(code)) {                                            \
+        instrs++;                                                     \
+      }                                                               \
+    }
+    VM_CASE(OP_LT):
+      META_COMPARE(BINOP_LT, META_LT,
+                   OP_LT_NUM_NUM, OP_LT_NUM_K, OP_LT_K_NUM);
+      VM_NEXT;
+    VM_CASE(OP_LE):
+      META_COMPARE(BINOP_LE, META_LE,
+                   OP_LE_NUM_NUM, OP_LE_NUM_K, OP_LE_K_NUM);
+      VM_NEXT;
+
+    /* Comparisons of two numbers, B and C are registers or constants as the
+       suffix of the opcode says */
+    #define COMPARE_NUM(op, bv, cv) {                                 \
+      luav _bv = (bv); luav _cv = (cv);                               \
+      if (!lv_isnumber(_bv) || !lv_isnumber(_cv)) VM_DEOPT();         \
+      if ((u32) op(lv_cvt(_bv), lv_cvt(_cv)) != A(code)) {            \
+        instrs++;                                                     \
+      }                                                               \
+    }
+    VM_CASE(OP_LT_NUM_NUM):
+      COMPARE_NUM(BINOP_LT, REG(B(code)), REG(C(code)));
+      VM_NEXT;
+    VM_CASE(OP_LT_NUM_K):
+      COMPARE_NUM(BINOP_LT, REG(B(code)), CONST(C(code) - 256));
+      VM_NEXT;
+    VM_CASE(OP_LT_K_NUM):
+      COMPARE_NUM(BINOP_LT, CONST(B(code) - 256), REG(C(code)));
+      VM_NEXT;
+    VM_CASE(OP_LE_NUM_NUM):
+      COMPARE_NUM(BINOP_LE, REG(B(code)), REG(C(code)));
+      VM_NEXT;
+    VM_CASE(OP_LE_NUM_K):
+      COMPARE_NUM(BINOP_LE, REG(B(code)), CONST(C(code) - 256));
+      VM_NEXT;
+    VM_CASE(OP_LE_K_NUM):
+      COMPARE_NUM(BINOP_LE, CONST(B(code) - 256), REG(C(code)));
+      VM_NEXT;
+
+    VM_CASE(OP_TEST):
+      temp = REG(A(code));
+      if (lv_getbool(temp, 0) != C(code)) {
+        instrs++;
       }
+      VM_NEXT;
 
-      #define BINOP_LT(a,b)  ((a) <  (b))
-      #define BINOP_LE(a,b)  ((a) <= (b))
-      #define META_COMPARE(op, idx) {                                   \
-        u32 lt; luav res;                                               \
-        luav bv = KREG(B(code)); luav cv = KREG(C(code));               \
-        if (lv_sametyp(bv, cv) &&                                       \
-            (lv_isnumber(bv) || lv_isstring(bv))) {                     \
-          lt = (u8) op(lv_compare(bv, cv), 0);                          \
-        } else if (meta_eq(bv, cv, idx, &res)) {                        \
-          lt = lv_getbool(res, 0);                                      \
-        } else if (idx == META_LE && meta_eq(cv, bv, META_LT, &res)) {  \
-          lt = (u8) !lv_getbool(res, 0);                                \
-        } else {                                                        \
-          lt = (u8) op(lv_compare(bv, cv), 0);                          \
-        }                                                               \
-        if (lt != A(code)) {                                            \
-          instrs++;                                                     \
-        }                                                               \
+    VM_CASE(OP_TESTSET):
+      temp = REG(B(code));
+      if (lv_getbool(temp, 0) == C(code)) {
+        SETREG(A(code), temp);
+      } else {
+        instrs++;
+      }
+      SETTRACE(0, REG(A(code)));
+      VM_NEXT;
+
+    VM_CASE(OP_LOADBOOL):
+      SETREG(A(code), lv_bool((u8) B(code)));
+      if (C(code))
+        instrs++;
+      VM_NEXT;
+
+    #define BINOP_ADD(a,b) ((a)+(b))
+    #define BINOP_SUB(a,b) ((a)-(b))
+    #define BINOP_MUL(a,b) ((a)*(b))
+    #define BINOP_DIV(a,b) ((a)/(b))
+    #define BINOP_MOD(a,b) ((a) - floor((a)/(b))*(b))
+    #define BINOP_POW(a,b) (pow((a), (b)))
+    #define META_ARITH_BINARY(op, idx, qnn, qnk) {                   \
+      a = A(code);                                                   \
+      luav bv = KREG(B(code));                                       \
+      luav cv = KREG(C(code));                                       \
+      if (lv_isnumber(bv) && lv_isnumber(cv)) {                      \
+        SETREG(a, lv_number(op(lv_cvt(bv), lv_cvt(cv))));            \
+        if (B(code) < 256) {                                         \
+          VM_QUICKEN(C(code) < 256 ? (qnn) : (qnk));                 \
+        }                                                            \
+        VM_NEXT;                                                     \
+      }                                                              \
+      if (meta_binary(bv, idx, bv, cv, STACKI(a)) ||                 \
+          meta_binary(cv, idx, bv, cv, STACKI(a)))                   \
+        VM_NEXT;                                                     \
+      double bd = lv_castnumber(bv, 0);                              \
+      double cd = lv_castnumber(cv, 1);                              \
+      SETREG(a, lv_number(op(bd, cd)));                              \
+    }
+    VM_CASE(OP_ADD):
+      META_ARITH_BINARY(BINOP_ADD, META_ADD, OP_ADD_NUM_NUM, OP_ADD_NUM_K);
+      VM_NEXT;
+    VM_CASE(OP_SUB):
+      META_ARITH_BINARY(BINOP_SUB, META_SUB, OP_SUB_NUM_NUM, OP_SUB_NUM_K);
+      VM_NEXT;
+    VM_CASE(OP_MUL):
+      META_ARITH_BINARY(BINOP_MUL, META_MUL, OP_MUL_NUM_NUM, OP_MUL_NUM_K);
+      VM_NEXT;
+    VM_CASE(OP_DIV):
+      META_ARITH_BINARY(BINOP_DIV, META_DIV, OP_DIV_NUM_NUM, OP_DIV_NUM_K);
+      VM_NEXT;
+    VM_CASE(OP_MOD):
+      META_ARITH_BINARY(BINOP_MOD, META_MOD, OP_MOD_NUM_NUM, OP_MOD_NUM_K);
+      VM_NEXT;
+    /* pow() dominates, so there's nothing to gain from specializing */
+    VM_CASE(OP_POW):
+      META_ARITH_BINARY(BINOP_POW, META_POW, OP_POW, OP_POW);
+      VM_NEXT;
+
+    /* Arithmetic on a number register and either another number register
+       (NUM_NUM) or a number constant (NUM_K) */
+    #define ARITH_NUM(op, cv) {                                      \
+      luav bv = REG(B(code));                                        \
+      luav _cv = (cv);                                               \
+      if (!lv_isnumber(bv) || !lv_isnumber(_cv)) VM_DEOPT();         \
+      SETREG(A(code), lv_number(op(lv_cvt(bv), lv_cvt(_cv))));       \
+    }
+    VM_CASE(OP_ADD_NUM_NUM): ARITH_NUM(BINOP_ADD, REG(C(code))); VM_NEXT;
+    VM_CASE(OP_ADD_NUM_K): ARITH_NUM(BINOP_ADD, CONST(C(code) - 256)); VM_NEXT;
+    VM_CASE(OP_SUB_NUM_NUM): ARITH_NUM(BINOP_SUB, REG(C(code))); VM_NEXT;
+    VM_CASE(OP_SUB_NUM_K): ARITH_NUM(BINOP_SUB, CONST(C(code) - 256)); VM_NEXT;
+    VM_CASE(OP_MUL_NUM_NUM): ARITH_NUM(BINOP_MUL, REG(C(code))); VM_NEXT;
+    VM_CASE(OP_MUL_NUM_K): ARITH_NUM(BINOP_MUL, CONST(C(code) - 256)); VM_NEXT;
+    VM_CASE(OP_DIV_NUM_NUM): ARITH_NUM(BINOP_DIV, REG(C(code))); VM_NEXT;
+    VM_CASE(OP_DIV_NUM_K): ARITH_NUM(BINOP_DIV, CONST(C(code) - 256)); VM_NEXT;
+    VM_CASE(OP_MOD_NUM_NUM): ARITH_NUM(BINOP_MOD, REG(C(code))); VM_NEXT;
+    VM_CASE(OP_MOD_NUM_K): ARITH_NUM(BINOP_MOD, CONST(C(code) - 256)); VM_NEXT;
+
+    VM_CASE(OP_UNM): {
+      a = A(code);
+      luav bv = REG(B(code));
+      if (lv_isnumber(bv)) {
+        SETREG(a, lv_number(-lv_cvt(bv)));
+        VM_NEXT;
       }
-      case OP_LT: META_COMPARE(BINOP_LT, META_LT); break;
-      case OP_LE: META_COMPARE(BINOP_LE, META_LE); break;
+      if (meta_unary(bv, META_UNM, STACKI(a)))
+        VM_NEXT;
+      SETREG(a, lv_number(-lv_castnumber(bv, 0)));
+      VM_NEXT;
+    }
 
-      case OP_TEST:
-        temp = REG(A(code));
-        if (lv_getbool(temp, 0) != C(code)) {
-          instrs++;
-        }
-        break;
+    VM_CASE(OP_NOT): { // no metamethod for not
+      u8 bv = lv_getbool(REG(B(code)), 0);
+      SETREG(A(code), lv_bool(bv ^ 1));
+      VM_NEXT;
+    }
 
-      case OP_TESTSET:
-        temp = REG(B(code));
-        if (lv_getbool(temp, 0) == C(code)) {
-          SETREG(A(code), temp);
-        } else {
-          instrs++;
-        }
-        SETTRACE(0, REG(A(code)));
-        break;
-
-      case OP_LOADBOOL:
-        SETREG(A(code), lv_bool((u8) B(code)));
-        if (C(code))
-          instrs++;
-        break;
-
-      #define BINOP_ADD(a,b) ((a)+(b))
-      #define BINOP_SUB(a,b) ((a)-(b))
-      #define BINOP_MUL(a,b) ((a)*(b))
-      #define BINOP_DIV(a,b) ((a)/(b))
-      #define BINOP_MOD(a,b) ((a) - floor((a)/(b))*(b))
-      #define BINOP_POW(a,b) (pow((a), (b)))
-      #define META_ARITH_BINARY(op, idx) {                             \
-        a = A(code);                                                   \
-        luav bv = KREG(B(code));                                       \
-        luav cv = KREG(C(code));                                       \
-        if (lv_isnumber(bv) && lv_isnumber(cv)) {                      \
-          SETREG(a, lv_number(op(lv_cvt(bv), lv_cvt(cv))));            \
-          break;                                                       \
-        }                                                              \
-        if (meta_binary(bv, idx, bv, cv, STACKI(a)) ||                 \
-            meta_binary(cv, idx, bv, cv, STACKI(a)))                   \
-          break;                                                       \
-        double bd = lv_castnumber(bv, 0);                              \
-        double cd = lv_castnumber(cv, 1);                              \
-        SETREG(a, lv_number(op(bd, cd)));                              \
-      }
-      case OP_ADD: META_ARITH_BINARY(BINOP_ADD, META_ADD); break;
-      case OP_SUB: META_ARITH_BINARY(BINOP_SUB, META_SUB); break;
-      case OP_MUL: META_ARITH_BINARY(BINOP_MUL, META_MUL); break;
-      case OP_DIV: META_ARITH_BINARY(BINOP_DIV, META_DIV); break;
-      case OP_MOD: META_ARITH_BINARY(BINOP_MOD, META_MOD); break;
-      case OP_POW: META_ARITH_BINARY(BINOP_POW, META_POW); break;
-
-      case OP_UNM: {
-        a = A(code);
-        luav bv = REG(B(code));
-        if (lv_isnumber(bv)) {
-          SETREG(a, lv_number(-lv_cvt(bv)));
+    VM_CASE(OP_LEN): {
+      luav bv = REG(B(code));
+      switch (lv_gettype(bv)) {
+        case LSTRING: {
+          size_t len = lv_caststring(bv, 0)->length;
+          SETREG(A(code), lv_number((double) len));
           break;
         }
-        if (meta_unary(bv, META_UNM, STACKI(a)))
+        case LTABLE: {
+          u64 len = lv_gettable(bv, 0)->length;
+          SETREG(A(code), lv_number((double) len));
           break;
-        SETREG(a, lv_number(-lv_castnumber(bv, 0)));
-        break;
+        }
+        default:
+          panic("Invalid type for len\n");
       }
+      VM_NEXT;
+    }
 
-      case OP_NOT: { // no metamethod for not
-        u8 bv = lv_getbool(REG(B(code)), 0);
-        SETREG(A(code), lv_bool(bv ^ 1));
-        break;
-      }
+    VM_CASE(OP_NEWTABLE): {
+      lhash_t *ht = lhash_hint(B(code), C(code));
+      SETREG(A(code), lv_table(ht));
+      gc_check();
+      VM_NEXT;
+    }
 
-      case OP_LEN: {
-        luav bv = REG(B(code));
-        switch (lv_gettype(bv)) {
-          case LSTRING: {
-            size_t len = lv_caststring(bv, 0)->length;
-            SETREG(A(code), lv_number((double) len));
-            break;
-          }
-          case LTABLE: {
-            u64 len = lv_gettable(bv, 0)->length;
-            SETREG(A(code), lv_number((double) len));
-            break;
-          }
-          default:
-            panic("Invalid type for len\n");
-        }
-        break;
+    VM_CASE(OP_FORPREP):
+      a = A(code);
+      if (JIT_ON) {
+        /* Sticks at 0 once the loop has been entered with something which
+           isn't an i32, the trace starts out as LANY */
+        u8 *trace = func->trace.instrs[PC];
+        trace[0] = (u8) (trace[0] && IS_I32(REG(a)) && IS_I32(REG(a + 1)) &&
+                         IS_I32(REG(a + 2)));
       }
-
-      case OP_NEWTABLE: {
-        lhash_t *ht = lhash_hint(B(code), C(code));
-        SETREG(A(code), lv_table(ht));
-        gc_check();
-        break;
+      SETREG(a, lv_number(lv_castnumber(REG(a), 0) -
+                          lv_castnumber(REG(a + 2), 0)));
+      instrs += SBX(code);
+      VM_NEXT;
+
+    VM_CASE(OP_FORLOOP): {
+      a = A(code);
+      if (lv_isnumber(REG(a)) && lv_isnumber(REG(a + 1)) &&
+          lv_isnumber(REG(a + 2))) {
+        VM_QUICKEN(OP_FORLOOP_NUM);
       }
+      double d1 = lv_castnumber(REG(a), 0);
+      double d2 = lv_castnumber(REG(a + 1), 0);
+      double step = lv_castnumber(REG(a + 2), 0);
+      SETREG(a, lv_number(d1 + step));
+      d1 += step;
+      TRACE_FORDIR(step);
+      if ((step > 0 && d1 <= d2) || (step < 0 && d1 >= d2)) {
+        SETREG(a + 3, lv_number(d1));
+        instrs += SBX(code);
+        VM_LOOP;
+      }
+      VM_NEXT;
+    }
 
-      case OP_FORPREP:
-        a = A(code);
-        SETREG(a, lv_number(lv_castnumber(REG(a), 0) -
-                            lv_castnumber(REG(a + 2), 0)));
+    /* OP_FORLOOP with the index, limit and step all already numbers */
+    VM_CASE(OP_FORLOOP_NUM): {
+      a = A(code);
+      luav iv = REG(a), lv = REG(a + 1), sv = REG(a + 2);
+      if (!lv_isnumber(iv) || !lv_isnumber(lv) || !lv_isnumber(sv))
+        VM_DEOPT();
+      double step = lv_cvt(sv);
+      double d1 = lv_cvt(iv) + step;
+      double d2 = lv_cvt(lv);
+      SETREG(a, lv_number(d1));
+      TRACE_FORDIR(step);
+      if ((step > 0 && d1 <= d2) || (step < 0 && d1 >= d2)) {
+        SETREG(a + 3, lv_number(d1));
         instrs += SBX(code);
-        break;
-
-      case OP_FORLOOP: {
-        a = A(code);
-        double d1 = lv_castnumber(REG(a), 0);
-        double d2 = lv_castnumber(REG(a + 1), 0);
-        double step = lv_castnumber(REG(a + 2), 0);
-        SETREG(a, lv_number(d1 + step));
-        d1 += step;
-        if ((step > 0 && d1 <= d2) || (step < 0 && d1 >= d2)) {
-          SETREG(a + 3, lv_number(d1));
-          instrs += SBX(code);
-        }
-        func->trace.instrs[pc][0] = (step < 0);
-        break;
+        VM_LOOP;
       }
+      VM_NEXT;
+    }
 
-      case OP_CONCAT: {
-        b = B(code);
-        c = C(code);
-        luav value = REG(b);
+    VM_CASE(OP_CONCAT): {
+      b = B(code);
+      c = C(code);
+      luav value = meta_concatn(STACKI(b), c - b + 1);
 
-        for (i = b + 1; i <= c; i++) {
-          value = meta_concat(value, REG(i));
-        }
+      SETREG(A(code), value);
+      SETTRACE(0, value);
+      gc_check();
+      VM_NEXT;
+    }
 
-        SETREG(A(code), value);
-        SETTRACE(0, value);
-        gc_check();
-        break;
+    VM_CASE(OP_SETLIST): {
+      b = B(code);
+      a = A(code);
+      c = C(code);
+      if (c == 0) {
+        c = (instrs++)->instr;
       }
-
-      case OP_SETLIST: {
-        b = B(code);
-        a = A(code);
-        c = C(code);
-        if (c == 0) {
-          c = (instrs++)->instr;
-        }
-        if (b == 0) { b = closure->last_ret - a - 1; }
-        lhash_t *hash = lv_gettable(REG(a), 0);
-        for (i = 1; i <= b; i++) {
-          lhash_set(hash, lv_number((c - 1) * LFIELDS_PER_FLUSH + i),
-                          REG(a + i));
-        }
-        break;
+      if (b == 0) { b = closure->last_ret - a - 1; }
+      lhash_t *hash = lv_gettable(REG(a), 0);
+      for (i = 1; i <= b; i++) {
+        lhash_set(hash, lv_number((c - 1) * LFIELDS_PER_FLUSH + i),
+                        REG(a + i));
       }
+      VM_NEXT;
+    }
 
-      case OP_VARARG: {
-        /* TODO: trace information */
-        a = A(code);
-        b = B(code);
-        u32 max = argc < func->num_parameters ? 0 : argc - func->num_parameters;
-        u32 limit = b > 0 ? b - 1 : max;
-        if (stack + limit + a > vm_stack->size) {
-          vm_stack_grow(vm_stack, stack + limit + a - vm_stack->size);
-        }
-        for (i = 0; i < limit && i < max; i++) {
-          SETREG(a + i, vm_stack->base[argvi + i + func->num_parameters]);
-        }
-        for (; i < limit; i++) {
-          SETREG(a + i, LUAV_NIL);
-        }
-        closure->last_ret = a + i;
-        func->trace.instrs[pc][0] = (u8) MIN(argc, TRACEMAX);
-        for (i = 1; i < TRACELIMIT && i < limit + 1; i++) {
-          SETTRACE(i, REG(a + i - 1));
-        }
-        break;
+    VM_CASE(OP_VARARG): {
+      /* TODO: trace information */
+      a = A(code);
+      b = B(code);
+      u32 max = argc < func->num_parameters ? 0 : argc - func->num_parameters;
+      u32 limit = b > 0 ? b - 1 : max;
+      if (stack + limit + a > vm_stack->size) {
+        vm_stack_grow(vm_stack, stack + limit + a - vm_stack->size);
       }
-
-      case OP_SELF: {
-        luav bv = REG(B(code));
-        SETREG(A(code) + 1, bv);
-        luav val = meta_lhash_get(bv, KREG(C(code)));
-        SETREG(A(code), val);
-        SETTRACE(0, val);
-        SETTRACE(1, bv);
-        break;
+      for (i = 0; i < limit && i < max; i++) {
+        SETREG(a + i, vm_stack->base[argvi + i + func->num_parameters]);
       }
-
-      case OP_TFORLOOP:
-        /* TODO: trace information */
-        a = A(code); c = C(code);
-        lclosure_t *closure2 = lv_getfunction(REG(a), 0);
-        u32 got = vm_fun(closure2, 2, STACKI(a + 1), c, STACKI(a + 3));
-        temp = REG(a + 3);
-        if (got == 0 || temp == LUAV_NIL) {
-          instrs++;
-        } else {
-          SETREG(a + 2, temp);
-        }
-        // fill in the nils
-        if (c != 0) {
-          for (i = got; i < c; i++) {
-            SETREG(a + 3 + i, LUAV_NIL);
-          }
-        }
-        func->trace.instrs[pc][0] = (u8) MIN(got, TRACEMAX);
-        u32 base = a + 3;
-        for (i = base; i < base + got && i - base < TRACELIMIT - 1; i++) {
-          SETTRACE(i - base + 1, REG(i));
-        }
-        break;
-
-      default:
-        fprintf(stderr, "Unimplemented opcode: ");
-        opcode_dump(stderr, code);
-        abort();
+      for (; i < limit; i++) {
+        SETREG(a + i, LUAV_NIL);
+      }
+      closure->last_ret = a + i;
+      func->trace.instrs[PC][0] = (u8) MIN(argc, TRACEMAX);
+      for (i = 1; i < TRACELIMIT && i < limit + 1; i++) {
+        SETTRACE(i, REG(a + i - 1));
+      }
+      VM_NEXT;
     }
 
-    func->instrs[pc].count++;
-  } /* End of massive VM loop */
-}
-
-static u32 op_close(u32 upc, luav *upv) {
-  u32 i, r = 0;
-  for (i = 0; i < upc; i++) {
-    if (lv_isupvalue(upv[i])) {
-      upv[i] = *lv_getupvalue(upv[i]);
-      r++;
+    VM_CASE(OP_SELF): {
+      luav bv = REG(B(code));
+      luav key = KREG(C(code));
+      SETREG(A(code) + 1, bv);
+      luav val;
+      if (lv_istable(bv) && C(code) >= 256 && lv_isstring(key)) {
+        val = icache_get(&func->icache[PC], lv_getptr(bv), key);
+      } else {
+        val = meta_lhash_get(bv, key);
+      }
+      SETREG(A(code), val);
+      SETTRACE(0, val);
+      SETTRACE(1, bv);
+      VM_NEXT;
     }
+
+    VM_CASE(OP_TFORLOOP):
+      /* TODO: trace information */
+      a = A(code); c = C(code);
+      lclosure_t *closure2 = lv_getfunction(REG(a), 0);
+      u32 got = vm_fun(closure2, 2, STACKI(a + 1), c, STACKI(a + 3));
+      temp = REG(a + 3);
+      if (got == 0 || temp == LUAV_NIL) {
+        instrs++;
+      } else {
+        SETREG(a + 2, temp);
+      }
+      // fill in the nils
+      if (c != 0) {
+        for (i = got; i < c; i++) {
+          SETREG(a + 3 + i, LUAV_NIL);
+        }
+      }
+      func->trace.instrs[PC][0] = (u8) MIN(got, TRACEMAX);
+      u32 base = a + 3;
+      for (i = base; i < base + got && i - base < TRACELIMIT - 1; i++) {
+        SETTRACE(i - base + 1, REG(i));
+      }
+      VM_NEXT;
+
+    VM_DEFAULT:
+      fprintf(stderr, "Unimplemented opcode: ");
+      opcode_dump(stderr, code);
+      abort();
+  } /* End of massive VM dispatch */
+
+  /* A lua function called by OP_CALL in this loop returned `got` values, so
+     restore the caller and finish its OP_CALL */
+resume_caller: {
+    lcallinfo_t *ci = vm_stack->ci;
+    assert(depth > 0 && vm_running == ci->frame.caller);
+    closure    = ci->closure;
+    func       = closure->function.lua;
+    instrs     = ci->instrs;
+    stack      = ci->stack;
+    stack_orig = ci->stack_orig;
+    argc       = ci->argc;
+    argvi      = ci->argvi;
+    retc       = ci->retc;
+    retvi      = ci->retvi;
+    vm_running->pc = &instrs;
+    vm_callinfo_pop(vm_stack);
+    depth--;
+
+    cur  = instrs - 1;
+    code = cur->instr;
+    assert(OP(code) == OP_CALL);
+    a = A(code);
+    c = C(code);
+    goto call_return;
   }
-  return r;
 }
 
 static int meta_unary(luav operand, luav name, u32 reti) {
@@ -1036,6 +1529,88 @@ notfound:
   err_rawstr("metatable.__index not found", TRUE);
 }
 
+/**
+ * @brief Fills an inline cache with where a key was found, then returns it
+ *
+ * Only keys in the hash portion of the table, or of the table that the
+ * table's metatable has as __index, are cached. Anything else, such as an
+ * __index function, is left to meta_lhash_get every time.
+ *
+ * @param ic the cache to fill in
+ * @param hash the table being indexed
+ * @param key the constant string key being looked up
+ * @return the value of hash[key]
+ */
+static luav icache_fill(icache_t *ic, lhash_t *hash, luav key) {
+  u32 slot, meta_slot;
+  luav val = lhash_get(hash, key);
+  if (val != LUAV_NIL) {
+    /* lhash_get special cases some keys, like _G, so make sure the slot
+       actually holds what was returned before caching it */
+    if (lhash_slot(hash, key, &slot) && hash->table[slot].value == val) {
+      ic->table = hash;
+      ic->meta  = NULL;
+      ic->slot  = slot;
+    }
+    return val;
+  }
+
+  lhash_t *meta = hash->metatable;
+  if (meta != NULL && lhash_slot(meta, META_INDEX, &meta_slot) &&
+      lv_istable(meta->table[meta_slot].value)) {
+    lhash_t *index = lv_getptr(meta->table[meta_slot].value);
+    if (lhash_slot(index, key, &slot)) {
+      ic->table     = index;
+      ic->meta      = meta;
+      ic->slot      = slot;
+      ic->meta_slot = meta_slot;
+      return index->table[slot].value;
+    }
+  }
+  return meta_lhash_get(lv_table(hash), key);
+}
+
+/**
+ * @brief Looks up a constant string key in a table through an inline cache
+ *
+ * The cached tables are never dereferenced unless they're reachable from
+ * `hash`, so a hit only needs to check that the cached slots still hold the
+ * same keys. Table versions aren't used because any unrelated write would
+ * invalidate the cache. Long constant strings aren't interned, so the key in
+ * the slot may be a different copy of the same string.
+ *
+ * @param ic the instruction's inline cache
+ * @param hash the table being indexed
+ * @param key the constant string key being looked up
+ * @return the value of hash[key], respecting __index
+ */
+static luav icache_get(icache_t *ic, lhash_t *hash, luav key) {
+  if (ic->meta == NULL) {
+    if (ic->table == hash && ic->slot < hash->tcap &&
+        lv_rawequal(hash->table[ic->slot].key, key)) {
+      luav val = hash->table[ic->slot].value;
+      if (val != LUAV_NIL || hash->metatable == NULL) {
+        return val;
+      }
+    }
+  } else if (hash->metatable == ic->meta) {
+    lhash_t *meta = ic->meta;
+    lhash_t *index = ic->table;
+    if (ic->meta_slot < meta->tcap &&
+        meta->table[ic->meta_slot].key == META_INDEX &&
+        meta->table[ic->meta_slot].value == lv_table(index) &&
+        ic->slot < index->tcap &&
+        lv_rawequal(index->table[ic->slot].key, key) &&
+        lhash_get(hash, key) == LUAV_NIL) {
+      luav val = index->table[ic->slot].value;
+      if (val != LUAV_NIL) {
+        return val;
+      }
+    }
+  }
+  return icache_fill(ic, hash, key);
+}
+
 static void meta_lhash_set(luav operand, luav key, luav val) {
   lhash_t *meta = getmetatable(operand);
   if (meta == NULL) goto normal;
@@ -1101,3 +1676,40 @@ static luav meta_concat(luav v1, luav v2) {
 
   return lv_concat(v1, v2);
 }
+
+/**
+ * @brief Concatenate a range of stack slots, with lua's semantics
+ *
+ * Concatenation is right associative, so this works from the end of the range
+ * backwards. Each maximal run of strings and numbers is joined with a single
+ * call to lv_concatn, and only values with a __concat metamethod are combined
+ * pairwise. Intermediate results are written back into the range so they stay
+ * visible to the garbage collector while metamethods are running.
+ *
+ * @param base the index of the first slot in the stack
+ * @param cnt the number of slots to concatenate
+ * @return the result of the concatenation
+ */
+static luav meta_concatn(u32 base, u32 cnt) {
+  while (cnt > 1) {
+    /* The stack may be reallocated by a metamethod, so refetch it each time */
+    luav *vals = &vm_stack->base[base];
+    luav v1 = vals[cnt - 2];
+    luav v2 = vals[cnt - 1];
+    if ((lv_isstring(v1) || lv_isnumber(v1)) &&
+        (lv_isstring(v2) || lv_isnumber(v2))) {
+      u32 start = cnt - 2;
+      while (start > 0 && (lv_isstring(vals[start - 1]) ||
+                           lv_isnumber(vals[start - 1]))) {
+        start--;
+      }
+      vals[start] = lv_concatn(&vals[start], cnt - start);
+      cnt = start + 1;
+    } else {
+      luav value = meta_concat(v1, v2);
+      vm_stack->base[base + cnt - 2] = value;
+      cnt--;
+    }
+  }
+  return vm_stack->base[base];
+}
@@ -15,7 +15,14 @@
 #include "luav.h"
 #include "trace.h"
 
-#define VM_STACK_INIT 1024
+#define VM_STACK_INIT   1024
+#define VM_STACK_SHRINK 4     // shrink stacks once a quarter full
+/* C stack kept free below the deepest compiled frame on the main thread */
+#define VM_CSTACK_RESERVE (256 * 1024)
+
+/* Whether compiled code may be entered from the C stack frame at 'sp'. Below
+   the limit lua calls stay in the interpreter, which doesn't recurse */
+#define VM_CSTACK_ROOM(sp) ((char*) (sp) > vm_cstack_limit)
 
 struct lhash;
 
@@ -26,8 +33,21 @@ typedef struct instr {
   jfunc_t   *jfunc; //<! Compiled code starting from this instruction
   u32       instr;  //<! The lua opcode for this instruction
   u8        count;  //<! Number of times the instruction has been run
+  u8        op;     //<! Opcode dispatched on, possibly specialized from instr
+  u8        deopts; //<! Number of times a specialization has failed
+  u8        exits;  //<! Side exits compiled code has taken here, saturating
 } instr_t;
 
+/* Inline cache for looking up a constant string key at one instruction,
+   remembering which slot of which table the key was last found in */
+typedef struct icache {
+  struct lhash *table;  //<! Table the key was found in, NULL if none yet
+  struct lhash *meta;   //<! If found through __index, the metatable whose
+                        //<! __index is `table`, otherwise NULL
+  u32 slot;             //<! Slot of the key in table's hash portion
+  u32 meta_slot;        //<! Slot of __index in meta's hash portion
+} icache_t;
+
 /* Package of a parsed function, and lots of metadata about it */
 typedef struct lfunc {
   lstring_t   *name;            //<! Name (in theory, doesn't work with luac?)
@@ -50,6 +70,7 @@ typedef struct lfunc {
   u32         num_lines;        //<! Number of debug lines reported
   u32         *lines;           //<! Corresponding line number for each inst
   trace_t     trace;            //<! JIT tracing information
+  icache_t    *icache;          //<! Inline cache for each instruction
   i32         *preds;           //<! Predecessor array
 
   u8          compilable;       //<! Whether the function can be fully compiled
@@ -86,12 +107,41 @@ typedef struct lframe {
   struct lframe *caller;  //<! Parent frame
 } lframe_t;
 
+/* Upvalue shared between closures. While the local variable it refers to is
+   still live the upvalue is open and points at the variable's stack slot,
+   and once the variable goes out of scope the upvalue is closed by moving the
+   value into the upvalue itself */
+typedef struct lupvalue {
+  luav *v;                //<! Location of the value, a stack slot or &value
+  luav value;             //<! Storage for the value once closed
+  u32 index;              //<! Stack slot of the variable while open
+  struct lupvalue *next;  //<! Next open upvalue further down the stack
+} lupvalue_t;
+
+/* State of a lua function which called another lua function without leaving
+   the interpreter loop, restored once the callee returns. These live on the
+   heap so that lua recursion doesn't consume any C stack. */
+typedef struct lcallinfo {
+  lframe_t frame;           //<! Frame of the callee
+  lclosure_t *closure;      //<! Closure of the caller
+  instr_t *instrs;          //<! Instruction the caller resumes at
+  u32 stack;                //<! Caller's stack frame
+  u32 stack_orig;           //<! Caller's original stack frame, see TAILCALL
+  u32 argc, argvi;          //<! Caller's arguments
+  u32 retc, retvi;          //<! Where the caller returns to
+  struct lcallinfo *prev;   //<! Call info of the caller's caller, or the next
+                            //<! free call info when not in use
+} lcallinfo_t;
+
 /* Implementation of lua stacks */
 typedef struct lstack {
   luav *top;  //<! Top of the stack's limit
   luav *base; //<! Base of the stack
   u32 size;   //<! Current size of the stack
   u32 limit;  //<! Limit of the size of the stack
+  lupvalue_t *open; //<! Open upvalues, sorted by decreasing stack slot
+  lcallinfo_t *ci;      //<! Innermost call made within the interpreter loop
+  lcallinfo_t *ci_free; //<! Call infos available for reuse
 } lstack_t;
 
 /**
@@ -113,6 +163,7 @@ extern lstack_t *vm_stack;
 extern struct lhash *global_env;
 extern int jit_bailed;
 extern jfunc_t *running_jfunc;
+extern char *vm_cstack_limit;
 
 lclosure_t* cfunc_alloc(cfunction_t *f, char *name, int upvalues);
 void cfunc_register(struct lhash *table, char *name, cfunction_t *f);
@@ -126,8 +177,10 @@ void vm_stack_destroy(lstack_t *stack);
 void vm_stack_grow(lstack_t *stack, u32 size);
 u32 vm_stack_alloc(lstack_t *stack, u32 size);
 void vm_stack_dealloc(lstack_t *stack, u32 base);
+void vm_stack_close(lstack_t *stack, u32 base);
+void vm_stack_unwind(lstack_t *stack, lcallinfo_t *ci);
 
 lclosure_t* lclosure_alloc(lclosure_t *parent, u32 idx);
-luav        lupvalue_alloc(luav val);
+luav        lupvalue_find(lstack_t *stack, u32 index);
 
 #endif /* _VM_H_ */
@@ -0,0 +1,146 @@
+-- Loops over the array part of tables, which compiled code indexes directly
+
+local function sum(t, n)
+  local s = 0
+  for i = 1, n do s = s + t[i] end
+  return s
+end
+local function rsum(t, n)
+  local s = 0
+  for i = n, 1, -1 do s = s + t[i] * i end
+  return s
+end
+local function scale(t, n, f)
+  for i = 1, n do t[i] = t[i] * f end
+end
+
+local t = {}
+for i = 1, 100 do t[i] = i end
+for k = 1, 300 do
+  scale(t, 100, 1)
+  if k % 100 == 0 then print(sum(t, 100), rsum(t, 100)) end
+end
+scale(t, 100, 3)
+print(t[1], t[50], t[100], sum(t, 100))
+print((pcall(sum, t, 101)), (pcall(rsum, t, 120)))
+print((pcall(sum, "x", 3)), sum({1, 2, 3}, 3))
+
+local u = {1, 2, 3}
+print((pcall(scale, u, 4, 2)))
+print(u[1], u[2], u[3], u[4])
+
+-- Holes go through the metatable, and so do stores into them
+local m = setmetatable({}, {__index = function(_, k) return -k end})
+for i = 1, 50 do m[i] = i end
+print(sum(m, 50))
+m[25] = nil
+print(sum(m, 50))
+local w = setmetatable({}, {__newindex = function(t, k, v)
+  rawset(t, k, v + 1000)
+end})
+w[1] = 1; w[2] = 2
+scale(w, 2, 2)
+print(w[1], w[2])
+w[2] = nil
+print((pcall(scale, w, 2, 2)))
+print(w[1], w[2])
+
+-- Tables which grow or get replaced in the loop
+local function fill(t, n)
+  for i = 1, n do t[i] = t[i] or i end
+  return #t
+end
+for k = 1, 40 do io.write(fill({}, k * 3), " ") end
+print()
+local grow = {}
+for k = 1, 40 do io.write(fill(grow, 90 + k * 5), " ") end
+print()
+local h = {}
+for i = 1, 10 do h[i] = i * 4 end
+local function swap(t)
+  local s = 0
+  for i = 1, 10 do s = s + t[i]; t = h end
+  return s
+end
+for k = 1, 300 do swap(h) end
+print(swap(h), swap({2, 2, 2, 2, 2, 2, 2, 2, 2, 2}))
+
+-- Keys which aren't the loop counter, and nested loops
+local f = {10, 20, 30}
+local function g(t, x)
+  local s = 0
+  for i = 1, 100 do s = s + (t[x] or 0) end
+  return s
+end
+for k = 1, 300 do g(f, 2) end
+print(g(f, 2.5), g(f, 2), g(f, 4), g(f, 0), g(f, -1), g(f, 1e300))
+local a, b = {}, {}
+for i = 1, 64 do a[i] = i; b[i] = 0 end
+local function add(n)
+  for i = 1, n do b[i] = a[i] + b[i] end
+end
+local function outer(n)
+  local s = 0
+  for i = 1, n do
+    for j = 1, n do s = s + a[i] * a[j] end
+  end
+  return s
+end
+for k = 1, 300 do add(64) end
+for k = 1, 50 do outer(8) end
+print(b[1], b[64], outer(8), outer(64))
+a[30] = 2
+print(outer(64))
+
+-- Steps which change once the loop has been compiled
+local function axpy(a, x, y, n, step)
+  for i = 1, n, step do y[i] = a * x[i] + y[i] end
+end
+local x, y = {}, {}
+for i = 1, 100 do x[i] = i; y[i] = 1 end
+for k = 1, 300 do axpy(0.5, x, y, 100, 1) end
+axpy(2, x, y, 100, 3)
+axpy(-1, x, y, 99, 2)
+axpy(1, x, y, 100, -1)
+print(y[1], y[2], y[4], y[50], y[99], y[100])
+y[60] = nil
+print((pcall(axpy, 1, x, y, 100, 1)), y[59], y[61])
+
+-- Holes left and filled by table.remove and table.insert, which writes
+-- into the array part have to see
+local z = {}
+for i = 1, 50 do z[i] = i end
+table.remove(z, 1)
+table.remove(z, 10)
+print(#z, z[47], z[48], z[49], z[50])
+for k = 1, 300 do axpy(1, x, z, 48, 1) end
+print(z[1], z[48], z[49])
+table.insert(z, 5, 0)
+table.insert(z, 52, 7)
+print(z[5], z[49], z[50], z[51], z[52])
+print((pcall(axpy, 1, x, z, 52, 1)), z[49], z[50], z[51])
+print((table.remove({})))
+
+-- Holes below the length left by a resize which moved higher keys into the
+-- array part, and inserts right at the end of the array part
+local function fill(t, n)
+  for i = 1, n do t[i] = i * 2 end
+end
+local function holes()
+  local t = {}
+  for i = 12, 16 do t[i] = i end
+  for i = 1, 5 do t[i] = i end
+  t[11] = 11
+  return t
+end
+for k = 1, 300 do fill(holes(), 11) end
+local h = holes()
+fill(h, 11)
+local cnt = 0
+for _ in pairs(h) do cnt = cnt + 1 end
+print(cnt, h[6], h[10], h[11], h[12], h[16])
+for p = 1, 40 do
+  local t = {}
+  table.insert(t, p, p)
+  if t[p] ~= p then print('insert', p) end
+end
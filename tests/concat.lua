@@ -1,3 +1,7 @@
 print('ab' .. 'cd')
 print('hello' .. ' ' .. 'world')
 print(#('hello\0' .. ' world' .. ' this has a ' .. '\0null'))
+print(1 .. 2 .. 'x' .. 3.5 .. '' .. -0.25)
+print('' .. 'only' .. '')
+local a, b, c = 'a', 12, 'c'
+print(a .. b .. c .. b .. a .. 1e100 .. c)
@@ -0,0 +1,59 @@
+-- Deep lua recursion, which shouldn't need any C stack
+
+local function depth(n)
+  if n == 0 then return 0 end
+  return 1 + depth(n - 1)
+end
+print(depth(15000))
+
+local function sum(n, ...)
+  if n == 0 then return select('#', ...) end
+  local a, b = sum(n - 1, n, ...)
+  return a
+end
+print(sum(100))
+
+local co = coroutine.create(function(n)
+  coroutine.yield(depth(n))
+  local function down(n)
+    if n == 0 then coroutine.yield("bottom") return "up" end
+    local r = down(n - 1)
+    return r
+  end
+  return down(n)
+end)
+print(coroutine.resume(co, 15000))
+print(coroutine.resume(co))
+print(coroutine.resume(co))
+print(coroutine.status(co))
+
+local function fail(n)
+  if n == 0 then error("deep") end
+  local r = fail(n - 1)
+  return r
+end
+for i = 1, 3 do
+  local ok, err = pcall(fail, 5000)
+  print(ok, string.find(err, "deep") ~= nil)
+end
+print(depth(10000))
+
+local mt = {__call = function(self, n) return depth(n) end}
+local callable = setmetatable({}, mt)
+local function viacall(n)
+  if n == 0 then return callable(10) end
+  local r = viacall(n - 1)
+  return r
+end
+print(viacall(100))
+
+local function tail(n)
+  if n == 0 then return "tail done" end
+  return tail(n - 1)
+end
+local function caller(n)
+  local r = tail(n)
+  return r
+end
+print(caller(100000))
+print(select('#', depth(1)), math.max(depth(3), depth(2)))
@@ -27,3 +27,30 @@ for i = 100, -900, 3 do
   a = a + i
 end
 print(a)
+
+-- A hot loop whose step changes sign between calls, and sometimes isn't an
+-- integer or is zero
+local t = {2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30, 32}
+local function walk(first, limit, step)
+  local s = 0
+  for i = first, limit, step do
+    s = s + i + (t[i] or 0)
+  end
+  return s
+end
+local total = walk(1, 1, 1) + walk(1, 1, -1)
+for n = 1, 3000 do
+  local r = n % 5
+  if r == 0 then
+    total = total + walk(1, 20, 1)
+  elseif r == 1 then
+    total = total + walk(20, 1, -1)
+  elseif r == 2 then
+    total = total + walk(19, 3, -3)
+  elseif r == 3 then
+    total = total + walk(2, 20, 0.5)
+  else
+    total = total + walk(1, 10, 0) + walk(5, 1, 2)
+  end
+end
+print(total)
@@ -0,0 +1,39 @@
+-- string.format conversions, compared against the reference output
+
+local nums = {0, 1, -1, 7, 42, -42, 255, 65535, 123456789, -987654321,
+              0.5, 1.5, 2.5, -0.125, 0.125, 3.14159265, -2.71828, 1e-7,
+              123.456, 99.995, 1e12 + 0.5, 0.001, -0.0009}
+local formats = {"%d", "%5d", "%-5d|", "%05d", "%i", "%x", "%X", "%8x", "%o",
+                 "%f", "%.2f", "%5.2f", "%-10.3f|", "%010.4f", "%.0f", "%.9f",
+                 "%3.0f", "%+d", "% d", "%+.2f", "%#x", "%e", "%.3e", "%g",
+                 "%.14g", "%10.3g", "%G"}
+
+for _, fmt in ipairs(formats) do
+  local out = {}
+  for _, n in ipairs(nums) do
+    out[#out + 1] = string.format(fmt, n)
+  end
+  print(fmt, table.concat(out, " "))
+end
+
+local strs = {"", "a", "hello", "with space", string.rep("x", 120)}
+for _, fmt in ipairs({"%s", "%10s|", "%-10s|", "%.3s|", "%8.2s|", "%q"}) do
+  for _, s in ipairs(strs) do
+    print(fmt, string.format(fmt, s))
+  end
+end
+
+print(string.format("%c%c%c", 76, 117, 97), string.format("%5c|", 65))
+print(string.format("%s=%d (%5.1f%%) [%x]", "key", 10, 12.345, 3054))
+print(string.format("%q", 'a "quoted"\n\\ string\0end'))
+print(string.format("%s %s", 1, 2.5), string.format("%d%%", 50))
+print(string.format("%5s|%-5s|", 12, 3.5))
+
+for i = 1, 3 do
+  print(string.format("row %3d: %-8s %8.2f", i, "item" .. i, i * 1.1))
+end
+
+print((pcall(string.format, "%y", 1)))
+print((pcall(string.format, "%", 1)))
+print((pcall(string.format, "%1234d", 1)))
+print((pcall(string.format, "%d")))
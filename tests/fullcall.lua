@@ -0,0 +1,74 @@
+-- Functions with varargs, many parameters, multiple returns and tail calls,
+-- called often enough to be compiled whole
+
+local function count(...) return select('#', ...) end
+local function pack(...) return {...} end
+local function first(a, ...) local b, c = ... return a, b, c end
+local function many(a, b, c, d, e, f, g, h)
+  return a + b + c + d, e, f, g, h
+end
+local function none() end
+local function swap(a, b) return b, a end
+local function sum(...)
+  local s = 0
+  local t = {...}
+  for i = 1, #t do s = s + t[i] end
+  return s
+end
+
+for k = 1, 300 do
+  local n = k % 5
+  if k % 60 == 0 then
+    print(count(), count(nil), count(1, 2, 3), count(swap(1, 2)))
+    print(#pack(), #pack(1, 2, 3, 4, 5, 6, 7, 8, 9, 10), pack(k, n)[2])
+    print(first(1), first(1, 2), first(1, 2, 3, 4))
+    print(many(1, 2, 3, 4, 5, 6, 7, 8))
+    print(many(1, 2, 3, 4, 5, 6))
+    print(none(), (none()), swap(k, n))
+    print(sum(), sum(1, 2, 3), sum(swap(4, 5)), sum(1, 2, 3, 4, 5, 6, 7, 8, 9))
+  else
+    count(k); pack(k, n); first(k, n); many(1, 2, 3, 4, 5, 6, 7, 8)
+    none(); swap(k, n); sum(k, n, k)
+  end
+end
+
+-- More values than registers
+local big = {}
+for i = 1, 300 do big[i] = i end
+print(count(unpack(big)), sum(unpack(big)), #pack(unpack(big)))
+
+-- Self tail calls run in constant stack
+local function loop(n, acc)
+  if n == 0 then return acc end
+  return loop(n - 1, acc + n)
+end
+for k = 1, 10 do loop(10, 0) end
+print(loop(100000, 0))
+
+-- Tail calls to other functions
+local even, odd
+function even(n) if n == 0 then return true end return odd(n - 1) end
+function odd(n) if n == 0 then return false end return even(n - 1) end
+for k = 1, 10 do even(10) end
+print(even(100000), odd(100001), even(7))
+
+local function tailvar(n, ...)
+  if n == 0 then return ... end
+  return tailvar(n - 1, n, ...)
+end
+for k = 1, 10 do tailvar(3) end
+print(tailvar(5))
+
+local function pick(f, ...) return f(...) end
+for k = 1, 10 do pick(swap, 1, 2) end
+print(pick(swap, 1, 2), pick(count, 1, nil, 3), pick(print, "from print"))
+
+-- Closures captured across a self tail call see their own iteration
+local fs = {}
+local function capture(n)
+  if n == 0 then return end
+  fs[n] = function() return n end
+  return capture(n - 1)
+end
+for k = 1, 10 do capture(3) end
+print(fs[1](), fs[2](), fs[3]())
@@ -0,0 +1,67 @@
+-- Lookups of constant keys whose tables change between runs
+
+local function getglobal() return value end
+value = 1
+for i = 1, 3 do print(getglobal()) end
+value = 2
+print(getglobal())
+for i = 1, 100 do _G["filler" .. i] = i end
+print(getglobal())
+value = nil
+print(getglobal())
+value = 3
+print(getglobal())
+
+local function getfield(t) return t.field end
+local t = {field = "a"}
+for i = 1, 3 do print(getfield(t)) end
+t.field = nil
+print(getfield(t))
+t.field = "b"
+for i = 1, 100 do t["k" .. i] = i end
+print(getfield(t))
+print(getfield({field = "other"}), getfield({}))
+setmetatable(t, {__index = {field = "meta"}})
+t.field = nil
+print(getfield(t))
+
+local Class = {}
+Class.__index = Class
+function Class.new(n) return setmetatable({n = n}, Class) end
+function Class:get() return "get " .. self.n end
+local objs = {Class.new(1), Class.new(2), Class.new(3)}
+for i = 1, 3 do print(objs[i]:get()) end
+function Class:get() return "new get " .. self.n end
+print(objs[1]:get())
+objs[2].get = function(self) return "own get " .. self.n end
+print(objs[2]:get(), objs[3]:get())
+for i = 1, 100 do Class["m" .. i] = i end
+print(objs[3]:get())
+
+local Other = {get = function(self) return "other " .. self.n end}
+Other.__index = Other
+setmetatable(objs[3], Other)
+print(objs[3]:get())
+Class.__index = {get = function(self) return "swapped " .. self.n end}
+print(objs[1]:get())
+Class.__index = function(t, k) return function(self) return "fn " .. k end end
+print(objs[1]:get())
+Class.__index = Class
+print(objs[1]:get())
+getmetatable(objs[1]).__index = nil
+print(pcall(function() return objs[1]:get() end) == false)
+
+-- Long constant keys aren't interned, so the table holds another copy
+local long = {}
+long[string.rep("k", 50)] = 1
+local proto = {}
+proto[string.rep("p", 45)] = 2
+setmetatable(long, {__index = proto})
+local sum = 0
+for i = 1, 100 do
+  sum = sum + long.kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk +
+        long.ppppppppppppppppppppppppppppppppppppppppppppp
+end
+print(sum)
+long[string.rep("k", 50)] = 5
+print(long.kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk)
@@ -0,0 +1,51 @@
+-- Calls to small functions from hot loops, which compiled code inlines
+
+local function sq(x) return x * x + 1 end
+local function dot(ax, ay, bx, by) return ax * bx + ay * by end
+local function less(a, b) return a < b end
+local point = {x = 3, y = 4}
+function point.getx(p) return p.x end
+
+local function work(n)
+  local s, c = 0, 0
+  for i = 1, n do
+    s = s + sq(i) + dot(i, 2, 3, i) + point.getx(point)
+    if less(i, n / 2) then c = c + 1 end
+  end
+  return s, c
+end
+for k = 1, 30 do work(100) end
+print(work(100))
+print(work(7))
+
+-- The callee changes under the call site
+local saved = sq
+sq = function(x) return -x end
+print(work(100))
+sq = saved
+print(work(100))
+point.x = "5"
+print(pcall(work, 10))
+point.x = 3
+
+-- Callees which leave compiled code, and ones calling themselves
+local function pick(t, k)
+  local v = t[k]
+  if v == nil then return 0 end
+  return v
+end
+local function count(n)
+  if n == 0 then return 0 end
+  return 1 + count(n - 1)
+end
+local t = {1, 2, "x", 4}
+local function walk(n)
+  local s = 0
+  for i = 1, n do
+    local v = pick(t, i % 6)
+    if type(v) == "number" then s = s + v + count(3) end
+  end
+  return s
+end
+for k = 1, 30 do walk(60) end
+print(walk(60), walk(6))
@@ -0,0 +1,98 @@
+-- Closures sharing an open upvalue see each other's writes and the locals'
+local function counter()
+  local n = 0
+  local function inc() n = n + 1; return n end
+  local function get() return n end
+  n = 10
+  return inc, get
+end
+local inc, get = counter()
+inc(); inc()
+print(get())
+
+-- Every iteration of a loop gets a fresh local
+local fns = {}
+for i = 1, 5 do
+  local j = i * 2
+  fns[i] = function () j = j + 1; return i, j end
+end
+for i = 1, 5 do print(fns[i]()) end
+print(fns[1]())
+
+local k = 0
+local whiles = {}
+while k < 3 do
+  k = k + 1
+  local v = k
+  whiles[k] = function () return v end
+end
+print(whiles[1](), whiles[2](), whiles[3]())
+
+-- The stack is reallocated while upvalues are open
+local function deep(n)
+  if n == 0 then return 0 end
+  return 1 + deep(n - 1)
+end
+local function grows()
+  local x = 'before'
+  local f = function () return x end
+  local d = deep(5000)
+  x = 'after'
+  return f(), d
+end
+print(grows())
+
+-- Capturing locals, then tailcalling away from them
+local function tail(n, acc)
+  local f = function () return acc end
+  if n == 0 then return f end
+  return tail(n - 1, acc + n)
+end
+print(tail(100, 0)())
+
+-- Errors unwind frames without a RETURN closing them
+local saved
+print(pcall(function ()
+  local secret = 'kept'
+  saved = function () return secret end
+  error('boom')
+end))
+local function clobber(a, b, c, d, e) return a end
+clobber(1, 2, 3, 4, 5)
+print(saved())
+
+-- Upvalues into a coroutine's stack
+local co = coroutine.create(function (a)
+  local total = a
+  local add = function (x) total = total + x; return total end
+  while true do
+    a = coroutine.yield(add)
+    total = total + a
+  end
+end)
+local _, add = coroutine.resume(co, 1)
+print(add(10))
+coroutine.resume(co, 100)
+print(add(0))
+
+local grabbed
+local dead = coroutine.wrap(function ()
+  local msg = 'from a dead coroutine'
+  grabbed = function () return msg end
+end)
+dead()
+dead = nil
+for i = 1, 100000 do local garbage = {i} end
+print(grabbed())
+
+-- Upvalues of upvalues
+local function outer()
+  local a = 1
+  return function ()
+    local b = 2
+    return function () a = a + 1; b = b + 1; return a, b end
+  end
+end
+local mid = outer()
+local f1, f2 = mid(), mid()
+print(f1()); print(f1()); print(f2())
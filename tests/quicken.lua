@@ -0,0 +1,86 @@
+-- Instructions which change operand types after running a few times
+
+local function arith(a, b)
+  return a + b, a - b, a * b, a / b, a % b, a + 1, a - 1, a * 2, a / 2, a % 3
+end
+
+for i = 1, 10 do print(arith(i, 3)) end
+print(arith("10", 4))
+print(arith(7, "2"))
+local mt = {__add = function(a, b) return "add" end,
+            __sub = function(a, b) return "sub" end,
+            __mul = function(a, b) return "mul" end,
+            __div = function(a, b) return "div" end,
+            __mod = function(a, b) return "mod" end}
+print(arith(setmetatable({}, mt), 3))
+for i = 1, 10 do print(arith(i, i + 1)) end
+
+local function compare(a, b)
+  return a < b, a <= b, a < 5, a <= 5, 5 < b, 5 <= b
+end
+
+for i = 1, 10 do print(compare(i, 10 - i)) end
+local function strcompare(a, b) return a < b, a <= b end
+for i = 1, 5 do print(strcompare(i, 3)) end
+print(strcompare("abc", "abd"))
+print(strcompare("b", "a"))
+local cmt = {__lt = function(a, b) return true end,
+             __le = function(a, b) return false end}
+local x, y = setmetatable({}, cmt), setmetatable({}, cmt)
+print(strcompare(x, y))
+print(pcall(compare, 1, "2"))
+
+local function get(t, k) return t[k] end
+local function getname(t) return t.name end
+local arr = {10, 20, 30, 40, 50}
+for i = 1, 5 do print(get(arr, i)) end
+print(get(arr, 6), get(arr, 0), get(arr, 2.5), get(arr, "x"))
+arr.x = "hash"
+print(get(arr, "x"))
+setmetatable(arr, {__index = function(t, k) return "missing " .. k end})
+print(get(arr, 3), get(arr, 100))
+arr[3] = nil
+print(get(arr, 3))
+print((pcall(get, nil, 1)))
+
+local objs = {{name = "a"}, {name = "b"}, {name = "c"}, {}}
+for i = 1, 4 do print(getname(objs[i])) end
+print(getname(setmetatable({}, {__index = {name = "inherited"}})))
+
+local function set(t, k, v) t[k] = v end
+local t = {1, 2, 3, 4}
+for i = 1, 4 do set(t, i, i * 10) end
+print(t[1], t[2], t[3], t[4], #t)
+set(t, 4, nil)
+print(t[4], #t)
+set(t, 4, "back")
+print(t[4], #t)
+set(t, 5, "grow")
+print(t[5], #t)
+set(t, "k", "v")
+print(t.k)
+local log = {}
+local proxy = setmetatable({1, 2, 3}, {__newindex = function(t, k, v)
+  log[#log + 1] = k
+  rawset(t, k, v)
+end})
+for i = 1, 3 do set(proxy, i, i) end
+set(proxy, 2, nil)
+set(proxy, 2, "new")
+print(proxy[2], #log, log[1])
+
+local function loop(a, b, c)
+  local sum = 0
+  for i = a, b, c do sum = sum + i end
+  return sum
+end
+for i = 1, 5 do print(loop(1, 10 * i, i)) end
+print(loop("1", "10", "2"))
+print(loop(10, 1, -1))
+print(loop(1, 2, 0.25))
+
+-- NaN is unordered, before and after the comparisons are specialized
+local nan = 0 / 0
+for i = 1, 6 do
+  print(1 <= nan, 1 < nan, nan <= 1, nan < 1, nan <= nan, compare(nan, nan))
+end
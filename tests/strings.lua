@@ -41,8 +41,8 @@ assert(string.sub("123456789", a, b) == "345")
 assert(string.find("1234567890123456789", "345", 3) == 3)
 assert(string.find("1234567890123456789", "345", 4) == 13)
 assert(string.find("1234567890123456789", "346", 4) == nil)
--- assert(string.find("1234567890123456789", ".45", -9) == 13)
--- assert(string.find("abcdefg", "\0", 5, 1) == nil)
+assert(string.find("1234567890123456789", ".45", -9) == 13)
+assert(string.find("abcdefg", "\0", 5, 1) == nil)
 assert(string.find("", "") == 1)
 assert(string.find('', 'aaa', 1) == nil)
 -- assert(('alo(.)alo'):find('(.)', 1, 1) == 4)
@@ -176,3 +176,66 @@ assert(table.concat(a, ",", 4) == "")
 
 
 assert(string.sub(string.rep("a", 64), 65) == "")
+
+-- long strings aren't interned, but still compare and hash by contents
+local long1 = string.rep("xy", 40) .. "z"
+local long2 = string.rep("x", 1) .. string.rep("yx", 39) .. "yz"
+assert(long1 == long2)
+assert(rawequal(long1, long2))
+assert(long1 ~= long2 .. "!")
+assert(long1 < long2 .. "!")
+local keyed = {}
+keyed[long1] = 1
+assert(keyed[long2] == 1)
+keyed[long2] = 2
+assert(keyed[long1] == 2)
+local nkeys = 0
+for k, v in pairs(keyed) do nkeys = nkeys + 1 end
+assert(nkeys == 1)
+
+-- strings built up piece by piece
+assert(string.format("%s|%5s|%-5s|", "ab", "x", "y") == "ab|    x|y    |")
+assert(string.format("%q", 'a"b\\c\0d') == '"a\\"b\\\\c\\000d"')
+assert(#string.format("%s", string.rep("abc", 1000)) == 3000)
+assert(tostring(nil) == "nil" and tostring(true) == "true")
+assert(tostring(-1.5) == "-1.5")
+assert(table.concat({1, "b", 2.5}, ", ") == "1, b, 2.5")
+assert(table.concat({string.rep("x", 300), string.rep("y", 300)}) ==
+       string.rep("x", 300) .. string.rep("y", 300))
+assert(string.sub("A", 1, 1) == "A" and string.sub("abc", 1, 1) == "a")
+assert(string.sub("abc", 1, -10) == "" and string.sub("abc", 2, 0) == "")
+assert(string.byte("abc", 1, -10) == nil)
+for _, x in ipairs({0, 1, -1, 0.1, 1/3, -2/3, 1e14, 1e15 + 1, 123456789012345,
+                    99999999999999, 1e-4, 1.5e-5, 1e100, -1e-300, 2^63, 1e35,
+                    0.30000000000000004, 12.5, 2^-20}) do
+  assert(tostring(x) == string.format("%.14g", x))
+  assert(("" .. x) == tostring(x))
+end
+assert("10" + 1 == 11 and " 10 " * 2 == 20 and "-0.5" + 0 == -0.5)
+assert("0x10" + 0 == 16 and "1e2" + 0 == 100 and ".5" + 0 == 0.5)
+assert(tonumber("1e") == nil and tonumber("") == nil and tonumber(" ") == nil)
+assert(tonumber("0x") == nil and tonumber("1.5x") == nil and tonumber("1 2") == nil)
+assert(tonumber("12345678901234567890") == 1.2345678901234567e19)
+assert(tonumber("0.1") == 0.1 and tonumber("1e400") == 1/0)
+assert(tonumber("ff", 16) == 255 and tonumber("10", 2) == 2)
+for i = 1, 3 do assert("2.5" * i == 2.5 * i) end
+local t = {}
+t[string.sub("xabc", 2, 2)] = 1
+t[string.sub("xabcd", 2, 4)] = 2
+assert(t.a == 1 and t.abc == 2 and string.char(97) == "a")
+assert(string.byte(string.char(0)) == 0 and #string.char(255) == 1)
+assert(string.sub("hello", 2, 3) == "el" and string.sub("a\0b", 2, 2) == "\0")
+
+-- errors raised while buffers are open, in frames which are gone once caught
+local big = string.rep("ab", 400)
+local function boom(s) if s == "b" then error("boom") end return s end
+for i = 1, 20 do
+  assert(not pcall(string.gsub, big, "%w", boom))
+  assert(not pcall(string.gsub, "xy", "%w", function()
+    string.gsub(big, "%w", boom)
+  end))
+  assert(string.gsub(big, "a", "c") == string.rep("cb", 400))
+end
+local co = coroutine.create(function() string.gsub(big, "%w", boom) end)
+assert(not coroutine.resume(co))
+assert(table.concat({big, big}) == big .. big)